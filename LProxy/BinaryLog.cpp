@@ -0,0 +1,252 @@
+#include "BinaryLog.h"
+
+#include <chrono>
+#include <cstring>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#else
+#include <windows.h>
+#endif
+
+BinaryLogWriter::BinaryLogWriter()
+	: SegmentSize(BINARY_LOG_SEGMENT_SIZE)
+	, SegmentIndex(0)
+	, WallClockMicros(0)
+	, SteadyClock(0)
+	, MappedData(nullptr)
+	, WriteOffset(0)
+#ifdef __linux__
+	, FileHandle(-1)
+#else
+	, FileHandle(nullptr)
+	, MappingHandle(nullptr)
+#endif
+	, NextFormatId(0)
+{
+
+}
+
+BinaryLogWriter::~BinaryLogWriter()
+{
+	Close();
+}
+
+bool BinaryLogWriter::Open(const std::string& InBasePath, size_t InSegmentSize, int64_t InWallClockMicros, int64_t InSteadyClock)
+{
+	bool bReopen = !BasePath.empty() && InBasePath == BasePath;
+	Close();
+
+	// Reopening the same log continues with the next segment instead of overwriting the first one.
+	SegmentIndex = bReopen ? SegmentIndex + 1 : 0;
+	BasePath = InBasePath;
+	SegmentSize = InSegmentSize < BINARY_LOG_MIN_SEGMENT_SIZE ? BINARY_LOG_MIN_SEGMENT_SIZE : InSegmentSize;
+	WallClockMicros = InWallClockMicros;
+	SteadyClock = InSteadyClock;
+
+	return OpenSegment();
+}
+
+void BinaryLogWriter::Close()
+{
+	CloseSegment();
+}
+
+std::string BinaryLogWriter::GetSegmentPath(uint32_t Index) const
+{
+	return BasePath + "." + std::to_string(Index) + BINARY_LOG_EXT;
+}
+
+bool BinaryLogWriter::Rotate()
+{
+	if (!IsOpen()) {
+		return false;
+	}
+
+	CloseSegment();
+
+	SegmentIndex++;
+	return OpenSegment();
+}
+
+bool BinaryLogWriter::WriteRecord(int Level, const char* Format, const char* Signature, int64_t Timestamp, const char* Args, uint32_t ArgSize)
+{
+	if (!IsOpen()) {
+		return false;
+	}
+
+	size_t formatSize = sizeof(BinaryLogEntry) + sizeof(uint32_t) + std::strlen(Signature) + std::strlen(Format) + 2;
+	size_t recordSize = sizeof(BinaryLogEntry) + sizeof(uint32_t) * 2 + sizeof(int64_t) + ArgSize;
+
+	// Room for the definition too, a new segment defines its formats again.
+	bool bDefined = FormatIds.count(Format) != 0;
+	if (!EnsureSpace(recordSize + (bDefined ? 0 : formatSize))) {
+		return false;
+	}
+
+	auto format = FormatIds.find(Format);
+	if (format == FormatIds.end()) {
+		uint32_t formatId = NextFormatId++;
+		format = FormatIds.emplace(Format, formatId).first;
+
+		std::string definition(Signature);
+		definition.push_back('\0');
+		definition.append(Format);
+		definition.push_back('\0');
+
+		WriteEntry(EBinaryLogEntry::Format, 0, &formatId, sizeof(formatId), definition.data(), definition.size());
+	}
+
+	char head[sizeof(uint32_t) * 2 + sizeof(int64_t)] = { 0 };
+	std::memcpy(head, &format->second, sizeof(uint32_t));
+	std::memcpy(head + sizeof(uint32_t) * 2, &Timestamp, sizeof(Timestamp));
+
+	WriteEntry(EBinaryLogEntry::Record, Level, head, sizeof(head), Args, ArgSize);
+	return true;
+}
+
+bool BinaryLogWriter::WriteDropped(int64_t Timestamp, uint64_t Count)
+{
+	if (!IsOpen() || !EnsureSpace(sizeof(BinaryLogEntry) + sizeof(Timestamp) + sizeof(Count))) {
+		return false;
+	}
+
+	WriteEntry(EBinaryLogEntry::Dropped, 0, &Timestamp, sizeof(Timestamp), &Count, sizeof(Count));
+	return true;
+}
+
+bool BinaryLogWriter::OpenSegment()
+{
+	std::string path = GetSegmentPath(SegmentIndex);
+
+#ifdef __linux__
+	FileHandle = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (FileHandle < 0) {
+		return false;
+	}
+
+	if (ftruncate(FileHandle, static_cast<off_t>(SegmentSize)) != 0) {
+		CloseSegment();
+		return false;
+	}
+
+	void* mapped = mmap(nullptr, SegmentSize, PROT_READ | PROT_WRITE, MAP_SHARED, FileHandle, 0);
+	if (mapped == MAP_FAILED) {
+		CloseSegment();
+		return false;
+	}
+
+	MappedData = static_cast<char*>(mapped);
+#else
+	FileHandle = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (FileHandle == INVALID_HANDLE_VALUE) {
+		FileHandle = nullptr;
+		return false;
+	}
+
+	uint64_t mappingSize = static_cast<uint64_t>(SegmentSize);
+	MappingHandle = CreateFileMappingA(FileHandle, nullptr, PAGE_READWRITE, static_cast<DWORD>(mappingSize >> 32), static_cast<DWORD>(mappingSize & 0xFFFFFFFF), nullptr);
+	if (MappingHandle == nullptr) {
+		CloseSegment();
+		return false;
+	}
+
+	MappedData = static_cast<char*>(MapViewOfFile(MappingHandle, FILE_MAP_WRITE, 0, 0, SegmentSize));
+	if (MappedData == nullptr) {
+		CloseSegment();
+		return false;
+	}
+#endif
+
+	BinaryLogHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.Magic, BINARY_LOG_MAGIC, sizeof(header.Magic));
+	header.Version = BINARY_LOG_VERSION;
+	header.Segment = SegmentIndex;
+	header.WallClockMicros = WallClockMicros;
+	header.SteadyClock = SteadyClock;
+	header.SteadyNumerator = std::chrono::steady_clock::period::num;
+	header.SteadyDenominator = std::chrono::steady_clock::period::den;
+
+	std::memcpy(MappedData, &header, sizeof(header));
+	WriteOffset = sizeof(header);
+
+	FormatIds.clear();
+	NextFormatId = 0;
+	return true;
+}
+
+void BinaryLogWriter::CloseSegment()
+{
+#ifdef __linux__
+	if (MappedData != nullptr) {
+		munmap(MappedData, SegmentSize);
+	}
+
+	if (FileHandle >= 0) {
+		// Drop the unused tail, the decoder stops at the end of the file.
+		if (MappedData != nullptr && ftruncate(FileHandle, static_cast<off_t>(WriteOffset)) != 0) {
+			// The zeroed tail stays, it reads as an End entry.
+		}
+
+		close(FileHandle);
+		FileHandle = -1;
+	}
+#else
+	if (MappedData != nullptr) {
+		UnmapViewOfFile(MappedData);
+	}
+
+	if (MappingHandle != nullptr) {
+		CloseHandle(MappingHandle);
+		MappingHandle = nullptr;
+	}
+
+	if (FileHandle != nullptr) {
+		if (MappedData != nullptr) {
+			LARGE_INTEGER size;
+			size.QuadPart = static_cast<long long>(WriteOffset);
+			SetFilePointerEx(FileHandle, size, nullptr, FILE_BEGIN);
+			SetEndOfFile(FileHandle);
+		}
+
+		CloseHandle(FileHandle);
+		FileHandle = nullptr;
+	}
+#endif
+
+	MappedData = nullptr;
+	WriteOffset = 0;
+}
+
+bool BinaryLogWriter::EnsureSpace(size_t Size)
+{
+	if (Size > SegmentSize - sizeof(BinaryLogHeader)) {
+		return false;
+	}
+
+	if (WriteOffset + Size <= SegmentSize) {
+		return true;
+	}
+
+	return Rotate();
+}
+
+void BinaryLogWriter::WriteEntry(EBinaryLogEntry Type, int Level, const void* Head, size_t HeadSize, const void* Body, size_t BodySize)
+{
+	BinaryLogEntry entry;
+	entry.Type = static_cast<uint16_t>(Type);
+	entry.Level = static_cast<uint16_t>(Level);
+	entry.Size = static_cast<uint32_t>(HeadSize + BodySize);
+
+	char* out = MappedData + WriteOffset;
+	std::memcpy(out, &entry, sizeof(entry));
+	std::memcpy(out + sizeof(entry), Head, HeadSize);
+	if (BodySize > 0) {
+		std::memcpy(out + sizeof(entry) + HeadSize, Body, BodySize);
+	}
+
+	WriteOffset += sizeof(entry) + HeadSize + BodySize;
+}
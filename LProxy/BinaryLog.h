@@ -0,0 +1,140 @@
+#ifndef BINARY_LOG_H
+#define BINARY_LOG_H
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include <unordered_map>
+
+#define BINARY_LOG_MAGIC "LPXBLOG"
+#define BINARY_LOG_VERSION 1
+#define BINARY_LOG_EXT ".blog"
+#define BINARY_LOG_SEGMENT_SIZE (16 * 1024 * 1024)
+#define BINARY_LOG_MIN_SEGMENT_SIZE (64 * 1024)
+
+/**
+* Layout of a binary log segment, every field is in the byte order of the writing host.
+* [BinaryLogHeader][BinaryLogEntry][payload][BinaryLogEntry][payload]...
+* An entry of type End or the end of the file stops the segment.
+* Every segment defines the formats it uses, so it can be decoded on its own.
+*/
+enum class EBinaryLogEntry : uint16_t
+{
+	End = 0,
+
+	// uint32 format id, argument signature and format string, both NUL terminated
+	Format,
+
+	// uint32 format id, uint32 reserved, int64 steady clock timestamp, raw arguments
+	Record,
+
+	// int64 steady clock timestamp, uint64 number of dropped records
+	Dropped,
+};
+
+#pragma pack(push, 1)
+struct BinaryLogHeader
+{
+	char Magic[8];
+
+	uint32_t Version;
+
+	// Index of the segment within the log
+	uint32_t Segment;
+
+	// Wall clock microseconds at the steady clock timestamp below, the decoder derives record times from it.
+	int64_t WallClockMicros;
+	int64_t SteadyClock;
+
+	// Steady clock period in seconds, Numerator / Denominator
+	int64_t SteadyNumerator;
+	int64_t SteadyDenominator;
+};
+
+struct BinaryLogEntry
+{
+	uint16_t Type;
+
+	// Log level of records, 0 for other entries
+	uint16_t Level;
+
+	// Bytes of the payload after this head
+	uint32_t Size;
+};
+#pragma pack(pop)
+
+/**
+* Appends binary log entries to memory-mapped segments of a fixed size.
+* A full segment is truncated to its used size and the next one is started.
+* Written entries survive a crash of the process, the pages belong to the kernel once written.
+* Only the log thread may use it.
+*/
+class BinaryLogWriter
+{
+public:
+	BinaryLogWriter();
+
+	virtual ~BinaryLogWriter();
+
+	/**
+	* @param InBasePath	Path of the log without extension, segments are named <InBasePath>.<index>.blog
+	*/
+	virtual bool Open(const std::string& InBasePath, size_t InSegmentSize, int64_t InWallClockMicros, int64_t InSteadyClock);
+
+	virtual void Close();
+
+	virtual inline bool IsOpen() const { return MappedData != nullptr; }
+
+	// Index of the segment written now, earlier ones are complete.
+	virtual inline uint32_t GetSegmentIndex() const { return SegmentIndex; }
+
+	// Nothing but the header was written to the current segment.
+	virtual inline bool IsEmpty() const { return WriteOffset <= sizeof(BinaryLogHeader); }
+
+	virtual std::string GetSegmentPath(uint32_t Index) const;
+
+	// Close the current segment and start the next one, the writer is closed when that fails.
+	virtual bool Rotate();
+
+	/**
+	* @param Format		Format literal, its pointer identifies it.
+	* @param Signature	Type codes of the arguments, @see EasyLog::LogSignature
+	*/
+	virtual bool WriteRecord(int Level, const char* Format, const char* Signature, int64_t Timestamp, const char* Args, uint32_t ArgSize);
+
+	virtual bool WriteDropped(int64_t Timestamp, uint64_t Count);
+
+protected:
+	virtual bool OpenSegment();
+
+	virtual void CloseSegment();
+
+	// Start the next segment when the bytes don't fit in the current one.
+	virtual bool EnsureSpace(size_t Size);
+
+	virtual void WriteEntry(EBinaryLogEntry Type, int Level, const void* Head, size_t HeadSize, const void* Body, size_t BodySize);
+
+protected:
+	std::string BasePath;
+	size_t SegmentSize;
+	uint32_t SegmentIndex;
+
+	int64_t WallClockMicros;
+	int64_t SteadyClock;
+
+	char* MappedData;
+	size_t WriteOffset;
+
+#ifdef __linux__
+	int FileHandle;
+#else
+	void* FileHandle;
+	void* MappingHandle;
+#endif
+
+	// Formats defined in the current segment
+	std::unordered_map<const char*, uint32_t> FormatIds;
+	uint32_t NextFormatId;
+};
+
+#endif // !BINARY_LOG_H
@@ -0,0 +1,89 @@
+#include "BufferView.h"
+
+#include <cstring>
+
+BufferView::BufferView()
+	: Data(nullptr)
+	, Size(0)
+	, Offset(0)
+{
+
+}
+
+BufferView::BufferView(const char* InData, int InSize)
+	: Data(InData)
+	, Size(InData == nullptr || InSize < 0 ? 0 : InSize)
+	, Offset(0)
+{
+
+}
+
+BufferView::~BufferView()
+{
+
+}
+
+bool BufferView::Read(void* Buffer, int Count)
+{
+	if (!Peek(Buffer, Count)) {
+		return false;
+	}
+
+	Offset += Count;
+	return true;
+}
+
+bool BufferView::Peek(void* Buffer, int Count) const
+{
+	if (Count < 0 || Count > GetRemaining() || (Buffer == nullptr && Count > 0)) {
+		return false;
+	}
+
+	if (Count > 0) {
+		std::memcpy(Buffer, Data + Offset, Count);
+	}
+
+	return true;
+}
+
+bool BufferView::ReadUInt8(uint8_t& Value)
+{
+	return Read(&Value, 1);
+}
+
+bool BufferView::PeekUInt8(uint8_t& Value) const
+{
+	return Peek(&Value, 1);
+}
+
+bool BufferView::ReadUInt16(uint16_t& Value)
+{
+	unsigned char bytes[2];
+	if (!Read(bytes, 2)) {
+		return false;
+	}
+
+	Value = static_cast<uint16_t>((bytes[0] << 8) | bytes[1]);
+	return true;
+}
+
+bool BufferView::Skip(int Count)
+{
+	if (Count < 0 || Count > GetRemaining()) {
+		return false;
+	}
+
+	Offset += Count;
+	return true;
+}
+
+bool BufferView::ReadView(int Count, BufferView& View)
+{
+	if (Count < 0 || Count > GetRemaining()) {
+		return false;
+	}
+
+	View = BufferView(Data + Offset, Count);
+	Offset += Count;
+	return true;
+}
@@ -0,0 +1,49 @@
+#ifndef BUFFER_VIEW_H
+#define BUFFER_VIEW_H
+
+#include <cstdint>
+
+/**
+* Read-only view of bytes owned by someone else.
+* Every read is bounds checked and reports whether it succeeded, a failed read consumes nothing.
+* Fields are copied into caller storage or viewed in place, the reader never allocates.
+*/
+class BufferView
+{
+public:
+	BufferView();
+
+	BufferView(const char* InData, int InSize);
+
+	virtual ~BufferView();
+
+	virtual bool Read(void* Buffer, int Count);
+
+	// Same as Read, but the bytes stay unread.
+	virtual bool Peek(void* Buffer, int Count) const;
+
+	virtual bool ReadUInt8(uint8_t& Value);
+
+	virtual bool PeekUInt8(uint8_t& Value) const;
+
+	// Read a value in network octet order.
+	virtual bool ReadUInt16(uint16_t& Value);
+
+	virtual bool Skip(int Count);
+
+	// View the next bytes in place and consume them.
+	virtual bool ReadView(int Count, BufferView& View);
+
+	virtual inline const char* GetData() const { return Data + Offset; }
+
+	virtual inline int GetOffset() const { return Offset; }
+
+	virtual inline int GetRemaining() const { return Size - Offset; }
+
+protected:
+	const char* Data;
+	int Size;
+	int Offset;
+};
+
+#endif // !BUFFER_VIEW_H
@@ -0,0 +1,81 @@
+#include "ConnectionTask.h"
+#include "MemoryPool.h"
+
+#include <utility>
+
+// Size classes of pooled frames, bigger ones come from the global allocator.
+#define CONNECTION_TASK_SMALL_FRAME 512
+#define CONNECTION_TASK_LARGE_FRAME 2048
+
+void* ConnectionTask::promise_type::operator new(size_t Size)
+{
+	if (Size <= CONNECTION_TASK_SMALL_FRAME) {
+		return ThreadBlockCache<CONNECTION_TASK_SMALL_FRAME>::Allocate(MemoryPool::FrameCounters);
+	}
+
+	if (Size <= CONNECTION_TASK_LARGE_FRAME) {
+		return ThreadBlockCache<CONNECTION_TASK_LARGE_FRAME>::Allocate(MemoryPool::FrameCounters);
+	}
+
+	return ::operator new(Size);
+}
+
+void ConnectionTask::promise_type::operator delete(void* Frame, size_t Size)
+{
+	if (Size <= CONNECTION_TASK_SMALL_FRAME) {
+		ThreadBlockCache<CONNECTION_TASK_SMALL_FRAME>::Free(Frame, MemoryPool::FrameCounters);
+		return;
+	}
+
+	if (Size <= CONNECTION_TASK_LARGE_FRAME) {
+		ThreadBlockCache<CONNECTION_TASK_LARGE_FRAME>::Free(Frame, MemoryPool::FrameCounters);
+		return;
+	}
+
+	::operator delete(Frame);
+}
+
+ConnectionTask::ConnectionTask()
+	: Handle(nullptr)
+{
+
+}
+
+ConnectionTask::ConnectionTask(std::coroutine_handle<promise_type> InHandle)
+	: Handle(InHandle)
+{
+
+}
+
+ConnectionTask::ConnectionTask(ConnectionTask&& Other) noexcept
+	: Handle(std::exchange(Other.Handle, nullptr))
+{
+
+}
+
+ConnectionTask& ConnectionTask::operator=(ConnectionTask&& Other) noexcept
+{
+	if (this != &Other) {
+		if (Handle) {
+			Handle.destroy();
+		}
+
+		Handle = std::exchange(Other.Handle, nullptr);
+	}
+
+	return *this;
+}
+
+ConnectionTask::~ConnectionTask()
+{
+	if (Handle) {
+		Handle.destroy();
+	}
+}
+
+void ConnectionTask::Resume()
+{
+	if (!IsDone()) {
+		Handle.resume();
+	}
+}
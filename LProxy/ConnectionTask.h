@@ -0,0 +1,77 @@
+#ifndef CONNECTION_TASK_H
+#define CONNECTION_TASK_H
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+
+/**
+* Coroutine of a connection lifecycle, @see ProxyContext::RunConnection
+* It starts suspended and is only resumed by the loop thread of its context,
+* a frame which is still suspended is destroyed with its task.
+*/
+class ConnectionTask
+{
+public:
+	struct promise_type
+	{
+		ConnectionTask get_return_object() { return ConnectionTask(std::coroutine_handle<promise_type>::from_promise(*this)); }
+
+		std::suspend_always initial_suspend() noexcept { return {}; }
+
+		// Kept until the task goes, so a finished lifecycle is never resumed again.
+		std::suspend_always final_suspend() noexcept { return {}; }
+
+		void return_void() {}
+
+		void unhandled_exception() { std::terminate(); }
+
+		// Frames are pooled per thread like the contexts owning them, @see ThreadBlockCache
+		static void* operator new(size_t Size);
+
+		static void operator delete(void* Frame, size_t Size);
+	};
+
+	ConnectionTask();
+
+	explicit ConnectionTask(std::coroutine_handle<promise_type> InHandle);
+
+	ConnectionTask(ConnectionTask&& Other) noexcept;
+
+	ConnectionTask& operator=(ConnectionTask&& Other) noexcept;
+
+	ConnectionTask(const ConnectionTask&) = delete;
+
+	ConnectionTask& operator=(const ConnectionTask&) = delete;
+
+	virtual ~ConnectionTask();
+
+	// Continue until the next suspension, nothing happens once it's done.
+	virtual void Resume();
+
+	virtual inline bool IsDone() const { return !Handle || Handle.done(); }
+
+protected:
+	std::coroutine_handle<promise_type> Handle;
+};
+
+/**
+* Suspends until the owner of the task resumes it, then yields the value the owner stored for it.
+*/
+template<typename T>
+class ResumeAwaiter
+{
+public:
+	explicit ResumeAwaiter(const T& InValue) : Value(InValue) {}
+
+	bool await_ready() const noexcept { return false; }
+
+	void await_suspend(std::coroutine_handle<>) const noexcept {}
+
+	T await_resume() const { return Value; }
+
+protected:
+	const T& Value;
+};
+
+#endif // !CONNECTION_TASK_H
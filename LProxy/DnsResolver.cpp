@@ -0,0 +1,478 @@
+#include "DnsResolver.h"
+#include "EasyLog.h"
+
+#include <algorithm>
+#include <random>
+#include <thread>
+#include <cstring>
+
+#define DNS_HEADER_SIZE 12
+#define DNS_PACKET_SIZE 1232
+#define DNS_TYPE_A 1
+#define DNS_TYPE_AAAA 28
+#define DNS_CLASS_IN 1
+
+std::once_flag DnsResolver::InstanceOnceFlag;
+std::shared_ptr<DnsResolver> DnsResolver::Instance;
+
+namespace
+{
+	uint16_t ReadUInt16(const char* Data)
+	{
+		return static_cast<uint16_t>((static_cast<unsigned char>(Data[0]) << 8) | static_cast<unsigned char>(Data[1]));
+	}
+
+	uint32_t ReadUInt32(const char* Data)
+	{
+		return (static_cast<uint32_t>(ReadUInt16(Data)) << 16) | ReadUInt16(Data + 2);
+	}
+
+	void WriteUInt16(char* Data, uint16_t Value)
+	{
+		Data[0] = static_cast<char>(Value >> 8);
+		Data[1] = static_cast<char>(Value & 0xff);
+	}
+
+	// Skip a possibly compressed name, returns the offset after it or -1 when it runs past the packet.
+	int SkipName(const char* Buffer, int Len, int Offset)
+	{
+		while (Offset < Len)
+		{
+			unsigned char labelLen = static_cast<unsigned char>(Buffer[Offset]);
+			if (labelLen == 0) {
+				return Offset + 1;
+			}
+
+			if ((labelLen & 0xc0) == 0xc0) {
+				return Offset + 2 <= Len ? Offset + 2 : -1;
+			}
+
+			Offset += labelLen + 1;
+		}
+
+		return -1;
+	}
+}
+
+DnsResolver::DnsResolver()
+	: ThreadNum(DNS_THREAD_NUM)
+	, TimeoutMsec(DNS_TIMEOUT_MSEC)
+	, DefaultTTL(DNS_DEFAULT_TTL_SEC)
+	, NegativeTTL(DNS_NEGATIVE_TTL_SEC)
+	, MaxEntriesPerShard(DNS_CACHE_MAX_ENTRIES / DNS_CACHE_SHARDS)
+{
+
+}
+
+DnsResolver::~DnsResolver()
+{
+
+}
+
+std::shared_ptr<DnsResolver> DnsResolver::Get()
+{
+	std::call_once(InstanceOnceFlag,
+	[&]()
+	{
+		Instance = std::make_shared<DnsResolver>();
+	});
+
+	return Instance;
+}
+
+void DnsResolver::Configure(int InThreadNum, const std::string& InServer, int InTimeoutMsec, int InDefaultTTL, int InNegativeTTL, int InMaxEntries)
+{
+	ThreadNum = std::max(InThreadNum, 1);
+	Server = InServer;
+	TimeoutMsec = std::max(InTimeoutMsec, 1);
+	DefaultTTL = std::max(InDefaultTTL, 0);
+	NegativeTTL = std::max(InNegativeTTL, 0);
+	MaxEntriesPerShard = std::max(InMaxEntries / DNS_CACHE_SHARDS, 1);
+}
+
+bool DnsResolver::Lookup(const std::string& HostName, ResolveResult& Result)
+{
+	CacheShard& shard = GetShard(HostName);
+	std::lock_guard<std::mutex> shardScope(shard.ShardLock);
+
+	auto entry = shard.Entries.find(HostName);
+	if (entry == shard.Entries.end()) {
+		return false;
+	}
+
+	if (entry->second.Expire <= std::chrono::steady_clock::now()) {
+		shard.Entries.erase(entry);
+		return false;
+	}
+
+	Result = entry->second.Result;
+	return true;
+}
+
+void DnsResolver::ResolveAsync(const std::string& HostName, ResolveCallback Callback)
+{
+	ResolveResult cached;
+	if (Lookup(HostName, cached)) {
+		Callback(cached);
+		return;
+	}
+
+	std::call_once(ThreadOnceFlag, [this]() { StartThreads(); });
+
+	CacheShard& shard = GetShard(HostName);
+	{
+		std::lock_guard<std::mutex> shardScope(shard.ShardLock);
+
+		auto pending = shard.Pending.find(HostName);
+		if (pending != shard.Pending.end()) {
+			pending->second.push_back(std::move(Callback));
+			return;
+		}
+
+		shard.Pending[HostName].push_back(std::move(Callback));
+	}
+
+	{
+		std::lock_guard<std::mutex> jobScope(JobLock);
+		Jobs.push_back(HostName);
+	}
+
+	JobCondition.notify_one();
+}
+
+void DnsResolver::StartThreads()
+{
+	LOG(Log, "Will create %d dns resolver threads.", ThreadNum);
+
+	for (int index = 0; index < ThreadNum; index++)
+	{
+		std::thread(
+		[this]()
+		{
+			ProcessJobs();
+		}).detach();
+	}
+}
+
+void DnsResolver::ProcessJobs()
+{
+	while (true)
+	{
+		std::string hostName;
+		{
+			std::unique_lock<std::mutex> jobScope(JobLock);
+			JobCondition.wait(jobScope, [this]() { return !Jobs.empty(); });
+
+			hostName = std::move(Jobs.front());
+			Jobs.pop_front();
+		}
+
+		int ttl(0);
+		ResolveResult result = Server.empty() ? ResolveBySystem(hostName, ttl) : ResolveByServer(hostName, ttl);
+
+		std::vector<ResolveCallback> callbacks;
+
+		CacheShard& shard = GetShard(hostName);
+		{
+			std::lock_guard<std::mutex> shardScope(shard.ShardLock);
+
+			Store(shard, hostName, result, ttl);
+
+			auto pending = shard.Pending.find(hostName);
+			if (pending != shard.Pending.end()) {
+				callbacks.swap(pending->second);
+				shard.Pending.erase(pending);
+			}
+		}
+
+		for (const ResolveCallback& callback : callbacks)
+		{
+			callback(result);
+		}
+	}
+}
+
+DnsResolver::CacheShard& DnsResolver::GetShard(const std::string& HostName)
+{
+	return Shards[std::hash<std::string>()(HostName) % DNS_CACHE_SHARDS];
+}
+
+void DnsResolver::Store(CacheShard& Shard, const std::string& HostName, const ResolveResult& Result, int TTL)
+{
+	if (TTL <= 0) {
+		return;
+	}
+
+	auto now = std::chrono::steady_clock::now();
+
+	if (static_cast<int>(Shard.Entries.size()) >= MaxEntriesPerShard) {
+		for (auto entry = Shard.Entries.begin(); entry != Shard.Entries.end();)
+		{
+			entry = entry->second.Expire <= now ? Shard.Entries.erase(entry) : std::next(entry);
+		}
+
+		if (static_cast<int>(Shard.Entries.size()) >= MaxEntriesPerShard) {
+			Shard.Entries.erase(Shard.Entries.begin());
+		}
+	}
+
+	CacheEntry& entry = Shard.Entries[HostName];
+	entry.Result = Result;
+	entry.Expire = now + std::chrono::seconds(TTL);
+}
+
+ResolveResult DnsResolver::ResolveBySystem(const std::string& HostName, int& TTL)
+{
+	ResolveResult result;
+
+	ADDRINFO info, * addrs;
+	std::memset(&info, 0, sizeof(ADDRINFO));
+	info.ai_socktype = SOCK_STREAM;
+	info.ai_family = AF_UNSPEC;
+
+	result.Error = getaddrinfo(HostName.c_str(), nullptr, &info, &addrs);
+	if (result.Error != 0) {
+		LOG(Warning, "Convert hostname %s to ip address failed, err: %s.", HostName.c_str(), MiscHelper::GetAddressInfoError(result.Error));
+		TTL = NegativeTTL;
+		return result;
+	}
+
+	for (ADDRINFO* entry = addrs; entry != nullptr; entry = entry->ai_next)
+	{
+		if (entry->ai_family != AF_INET && entry->ai_family != AF_INET6) {
+			continue;
+		}
+
+		SOCKADDR_STORAGE addr;
+		std::memset(&addr, 0, sizeof(addr));
+		std::memcpy(&addr, entry->ai_addr, std::min(sizeof(addr), static_cast<size_t>(entry->ai_addrlen)));
+		result.Addresses.push_back(addr);
+	}
+
+	freeaddrinfo(addrs);
+
+	// getaddrinfo doesn't report record TTLs.
+	TTL = result.Addresses.empty() ? NegativeTTL : DefaultTTL;
+	return result;
+}
+
+ResolveResult DnsResolver::ResolveByServer(const std::string& HostName, int& TTL)
+{
+	SOCKADDR_IN serverAddr;
+	std::memset(&serverAddr, 0, sizeof(serverAddr));
+	serverAddr.sin_family = AF_INET;
+	serverAddr.sin_port = htons(DNS_PORT);
+	if (inet_pton(AF_INET, Server.c_str(), &serverAddr.sin_addr) != 1) {
+		LOG(Error, "Wrong dns server address %s, use system resolver.", Server.c_str());
+		return ResolveBySystem(HostName, TTL);
+	}
+
+	SOCKET sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sock == INVALID_SOCKET) {
+		return ResolveBySystem(HostName, TTL);
+	}
+
+#ifdef __linux__
+	timeval timeout = { TimeoutMsec / 1000, (TimeoutMsec % 1000) * 1000 };
+#else
+	DWORD timeout = static_cast<DWORD>(TimeoutMsec);
+#endif
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+
+	// A connected socket only receives datagrams of the server, so answers can't be injected from other sources.
+	if (connect(sock, (SOCKADDR*)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR) {
+		MiscHelper::CloseSocket(sock);
+		return ResolveBySystem(HostName, TTL);
+	}
+
+	static thread_local std::mt19937 generator(std::random_device{}());
+	uint16_t ids[2] = { static_cast<uint16_t>(generator()), static_cast<uint16_t>(generator()) };
+	uint16_t types[2] = { DNS_TYPE_AAAA, DNS_TYPE_A };
+
+	char buffer[DNS_PACKET_SIZE];
+	for (int index = 0; index < 2; index++)
+	{
+		int queryLen = BuildQuery(buffer, DNS_PACKET_SIZE, ids[index], HostName, types[index]);
+		if (queryLen <= 0 || send(sock, buffer, queryLen, 0) == SOCKET_ERROR) {
+			MiscHelper::CloseSocket(sock);
+			return ResolveBySystem(HostName, TTL);
+		}
+	}
+
+	ResolveResult result;
+	TTL = DNS_MAX_TTL_SEC;
+
+	// Rcode of the first failed answer, reported when neither answer has an address.
+	int failedCode(0);
+
+	bool bAnswered[2] = { false, false };
+	while (!bAnswered[0] || !bAnswered[1])
+	{
+		int recvLen = recv(sock, buffer, DNS_PACKET_SIZE, 0);
+		if (recvLen <= 0) {
+			break;
+		}
+
+		if (recvLen < DNS_HEADER_SIZE) {
+			continue;
+		}
+
+		uint16_t id = ReadUInt16(buffer);
+		int index = (id == ids[0]) ? 0 : ((id == ids[1]) ? 1 : -1);
+		if (index < 0 || bAnswered[index]) {
+			continue;
+		}
+
+		bAnswered[index] = true;
+
+		ResolveResult answer;
+		int answerTTL(0);
+		if (!ParseResponse(buffer, recvLen, id, answer, answerTTL)) {
+			// Truncated or malformed answer, let the system resolver retry the whole name.
+			MiscHelper::CloseSocket(sock);
+			return ResolveBySystem(HostName, TTL);
+		}
+
+		if (answer.Error != 0 && failedCode == 0) {
+			failedCode = answer.Error;
+		}
+
+		if (answer.Error == 0 && !answer.Addresses.empty()) {
+			result.Addresses.insert(result.Addresses.end(), answer.Addresses.begin(), answer.Addresses.end());
+			TTL = std::min(TTL, answerTTL);
+		}
+	}
+
+	MiscHelper::CloseSocket(sock);
+
+	if (!bAnswered[0] && !bAnswered[1]) {
+		LOG(Warning, "Dns server %s didn't answer %s in time, use system resolver.", Server.c_str(), HostName.c_str());
+		return ResolveBySystem(HostName, TTL);
+	}
+
+	if (result.Addresses.empty()) {
+		result.Error = failedCode;
+		LOG(Warning, "Dns server %s has no address for %s, rcode: %d.", Server.c_str(), HostName.c_str(), failedCode);
+		TTL = NegativeTTL;
+	}
+
+	return result;
+}
+
+int DnsResolver::BuildQuery(char* Buffer, int BufferLen, uint16_t Id, const std::string& HostName, uint16_t Type)
+{
+	// Header, the name with a length octet per label and the root label, type and class
+	int queryLen = DNS_HEADER_SIZE + static_cast<int>(HostName.size()) + 2 + 4;
+	if (queryLen > BufferLen) {
+		return -1;
+	}
+
+	std::memset(Buffer, 0, DNS_HEADER_SIZE);
+	WriteUInt16(Buffer, Id);
+	WriteUInt16(Buffer + 2, 0x0100);
+	WriteUInt16(Buffer + 4, 1);
+
+	int offset = DNS_HEADER_SIZE;
+	size_t labelBegin = 0;
+	while (labelBegin <= HostName.size())
+	{
+		size_t labelEnd = HostName.find('.', labelBegin);
+		if (labelEnd == std::string::npos) {
+			labelEnd = HostName.size();
+		}
+
+		size_t labelLen = labelEnd - labelBegin;
+		if (labelLen > 63) {
+			return -1;
+		}
+
+		// Trailing dot of a fully qualified name
+		if (labelLen == 0) {
+			if (labelEnd == HostName.size()) {
+				break;
+			}
+			return -1;
+		}
+
+		Buffer[offset++] = static_cast<char>(labelLen);
+		std::memcpy(Buffer + offset, HostName.data() + labelBegin, labelLen);
+		offset += static_cast<int>(labelLen);
+
+		labelBegin = labelEnd + 1;
+	}
+
+	Buffer[offset++] = 0;
+	WriteUInt16(Buffer + offset, Type);
+	WriteUInt16(Buffer + offset + 2, DNS_CLASS_IN);
+	offset += 4;
+
+	return offset;
+}
+
+bool DnsResolver::ParseResponse(const char* Buffer, int Len, uint16_t Id, ResolveResult& Result, int& TTL)
+{
+	uint16_t flags = ReadUInt16(Buffer + 2);
+	if (ReadUInt16(Buffer) != Id || (flags & 0x8000) == 0 || (flags & 0x0200) != 0) {
+		return false;
+	}
+
+	Result.Error = flags & 0x000f;
+	TTL = DNS_MAX_TTL_SEC;
+	if (Result.Error != 0) {
+		return true;
+	}
+
+	int questionNum = ReadUInt16(Buffer + 4);
+	int answerNum = ReadUInt16(Buffer + 6);
+
+	int offset = DNS_HEADER_SIZE;
+	for (int index = 0; index < questionNum; index++)
+	{
+		offset = SkipName(Buffer, Len, offset);
+		if (offset < 0 || offset + 4 > Len) {
+			return false;
+		}
+		offset += 4;
+	}
+
+	for (int index = 0; index < answerNum; index++)
+	{
+		offset = SkipName(Buffer, Len, offset);
+		if (offset < 0 || offset + 10 > Len) {
+			return false;
+		}
+
+		uint16_t type = ReadUInt16(Buffer + offset);
+		uint16_t recordClass = ReadUInt16(Buffer + offset + 2);
+		uint32_t recordTTL = ReadUInt32(Buffer + offset + 4);
+		uint16_t dataLen = ReadUInt16(Buffer + offset + 8);
+		offset += 10;
+
+		if (offset + dataLen > Len) {
+			return false;
+		}
+
+		if (recordClass == DNS_CLASS_IN && ((type == DNS_TYPE_A && dataLen == 4) || (type == DNS_TYPE_AAAA && dataLen == 16))) {
+			SOCKADDR_STORAGE addr;
+			std::memset(&addr, 0, sizeof(addr));
+
+			if (type == DNS_TYPE_A) {
+				SOCKADDR_IN* addrIn = (SOCKADDR_IN*)&addr;
+				addrIn->sin_family = AF_INET;
+				std::memcpy(&addrIn->sin_addr, Buffer + offset, 4);
+			}
+			else {
+				SOCKADDR_IN6* addrIn6 = (SOCKADDR_IN6*)&addr;
+				addrIn6->sin6_family = AF_INET6;
+				std::memcpy(&addrIn6->sin6_addr, Buffer + offset, 16);
+			}
+
+			Result.Addresses.push_back(addr);
+			TTL = std::min(TTL, static_cast<int>(std::min<uint32_t>(recordTTL, DNS_MAX_TTL_SEC)));
+		}
+
+		offset += dataLen;
+	}
+
+	return true;
+}
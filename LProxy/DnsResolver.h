@@ -0,0 +1,118 @@
+#ifndef DNS_RESOLVER_H
+#define DNS_RESOLVER_H
+
+#include "PlatformSocket.h"
+
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+
+#define DNS_CACHE_SHARDS 16
+#define DNS_CACHE_MAX_ENTRIES 16384
+#define DNS_THREAD_NUM 4
+#define DNS_TIMEOUT_MSEC 2000
+#define DNS_DEFAULT_TTL_SEC 60
+#define DNS_NEGATIVE_TTL_SEC 10
+#define DNS_MAX_TTL_SEC 3600
+#define DNS_PORT 53
+
+struct ResolveResult
+{
+	// 0 when succeeded, otherwise a getaddrinfo error or DNS response code
+	int Error{0};
+
+	// Addresses without port
+	std::vector<SOCKADDR_STORAGE> Addresses;
+};
+
+using ResolveCallback = std::function<void(const ResolveResult&)>;
+
+/**
+* Resolves domain names on a small pool of threads and caches the answers.
+* [DnsServer set]	A and AAAA queries are sent to the server over UDP, answers live as long as their TTL.
+* [Otherwise]		getaddrinfo, answers live for the configured default TTL.
+* Failed lookups are cached for the negative TTL, lookups of a name already in flight wait for it.
+*/
+class DnsResolver
+{
+public:
+	DnsResolver();
+
+	virtual ~DnsResolver();
+
+	static std::shared_ptr<DnsResolver> Get();
+
+	/**
+	* Must be called before the first lookup.
+	* @param InServer	IPv4 address of the DNS server, empty to use the system resolver.
+	*/
+	virtual void Configure(int InThreadNum, const std::string& InServer, int InTimeoutMsec, int InDefaultTTL, int InNegativeTTL, int InMaxEntries);
+
+	// Look up the cache only, never blocks on the network.
+	virtual bool Lookup(const std::string& HostName, ResolveResult& Result);
+
+	// Callback runs on a resolver thread, or in place when the answer is cached.
+	virtual void ResolveAsync(const std::string& HostName, ResolveCallback Callback);
+
+protected:
+	struct CacheEntry
+	{
+		ResolveResult Result;
+
+		std::chrono::steady_clock::time_point Expire;
+	};
+
+	struct CacheShard
+	{
+		std::mutex ShardLock;
+
+		std::unordered_map<std::string, CacheEntry> Entries;
+
+		// Lookups in flight and the callbacks waiting for them
+		std::unordered_map<std::string, std::vector<ResolveCallback>> Pending;
+	};
+
+	virtual void StartThreads();
+
+	virtual void ProcessJobs();
+
+	virtual CacheShard& GetShard(const std::string& HostName);
+
+	virtual void Store(CacheShard& Shard, const std::string& HostName, const ResolveResult& Result, int TTL);
+
+	virtual ResolveResult ResolveBySystem(const std::string& HostName, int& TTL);
+
+	virtual ResolveResult ResolveByServer(const std::string& HostName, int& TTL);
+
+	virtual int BuildQuery(char* Buffer, int BufferLen, uint16_t Id, const std::string& HostName, uint16_t Type);
+
+	virtual bool ParseResponse(const char* Buffer, int Len, uint16_t Id, ResolveResult& Result, int& TTL);
+
+protected:
+	static std::once_flag InstanceOnceFlag;
+	static std::shared_ptr<DnsResolver> Instance;
+
+	CacheShard Shards[DNS_CACHE_SHARDS];
+
+	std::deque<std::string> Jobs;
+	std::mutex JobLock;
+	std::condition_variable JobCondition;
+
+	std::once_flag ThreadOnceFlag;
+
+	int ThreadNum;
+	std::string Server;
+	int TimeoutMsec;
+	int DefaultTTL;
+	int NegativeTTL;
+	int MaxEntriesPerShard;
+};
+
+#endif // !DNS_RESOLVER_H
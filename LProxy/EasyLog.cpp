@@ -1,11 +1,34 @@
 #include "EasyLog.h"
 
+#include <ctime>
+#include <cstdlib>
+#include <algorithm>
+
 std::once_flag IEasyLog::InstanceFlag;
 std::shared_ptr<IEasyLog> IEasyLog::Instance = nullptr;
+std::atomic<int> IEasyLog::MinLevel(static_cast<int>(ELogLevel::Display));
+
+namespace
+{
+	// Hands the ring back to the log thread when its thread exits.
+	struct ThreadRingHolder
+	{
+		std::shared_ptr<LogRing> Ring;
+
+		~ThreadRingHolder()
+		{
+			if (Ring != nullptr) {
+				Ring->SetDetached();
+			}
+		}
+	};
+
+	thread_local ThreadRingHolder ThreadRing;
+}
 
 std::shared_ptr<IEasyLog> IEasyLog::Get()
 {
-	std::call_once (InstanceFlag, 
+	std::call_once (InstanceFlag,
 	[]()
 	{
 		Instance = std::make_shared<IEasyLog>();
@@ -15,23 +38,588 @@ std::shared_ptr<IEasyLog> IEasyLog::Get()
 }
 
 IEasyLog::IEasyLog()
+	: bFileSettingsChanged(false)
+	, FileSize(0)
+	, FileOpenTime(0)
+	, LastFileWrite(0)
+	, RotateIndex(0)
+	, bPruneRequested(false)
+	, bFileThreadStopping(false)
+	, WallClockBase(0)
+	, SteadyClockBase(0)
+	, bBinaryRequested(false)
+	, BinarySegmentSize(BINARY_LOG_SEGMENT_SIZE)
+	, bBinaryActive(false)
+	, BinarySegment(0)
+	, BinaryOpenTime(0)
+	, RingVersion(0)
+	, DroppedNum(0)
+	, bRunning(true)
+	, bWakeupRequested(false)
+	, FlushRequested(0)
+	, FlushDone(0)
+	, ConsoleColor(EasyLog::White)
+	, TimeTextSecond(-1)
 {
 	std::string time = MiscHelper::GetDateTime();
 
+	WallClockBase = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	SteadyClockBase = std::chrono::steady_clock::now().time_since_epoch().count();
+
 	std::filesystem::path logPath(EasyLog::EASY_Log_Dir);
 	if (!std::filesystem::exists(logPath)) {
 		std::filesystem::create_directories(logPath);
 	}
-	
-	logPath += "/" + time + EasyLog::EASY_Log_Ext;
-	LogFile.open(std::filesystem::absolute(logPath), std::ios::out);
+
+	logPath += "/" + time;
+	LogBasePath = std::filesystem::absolute(logPath).string();
+
+	LogFile.open(LogBasePath + EasyLog::EASY_Log_Ext, std::ios::out);
+	FileOpenTime = SteadyClockBase;
+	LastFileWrite = SteadyClockBase;
+
+	LogThread = std::thread(&IEasyLog::ProcessRecords, this);
 }
 
 IEasyLog::~IEasyLog()
 {
+	bRunning = false;
+	Wakeup();
+
+	if (LogThread.joinable()) {
+		LogThread.join();
+	}
+
+	// The last pass of the log thread may have rotated a file too.
+	{
+		std::lock_guard<std::mutex> fileScope(FileLock);
+		bFileThreadStopping = true;
+	}
+	FileCondition.notify_one();
+
+	if (FileThread.joinable()) {
+		FileThread.join();
+	}
+
+	BinaryWriter.Close();
 	LogFile.close();
 }
 
+void IEasyLog::Flush()
+{
+	std::unique_lock<std::mutex> wakeScope(WakeLock);
+
+	uint64_t request = FlushRequested.fetch_add(1) + 1;
+	WakeCondition.notify_one();
+
+	// Bounded, a record logged while the log thread is already gone must not hang the caller.
+	FlushCondition.wait_for(wakeScope, std::chrono::seconds(1),
+	[this, request]()
+	{
+		return FlushDone >= request || !bRunning;
+	});
+}
+
+void IEasyLog::SetBinaryMode(bool bBinary, size_t SegmentSize /*= BINARY_LOG_SEGMENT_SIZE*/)
+{
+	BinarySegmentSize = SegmentSize;
+	bBinaryRequested = bBinary;
+	Wakeup();
+}
+
+void IEasyLog::SetFileSettings(const EasyLog::LogFileSettings& Settings)
+{
+	{
+		std::lock_guard<std::mutex> settingsScope(SettingsLock);
+		PendingFileSettings = Settings;
+	}
+
+	bFileSettingsChanged = true;
+	Wakeup();
+}
+
+LogRing* IEasyLog::GetThreadRing()
+{
+	if (ThreadRing.Ring == nullptr) {
+		ThreadRing.Ring = std::make_shared<LogRing>(EASY_LOG_RING_SIZE);
+
+		std::lock_guard<std::mutex> ringScope(RingLock);
+		Rings.push_back(ThreadRing.Ring);
+		RingVersion.fetch_add(1, std::memory_order_release);
+	}
+
+	return ThreadRing.Ring.get();
+}
+
+void IEasyLog::Wakeup()
+{
+	bWakeupRequested.store(true, std::memory_order_release);
+	WakeCondition.notify_one();
+}
+
+void IEasyLog::ProcessRecords()
+{
+	std::vector<std::shared_ptr<LogRing>> rings;
+	size_t ringVersion(0);
+
+	while (true)
+	{
+		bool bStopping = !bRunning;
+		uint64_t flushRequest = FlushRequested.load();
+
+		// Files of earlier runs are pruned once the settings are known.
+		if (bFileSettingsChanged.exchange(false)) {
+			{
+				std::lock_guard<std::mutex> settingsScope(SettingsLock);
+				FileSettings = PendingFileSettings;
+			}
+
+			{
+				std::lock_guard<std::mutex> fileScope(FileLock);
+				bPruneRequested = true;
+			}
+
+			WakeFileThread();
+		}
+
+		ApplyBinaryMode();
+
+		size_t currentVersion = RingVersion.load(std::memory_order_acquire);
+		if (currentVersion != ringVersion) {
+			std::lock_guard<std::mutex> ringScope(RingLock);
+			rings = Rings;
+			ringVersion = currentVersion;
+		}
+
+		int formatted = FormatBatch(rings);
+
+		// Segments the writer moved past are rotated like text files.
+		if (BinaryWriter.IsOpen() && BinaryWriter.GetSegmentIndex() != BinarySegment) {
+			BinarySegment = BinaryWriter.GetSegmentIndex();
+			BinaryOpenTime = std::chrono::steady_clock::now().time_since_epoch().count();
+
+			{
+				std::lock_guard<std::mutex> fileScope(FileLock);
+				ActiveSegmentPath = BinaryWriter.GetSegmentPath(BinarySegment);
+				bPruneRequested = true;
+			}
+
+			WakeFileThread();
+		}
+
+		uint64_t dropped = DroppedNum.exchange(0, std::memory_order_relaxed);
+		if (dropped > 0) {
+			std::string message = std::to_string(dropped) + " log records dropped, the log ring of their thread was full.";
+			int64_t now = std::chrono::steady_clock::now().time_since_epoch().count();
+			BinaryWriter.WriteDropped(now, dropped);
+			AppendLine(ELogLevel::Warning, now, message.c_str(), !BinaryWriter.IsOpen());
+		}
+
+		// Flush requests and shutdown write the file at once, everything else waits for the write buffer.
+		bool bDrained = formatted < EASY_LOG_BATCH_RECORDS;
+		WriteBatch(bDrained && (bStopping || flushRequest != FlushDone));
+
+		if (!bDrained) {
+			continue;
+		}
+
+		// Every ring was drained at least once since the requests arrived.
+		{
+			std::lock_guard<std::mutex> wakeScope(WakeLock);
+			FlushDone = flushRequest;
+		}
+		FlushCondition.notify_all();
+
+		if (bStopping) {
+			break;
+		}
+
+		// Rings of exited threads go away once they're drained.
+		{
+			std::lock_guard<std::mutex> ringScope(RingLock);
+			size_t ringNum = Rings.size();
+			Rings.erase(std::remove_if(Rings.begin(), Rings.end(),
+			[](const std::shared_ptr<LogRing>& Ring)
+			{
+				return Ring->IsDetached() && Ring->GetUsedSize() == 0;
+			}), Rings.end());
+
+			if (Rings.size() != ringNum) {
+				rings = Rings;
+				ringVersion = RingVersion.load(std::memory_order_acquire);
+			}
+		}
+
+		std::unique_lock<std::mutex> wakeScope(WakeLock);
+		WakeCondition.wait_for(wakeScope, std::chrono::milliseconds(EASY_LOG_FLUSH_MSEC),
+		[this, flushRequest]()
+		{
+			return bWakeupRequested.exchange(false) || FlushRequested.load() != flushRequest || !bRunning;
+		});
+	}
+}
+
+int IEasyLog::FormatBatch(std::vector<std::shared_ptr<LogRing>>& Rings)
+{
+	int formatted(0);
+
+	while (formatted < EASY_LOG_BATCH_RECORDS)
+	{
+		// Threads log concurrently, the oldest head of all rings goes first.
+		LogRing* oldestRing(nullptr);
+		const char* oldestData(nullptr);
+		uint32_t oldestSize(0);
+		EasyLog::LogRecord oldestRecord;
+
+		for (const std::shared_ptr<LogRing>& ring : Rings)
+		{
+			uint32_t size(0);
+			const char* data = ring->Peek(size);
+			if (data == nullptr) {
+				continue;
+			}
+
+			EasyLog::LogRecord record;
+			std::memcpy(&record, data, sizeof(record));
+
+			if (oldestRing == nullptr || record.Timestamp < oldestRecord.Timestamp) {
+				oldestRing = ring.get();
+				oldestData = data;
+				oldestSize = size;
+				oldestRecord = record;
+			}
+		}
+
+		if (oldestRing == nullptr) {
+			break;
+		}
+
+		AppendRecord(oldestRecord, oldestData + sizeof(oldestRecord), oldestSize - static_cast<uint32_t>(sizeof(oldestRecord)));
+		oldestRing->Pop();
+		formatted++;
+	}
+
+	return formatted;
+}
+
+void IEasyLog::AppendRecord(const EasyLog::LogRecord& Record, const char* Args, uint32_t ArgSize)
+{
+	bool bBinary = BinaryWriter.WriteRecord(static_cast<int>(Record.Level), Record.Format, Record.Signature, Record.Timestamp, Args, ArgSize);
+	if (bBinary && Record.Level < ELogLevel::Warning) {
+		return;
+	}
+
+	char buffer[MAX_BUF_SIZE];
+	Record.Formatter(buffer, MAX_BUF_SIZE, Record.Format, Args);
+
+	AppendLine(Record.Level, Record.Timestamp, buffer, !bBinary);
+}
+
+void IEasyLog::AppendLine(ELogLevel LogLevel, int64_t Timestamp, const char* Message, bool bToFile /*= true*/)
+{
+	const std::string& time = GetTimeText(Timestamp);
+
+	size_t lineStart = FileBatch.size();
+	FileBatch.append("[ ").append(time).append(" ][ ").append(GetLevelName(LogLevel)).append(" ] : ").append(Message).append("\n");
+
+	// Console output is written in runs of one color.
+	int textColor = GetLevelColor(LogLevel);
+	if (textColor != ConsoleColor && !ConsoleBatch.empty()) {
+		std::cout.write(ConsoleBatch.data(), ConsoleBatch.size());
+		std::cout.flush();
+		ConsoleBatch.clear();
+	}
+
+	if (textColor != ConsoleColor) {
+		SetConsoleTextColor(textColor | 0);
+		ConsoleColor = textColor;
+	}
+
+	ConsoleBatch.append(FileBatch, lineStart, std::string::npos);
+
+	if (!bToFile) {
+		FileBatch.resize(lineStart);
+	}
+}
+
+void IEasyLog::ApplyBinaryMode()
+{
+	bool bBinary = bBinaryRequested.load();
+	if (bBinary == BinaryWriter.IsOpen()) {
+		return;
+	}
+
+	if (!bBinary) {
+		BinaryWriter.Close();
+		bBinaryActive = false;
+
+		std::lock_guard<std::mutex> fileScope(FileLock);
+		ActiveSegmentPath.clear();
+		return;
+	}
+
+	int64_t now = std::chrono::steady_clock::now().time_since_epoch().count();
+
+	// The writer closed itself, the next segment couldn't be created.
+	if (bBinaryActive) {
+		bBinaryRequested = false;
+		bBinaryActive = false;
+		AppendLine(ELogLevel::Error, now, "Open next binary log segment failed, falling back to text log.");
+		return;
+	}
+
+	// A segment is a file like any other, it's never larger than a text file may grow.
+	size_t segmentSize = BinarySegmentSize.load();
+	if (FileSettings.MaxFileSize > 0) {
+		segmentSize = static_cast<size_t>(std::min<uint64_t>(segmentSize, FileSettings.MaxFileSize));
+	}
+
+	bBinaryActive = BinaryWriter.Open(LogBasePath, segmentSize, WallClockBase, SteadyClockBase);
+	BinarySegment = BinaryWriter.GetSegmentIndex();
+	BinaryOpenTime = now;
+	if (bBinaryActive) {
+		std::lock_guard<std::mutex> fileScope(FileLock);
+		ActiveSegmentPath = BinaryWriter.GetSegmentPath(BinarySegment);
+	}
+	else {
+		// Keep writing text, the failure is reported in it.
+		bBinaryRequested = false;
+		AppendLine(ELogLevel::Error, now, "Open binary log segment failed, falling back to text log.");
+	}
+}
+
+void IEasyLog::WriteBatch(bool bForce)
+{
+	if (!ConsoleBatch.empty()) {
+		std::cout.write(ConsoleBatch.data(), ConsoleBatch.size());
+		std::cout.flush();
+		ConsoleBatch.clear();
+	}
+
+	if (ConsoleColor != EasyLog::White) {
+		SetConsoleTextColor(EasyLog::EConsoleTextColor::White | 0);
+		ConsoleColor = EasyLog::White;
+	}
+
+	int64_t now = std::chrono::steady_clock::now().time_since_epoch().count();
+	if (ShouldRotateFile(now)) {
+		RotateFile(now);
+	}
+
+	// Size rotation of segments is up to the writer, the next pass hands the rotated one to the file thread.
+	std::chrono::steady_clock::duration segmentOpened(now - BinaryOpenTime);
+	if (BinaryWriter.IsOpen() && !BinaryWriter.IsEmpty() && FileSettings.RotateIntervalSec > 0 && segmentOpened >= std::chrono::seconds(FileSettings.RotateIntervalSec)) {
+		BinaryWriter.Rotate();
+	}
+
+	if (FileBatch.empty()) {
+		LastFileWrite = now;
+		return;
+	}
+
+	std::chrono::steady_clock::duration waited(now - LastFileWrite);
+	if (!bForce && FileBatch.size() < FileSettings.WriteBufferSize && waited < std::chrono::milliseconds(FileSettings.FlushIntervalMsec)) {
+		return;
+	}
+
+	LogFile.write(FileBatch.data(), FileBatch.size());
+	LogFile.flush();
+
+	FileSize += FileBatch.size();
+	FileBatch.clear();
+	LastFileWrite = now;
+}
+
+bool IEasyLog::ShouldRotateFile(int64_t Now) const
+{
+	// An empty file stays, rotating it would only leave empty files behind.
+	if (FileSize == 0) {
+		return false;
+	}
+
+	if (FileSettings.MaxFileSize > 0 && FileSize + FileBatch.size() > FileSettings.MaxFileSize) {
+		return true;
+	}
+
+	std::chrono::steady_clock::duration opened(Now - FileOpenTime);
+	return FileSettings.RotateIntervalSec > 0 && opened >= std::chrono::seconds(FileSettings.RotateIntervalSec);
+}
+
+void IEasyLog::RotateFile(int64_t Now)
+{
+	std::string path = LogBasePath + EasyLog::EASY_Log_Ext;
+	std::string rotatedPath = GetRotatedPath(RotateIndex);
+
+	LogFile.close();
+
+	std::error_code error;
+	std::filesystem::rename(path, rotatedPath, error);
+
+	if (error) {
+		// Keep appending to the current file, it counts as a new one until the next rotation tries again.
+		LogFile.open(path, std::ios::out | std::ios::app);
+		FileSize = 0;
+		FileOpenTime = Now;
+		AppendLine(ELogLevel::Error, Now, ("Rotate log file failed, " + error.message()).c_str());
+		return;
+	}
+
+	LogFile.open(path, std::ios::out | std::ios::trunc);
+	FileSize = 0;
+	FileOpenTime = Now;
+
+	{
+		std::lock_guard<std::mutex> fileScope(FileLock);
+		RotatedFiles.push_back(RotateIndex++);
+	}
+
+	WakeFileThread();
+}
+
+void IEasyLog::WakeFileThread()
+{
+	if (!FileThread.joinable()) {
+		FileThread = std::thread(&IEasyLog::ProcessRotatedFiles, this);
+	}
+	else {
+		FileCondition.notify_one();
+	}
+}
+
+void IEasyLog::ProcessRotatedFiles()
+{
+	std::unique_lock<std::mutex> fileScope(FileLock);
+
+	while (true)
+	{
+		FileCondition.wait(fileScope,
+		[this]()
+		{
+			return !RotatedFiles.empty() || bPruneRequested || bFileThreadStopping;
+		});
+
+		if (RotatedFiles.empty() && !bPruneRequested) {
+			break;
+		}
+
+		std::deque<uint32_t> rotatedFiles;
+		rotatedFiles.swap(RotatedFiles);
+		bPruneRequested = false;
+
+		std::string activeSegmentPath = ActiveSegmentPath.empty() ? LogBasePath + BINARY_LOG_EXT : ActiveSegmentPath;
+
+		fileScope.unlock();
+
+		// The log thread owns FileSettings, read the last settings given instead.
+		EasyLog::LogFileSettings settings;
+		{
+			std::lock_guard<std::mutex> settingsScope(SettingsLock);
+			settings = PendingFileSettings;
+		}
+
+		for (uint32_t index : rotatedFiles)
+		{
+			if (!settings.CompressCommand.empty()) {
+				std::string command = settings.CompressCommand + " \"" + GetRotatedPath(index) + "\"";
+				std::system(command.c_str());
+			}
+		}
+
+		// Binary segments are kept as they are, the decoder reads them uncompressed.
+		if (settings.MaxFiles > 0) {
+			PruneLogFiles(EasyLog::EASY_Log_Ext, LogBasePath + EasyLog::EASY_Log_Ext, settings.MaxFiles);
+			PruneLogFiles(BINARY_LOG_EXT, activeSegmentPath, settings.MaxFiles);
+		}
+
+		fileScope.lock();
+	}
+}
+
+void IEasyLog::PruneLogFiles(const std::string& Extension, const std::string& ActivePath, int MaxFiles)
+{
+	std::filesystem::path activePath(ActivePath);
+	std::vector<std::pair<std::filesystem::file_time_type, std::filesystem::path>> files;
+
+	// Kept files aren't remembered across runs, the directory itself tells which ones are left.
+	std::error_code error;
+	for (std::filesystem::directory_iterator entry(activePath.parent_path(), error), end; !error && entry != end; entry.increment(error))
+	{
+		std::error_code fileError;
+		if (!entry->is_regular_file(fileError) || entry->path() == activePath) {
+			continue;
+		}
+
+		// The compressor may have renamed it, e.g. gzip appends .gz.
+		std::string name = entry->path().filename().string();
+		size_t position = name.find(Extension);
+		if (position == std::string::npos || (position + Extension.size() != name.size() && name[position + Extension.size()] != '.')) {
+			continue;
+		}
+
+		std::filesystem::file_time_type writeTime = entry->last_write_time(fileError);
+		if (!fileError) {
+			files.emplace_back(writeTime, entry->path());
+		}
+	}
+
+	if (files.size() <= static_cast<size_t>(MaxFiles)) {
+		return;
+	}
+
+	std::sort(files.begin(), files.end());
+
+	for (size_t index = 0; index + static_cast<size_t>(MaxFiles) < files.size(); index++)
+	{
+		std::error_code removeError;
+		std::filesystem::remove(files[index].second, removeError);
+	}
+}
+
+std::string IEasyLog::GetRotatedPath(uint32_t Index) const
+{
+	return LogBasePath + "." + std::to_string(Index) + EasyLog::EASY_Log_Ext;
+}
+
+const std::string& IEasyLog::GetTimeText(int64_t Timestamp)
+{
+	// Records of the same second share the text.
+	int64_t second = GetWallClockMicros(Timestamp) / 1000000;
+	if (second == TimeTextSecond) {
+		return TimeText;
+	}
+
+	std::time_t timeDate = static_cast<std::time_t>(second);
+	struct tm* time = localtime(&timeDate);
+
+	char buffer[60] = { 0 };
+	std::snprintf(buffer, sizeof(buffer), "%d-%02d-%02d-%02d.%02d.%02d",
+		(int)time->tm_year + 1900, (int)time->tm_mon + 1, (int)time->tm_mday,
+		(int)time->tm_hour, (int)time->tm_min, (int)time->tm_sec);
+
+	TimeTextSecond = second;
+	TimeText = buffer;
+	return TimeText;
+}
+
+bool IEasyLog::ParseLevel(const std::string& LevelName, ELogLevel& LogLevel)
+{
+	for (int level = static_cast<int>(ELogLevel::Display); level <= static_cast<int>(ELogLevel::Fatal); level++)
+	{
+		if (Get()->GetLevelName(static_cast<ELogLevel>(level)) == LevelName) {
+			LogLevel = static_cast<ELogLevel>(level);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+int64_t IEasyLog::GetWallClockMicros(int64_t Timestamp) const
+{
+	std::chrono::steady_clock::duration elapsed(Timestamp - SteadyClockBase);
+	return WallClockBase + std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+}
+
 std::string IEasyLog::GetLevelName(ELogLevel LogLevel)
 {
 	switch (LogLevel)
@@ -71,6 +659,12 @@ EasyLog::EConsoleTextColor IEasyLog::GetLevelColor(ELogLevel LogLevel)
 
 void IEasyLog::SetConsoleTextColor(int ColorCode)
 {
+#ifdef __linux__
+	// ANSI numbers the colors red, green, blue from the lowest bit, the console attributes the other way round.
+	int color = ((ColorCode & FOREGROUND_RED) ? 1 : 0) | ((ColorCode & FOREGROUND_GREEN) ? 2 : 0) | ((ColorCode & FOREGROUND_BLUE) ? 4 : 0);
+	std::cout << "\033[" << (((ColorCode & FOREGROUND_INTENSITY) ? 90 : 30) + color) << "m";
+#else
 	HANDLE handle = GetStdHandle(STD_OUTPUT_HANDLE);
 	SetConsoleTextAttribute(handle, ColorCode);
+#endif
 }
@@ -2,16 +2,60 @@
 #define EASY_LOG_H
 
 #include "MiscHelper.h"
+#include "LogRing.h"
+#include "BinaryLog.h"
 
 #include <memory>
 #include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
 #include <filesystem>
 #include <fstream>
-#include <windows.h>
 #include <iostream>
+#include <chrono>
+#include <cstring>
+#include <cstdint>
+#include <tuple>
+#include <vector>
+#include <deque>
+#include <string>
+#include <type_traits>
+
+#ifdef __linux__
+// Bits of the Windows console attributes, written as ANSI colors, @see IEasyLog::SetConsoleTextColor
+#define FOREGROUND_BLUE 0x0001
+#define FOREGROUND_GREEN 0x0002
+#define FOREGROUND_RED 0x0004
+#define FOREGROUND_INTENSITY 0x0008
+#else
+#include <windows.h>
+#endif
 
 #define MAX_BUF_SIZE 4096
 
+// Bytes of the record ring of every logging thread
+#define EASY_LOG_RING_SIZE (256 * 1024)
+// Longest string argument kept by a record, longer ones are cut
+#define EASY_LOG_MAX_STRING 1024
+// Records formatted before the batch is written out
+#define EASY_LOG_BATCH_RECORDS 1024
+// Longest wait of the log thread when no one wakes it up
+#define EASY_LOG_FLUSH_MSEC 10
+// Text bytes buffered before the log file is written
+#define EASY_LOG_WRITE_BUFFER (64 * 1024)
+// Longest time buffered text waits for the log file
+#define EASY_LOG_FILE_FLUSH_MSEC 1000
+// Bytes of a text log file before the next one is started
+#define EASY_LOG_MAX_FILE_SIZE (64 * 1024 * 1024)
+// Rotated log files kept, text files and binary segments each
+#define EASY_LOG_MAX_FILES 16
+
+// Lowest level compiled in, e.g. define it to 2 to strip Display and Log calls from the build
+#ifndef EASY_LOG_MIN_LEVEL
+#define EASY_LOG_MIN_LEVEL 0
+#endif
+
 enum class ELogLevel {
 	Display = 0,
 	Log,
@@ -22,8 +66,6 @@ enum class ELogLevel {
 
 namespace EasyLog
 {
-	static bool EASY_DumpToFile = true;
-	static bool EASY_ShowColor = true;
 	static std::string EASY_Log_Dir = "./Logs";
 	static std::string EASY_Log_Ext = ".log";
 
@@ -40,12 +82,173 @@ namespace EasyLog
 		HighWhite	= FOREGROUND_INTENSITY | FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE,
 		Black		= 0,
 	};
+
+	/**
+	* Buffering and rotation of the log files.
+	* The current text file is always <time>.log, a rotated one is renamed to <time>.<index>.log.
+	* Binary segments are numbered as they're written, rotating one starts the next.
+	*/
+	struct LogFileSettings
+	{
+		// 0 never rotates by size
+		uint64_t MaxFileSize{EASY_LOG_MAX_FILE_SIZE};
+
+		// Seconds one file is written, 0 never rotates by time
+		int64_t RotateIntervalSec{0};
+
+		// Oldest rotated files beyond it are deleted, those of earlier runs too, 0 keeps all of them
+		int MaxFiles{EASY_LOG_MAX_FILES};
+
+		size_t WriteBufferSize{EASY_LOG_WRITE_BUFFER};
+		int FlushIntervalMsec{EASY_LOG_FILE_FLUSH_MSEC};
+
+		// Run in the background with the path of every rotated file appended, e.g. "gzip -f", empty keeps files as they are
+		std::string CompressCommand;
+	};
+
+	// Formats the arguments stored behind a record, instantiated for the argument types of each LOG call.
+	using LogFormatter = int(*)(char* Buffer, int BufferSize, const char* Format, const char* Args);
+
+	/**
+	* Head of a record in the ring of the logging thread, the encoded arguments follow it.
+	* The format must be a string literal, only its pointer is kept.
+	*/
+	struct LogRecord
+	{
+		// Raw steady clock ticks
+		int64_t Timestamp;
+
+		ELogLevel Level;
+
+		const char* Format;
+
+		LogFormatter Formatter;
+
+		// Type codes of the arguments, @see LogSignature
+		const char* Signature;
+	};
+
+	// Strings are copied into the record, any other argument is kept by value.
+	template<typename T>
+	using LogArgType = std::conditional_t<std::is_same<T, char*>::value || std::is_same<T, const char*>::value, const char*, T>;
+
+	template<typename T>
+	struct LogArg
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "Log arguments must be trivially copyable, pass strings by c_str().");
+
+		static inline size_t GetSize(const T&) { return sizeof(T); }
+
+		static inline void Write(char*& Out, const T& Value)
+		{
+			std::memcpy(Out, &Value, sizeof(T));
+			Out += sizeof(T);
+		}
+
+		static inline T Read(const char*& In)
+		{
+			T value;
+			std::memcpy(&value, In, sizeof(T));
+			In += sizeof(T);
+			return value;
+		}
+	};
+
+	template<>
+	struct LogArg<const char*>
+	{
+		static inline size_t GetLength(const char* Value)
+		{
+			if (Value == nullptr) {
+				return 6;
+			}
+
+			// strnlen warns about the bound whenever the argument is a shorter array.
+			size_t length(0);
+			while (length < EASY_LOG_MAX_STRING && Value[length] != '\0')
+			{
+				length++;
+			}
+			return length;
+		}
+
+		static inline size_t GetSize(const char* Value) { return GetLength(Value) + 1; }
+
+		static inline void Write(char*& Out, const char* Value)
+		{
+			size_t length = GetLength(Value);
+			std::memcpy(Out, Value == nullptr ? "(null)" : Value, length);
+			Out[length] = '\0';
+			Out += length + 1;
+		}
+
+		static inline const char* Read(const char*& In)
+		{
+			const char* value = In;
+			In += std::strlen(In) + 1;
+			return value;
+		}
+	};
+
+	/**
+	* Type code of an argument, binary logs keep it with the format so the decoder can read the raw arguments.
+	* s string, b/B h/H i/I l/L signed and unsigned integers of 1, 2, 4 and 8 bytes, f float, d double, p/q pointer of 8 or 4 bytes.
+	*/
+	template<typename T>
+	constexpr char GetArgCode()
+	{
+		if constexpr (std::is_same<T, const char*>::value) {
+			return 's';
+		}
+		else if constexpr (std::is_floating_point<T>::value) {
+			return sizeof(T) == sizeof(float) ? 'f' : 'd';
+		}
+		else if constexpr (std::is_pointer<T>::value) {
+			return sizeof(T) == 8 ? 'p' : 'q';
+		}
+		else if constexpr (std::is_enum<T>::value) {
+			return GetArgCode<std::underlying_type_t<T>>();
+		}
+		else if constexpr (std::is_integral<T>::value) {
+			constexpr bool bSigned = std::is_signed<T>::value;
+			return sizeof(T) == 1 ? (bSigned ? 'b' : 'B') : sizeof(T) == 2 ? (bSigned ? 'h' : 'H') : sizeof(T) == 4 ? (bSigned ? 'i' : 'I') : (bSigned ? 'l' : 'L');
+		}
+		else {
+			return 'x';
+		}
+	}
+
+	template<typename ...ArgType>
+	struct LogSignature
+	{
+		static constexpr char Value[] = { GetArgCode<ArgType>()..., '\0' };
+	};
+
+	template<typename ...ArgType>
+	int FormatRecord(char* Buffer, int BufferSize, const char* Format, [[maybe_unused]] const char* Args)
+	{
+		// Braced initialization reads the arguments in order.
+		std::tuple<ArgType...> values{ LogArg<ArgType>::Read(Args)... };
+
+		return std::apply(
+		[Buffer, BufferSize, Format](const ArgType&... Values)
+		{
+			return std::snprintf(Buffer, BufferSize, Format, Values...);
+		}, values);
+	}
 }
 
+/**
+* Asynchronous logger.
+* LOG only copies the format pointer, a timestamp and the raw arguments into a lock-free ring of the calling thread,
+* a log thread formats the records of all threads in time order and writes them out in batches.
+* A record is dropped when its ring is full, the number of dropped records is logged later.
+* Fatal records are written before LOG returns.
+*/
 class IEasyLog
 {
 public:
-	
+
 	static std::shared_ptr<IEasyLog> Get();
 
 	IEasyLog();
@@ -55,30 +258,110 @@ public:
 	template<typename ...ArgType>
 	void PrintLog(ELogLevel LogLevel, const char* Format, ArgType... Args)
 	{
-		std::lock_guard<std::mutex> printScope(PrintLock);
+		LogRing* ring = GetThreadRing();
 
-		std::string time = MiscHelper::GetDateTime();
+		size_t recordSize = sizeof(EasyLog::LogRecord);
+		((recordSize += EasyLog::LogArg<EasyLog::LogArgType<ArgType>>::GetSize(Args)), ...);
 
-		std::string logFormat = "[ " + time + " ]" + "[ " + GetLevelName(LogLevel) + " ] : " + Format;
+		char* data = ring->Reserve(static_cast<uint32_t>(recordSize));
+		if (data == nullptr) {
+			DroppedNum.fetch_add(1, std::memory_order_relaxed);
+			Wakeup();
+			return;
+		}
 
-		char buffer[MAX_BUF_SIZE];
-		std::snprintf(buffer, MAX_BUF_SIZE, logFormat.c_str(), Args...);
-		
-		std::string log(buffer);
+		EasyLog::LogRecord record;
+		record.Timestamp = std::chrono::steady_clock::now().time_since_epoch().count();
+		record.Level = LogLevel;
+		record.Format = Format;
+		record.Formatter = &EasyLog::FormatRecord<EasyLog::LogArgType<ArgType>...>;
+		record.Signature = EasyLog::LogSignature<EasyLog::LogArgType<ArgType>...>::Value;
+		std::memcpy(data, &record, sizeof(record));
 
-		EasyLog::EConsoleTextColor textColor = GetLevelColor(LogLevel);
+		[[maybe_unused]] char* argData = data + sizeof(record);
+		(EasyLog::LogArg<EasyLog::LogArgType<ArgType>>::Write(argData, Args), ...);
 
-		SetConsoleTextColor(textColor | 0);
+		ring->Commit();
 
-		std::cout << log << std::endl;
+		if (LogLevel == ELogLevel::Fatal) {
+			Flush();
+		}
+		else if (LogLevel == ELogLevel::Error || ring->GetUsedSize() > ring->GetCapacity() / 2) {
+			Wakeup();
+		}
+	}
 
-		SetConsoleTextColor(EasyLog::EConsoleTextColor::White | 0);
+	// Block until every record logged before is written out.
+	virtual void Flush();
 
-		LogFile << log << std::endl;
-	}
+	// Checked by LOG before its arguments are evaluated, a disabled level costs one relaxed load.
+	static inline bool IsLevelEnabled(ELogLevel LogLevel) { return static_cast<int>(LogLevel) >= MinLevel.load(std::memory_order_relaxed); }
+
+	static inline void SetMinLevel(ELogLevel LogLevel) { MinLevel.store(static_cast<int>(LogLevel), std::memory_order_relaxed); }
+
+	static bool ParseLevel(const std::string& LevelName, ELogLevel& LogLevel);
+
+	/**
+	* Write records to memory-mapped binary segments instead of text, @see BinaryLogWriter
+	* Formatting is left to the LogDecoder tool, only Warning and above are still printed to the console.
+	*/
+	virtual void SetBinaryMode(bool bBinary, size_t SegmentSize = BINARY_LOG_SEGMENT_SIZE);
+
+	virtual void SetFileSettings(const EasyLog::LogFileSettings& Settings);
 
 protected:
-	
+
+	virtual LogRing* GetThreadRing();
+
+	virtual void Wakeup();
+
+	virtual void ProcessRecords();
+
+	/**
+	* Format the records of all rings oldest first.
+	* @return Formatted records, at most EASY_LOG_BATCH_RECORDS.
+	*/
+	virtual int FormatBatch(std::vector<std::shared_ptr<LogRing>>& Rings);
+
+	virtual void AppendRecord(const EasyLog::LogRecord& Record, const char* Args, uint32_t ArgSize);
+
+	/**
+	* @param Timestamp	Raw steady clock ticks
+	*/
+	virtual void AppendLine(ELogLevel LogLevel, int64_t Timestamp, const char* Message, bool bToFile = true);
+
+	// Open or close the binary segments the last SetBinaryMode asked for.
+	virtual void ApplyBinaryMode();
+
+	/**
+	* Console output is written at once, file output once the write buffer fills or the flush interval passed.
+	* @param bForce	Write the buffered file output now.
+	*/
+	virtual void WriteBatch(bool bForce);
+
+	virtual bool ShouldRotateFile(int64_t Now) const;
+
+	// Start the next text log file, the rotated one is handed to the file thread.
+	virtual void RotateFile(int64_t Now);
+
+	// Start the file thread on the first rotation, wake it up afterwards.
+	virtual void WakeFileThread();
+
+	// Compresses rotated files and deletes the ones beyond MaxFiles, disk work the log thread shouldn't wait for.
+	virtual void ProcessRotatedFiles();
+
+	/**
+	* Delete the oldest files of the log directory with the extension beyond MaxFiles, compressed ones included.
+	* @param ActivePath	File still being written, never deleted.
+	*/
+	virtual void PruneLogFiles(const std::string& Extension, const std::string& ActivePath, int MaxFiles);
+
+	virtual std::string GetRotatedPath(uint32_t Index) const;
+
+	virtual const std::string& GetTimeText(int64_t Timestamp);
+
+	virtual int64_t GetWallClockMicros(int64_t Timestamp) const;
+
 	std::string GetLevelName(ELogLevel LogLevel);
 
 	EasyLog::EConsoleTextColor GetLevelColor(ELogLevel LogLevel);
@@ -89,11 +372,86 @@ private:
 	static std::once_flag InstanceFlag;
 	static std::shared_ptr<IEasyLog> Instance;
 
+	static std::atomic<int> MinLevel;
+
 	std::ofstream LogFile;
+	std::string LogBasePath;
+
+	EasyLog::LogFileSettings PendingFileSettings;
+	std::mutex SettingsLock;
+	std::atomic<bool> bFileSettingsChanged;
+
+	// Touched by the log thread only
+	EasyLog::LogFileSettings FileSettings;
+	uint64_t FileSize;
+	int64_t FileOpenTime;
+	int64_t LastFileWrite;
+	uint32_t RotateIndex;
+
+	// Rotated files waiting for the file thread
+	std::thread FileThread;
+	std::mutex FileLock;
+	std::condition_variable FileCondition;
+	std::deque<uint32_t> RotatedFiles;
+	bool bPruneRequested;
+	bool bFileThreadStopping;
+
+	// Binary segment being written, empty in text mode
+	std::string ActiveSegmentPath;
+
+	// Wall clock and steady clock read at the same time, record timestamps are steady clock ticks.
+	int64_t WallClockBase;
+	int64_t SteadyClockBase;
+
+	std::atomic<bool> bBinaryRequested;
+	std::atomic<size_t> BinarySegmentSize;
+	BinaryLogWriter BinaryWriter;
+
+	// Touched by the log thread only, the writer was opened and not closed on request.
+	bool bBinaryActive;
+
+	// Touched by the log thread only, the segment written and when it was started
+	uint32_t BinarySegment;
+	int64_t BinaryOpenTime;
+
+	// Rings of every thread which logged, only registering a thread takes the lock.
+	std::vector<std::shared_ptr<LogRing>> Rings;
+	std::mutex RingLock;
+	std::atomic<size_t> RingVersion;
+
+	std::atomic<uint64_t> DroppedNum;
+
+	std::thread LogThread;
+	std::atomic<bool> bRunning;
+
+	std::mutex WakeLock;
+	std::condition_variable WakeCondition;
+	std::atomic<bool> bWakeupRequested;
+
+	// Flush requests and the last request whose records are all written
+	std::atomic<uint64_t> FlushRequested;
+	uint64_t FlushDone;
+	std::condition_variable FlushCondition;
 
-	std::mutex PrintLock;
+	// Touched by the log thread only
+	std::string FileBatch;
+	std::string ConsoleBatch;
+	int ConsoleColor;
+	int64_t TimeTextSecond;
+	std::string TimeText;
 };
 
-#define LOG(Level, Format, ...) IEasyLog::Get()->PrintLog(ELogLevel::##Level, ##Format, ##__VA_ARGS__)
+/**
+* Levels below EASY_LOG_MIN_LEVEL are discarded at compile time, levels below the runtime level are skipped
+* before any argument is evaluated, so a disabled LOG does no work at all.
+*/
+#define LOG(Level, Format, ...) \
+	do { \
+		if constexpr (static_cast<int>(ELogLevel::Level) >= EASY_LOG_MIN_LEVEL) { \
+			if (IEasyLog::IsLevelEnabled(ELogLevel::Level)) { \
+				IEasyLog::Get()->PrintLog(ELogLevel::Level, Format, ##__VA_ARGS__); \
+			} \
+		} \
+	} while (0)
 
 #endif // !EASY_LOG_H
@@ -0,0 +1,799 @@
+#include "EventLoop.h"
+#include "ProxyContext.h"
+#include "EasyLog.h"
+#include "ProxyServer.h"
+#include "Metrics.h"
+
+#include <algorithm>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
+EventLoop::EventLoop()
+#ifdef __linux__
+	: WakeupHandle(-1)
+	, Uring(nullptr)
+	, NextRelayGeneration(0)
+#else
+	: WakeupSocket(INVALID_SOCKET)
+#endif
+	, bRunning(false)
+{
+	if (!InitPoller()) {
+		LOG(Error, "Init event loop poller failed.");
+	}
+}
+
+EventLoop::~EventLoop()
+{
+#ifdef __linux__
+	// Closing the ring cancels what's in flight before the contexts close their sockets.
+	UringRelays.clear();
+	Uring = nullptr;
+#endif
+	EventPoller.reset();
+
+	Watchers.clear();
+	Timers.Clear();
+	ClosedContexts.clear();
+	PendingTasks.clear();
+	UDPRelay.reset();
+
+#ifdef __linux__
+	if (WakeupHandle >= 0) {
+		close(WakeupHandle);
+	}
+#else
+	if (WakeupSocket != INVALID_SOCKET) {
+		MiscHelper::CloseSocket(WakeupSocket);
+	}
+#endif
+}
+
+void EventLoop::PostConnection(SOCKET Accepted, unsigned long long ConnectionId)
+{
+	PostTask(
+	[this, Accepted, ConnectionId]()
+	{
+		AddConnection(Accepted, ConnectionId);
+	});
+}
+
+void EventLoop::PostTask(std::function<void()> Task)
+{
+	{
+		std::lock_guard<std::mutex> pendingScope(PendingLock);
+		PendingTasks.push_back(std::move(Task));
+	}
+
+	Wakeup();
+}
+
+void EventLoop::PostContextTask(std::weak_ptr<ProxyContext> Context, std::function<void(const std::shared_ptr<ProxyContext>&)> Task)
+{
+	PostTask(
+	[this, Context, Task]()
+	{
+		std::shared_ptr<ProxyContext> context = Context.lock();
+		if (context == nullptr || !context->IsAttached()) {
+			return;
+		}
+
+		Task(context);
+
+		CloseIfDone(context);
+	});
+}
+
+bool EventLoop::WatchListener(SOCKET Listener)
+{
+	if (Listener == INVALID_SOCKET) {
+		return false;
+	}
+
+#ifdef __linux__
+	// One multishot accept keeps accepting until it fails.
+	bool bWatched = Uring != nullptr ? ArmUringAccept(Listener) : AddPollSocket(Listener, true, false);
+#else
+	bool bWatched = AddPollSocket(Listener, true, false);
+#endif
+
+	if (!bWatched) {
+		return false;
+	}
+
+	Listeners.insert(Listener);
+	return true;
+}
+
+void EventLoop::UnwatchListener(SOCKET Listener)
+{
+	if (Listeners.erase(Listener) == 0) {
+		return;
+	}
+
+#ifdef __linux__
+	// The accept isn't armed again once the listener is gone from the set.
+	if (Uring != nullptr) {
+		CancelUringOperations(Listener);
+		return;
+	}
+#endif
+
+	RemovePollSocket(Listener);
+}
+
+bool EventLoop::WatchRelaySocket(SOCKET Socket)
+{
+	return Socket != INVALID_SOCKET && AddPollSocket(Socket, true, false);
+}
+
+void EventLoop::UnwatchRelaySocket(SOCKET Socket)
+{
+	RemovePollSocket(Socket);
+}
+
+bool EventLoop::Watch(SOCKET Socket, std::shared_ptr<ProxyContext> Context, bool bRead /*= true*/, bool bWrite /*= false*/)
+{
+	if (Socket == INVALID_SOCKET || !AddPollSocket(Socket, bRead, bWrite)) {
+		return false;
+	}
+
+	SocketWatcher& watcher = Watchers[Socket];
+	watcher.Context = Context;
+	watcher.bRead = bRead;
+	watcher.bWrite = bWrite;
+	return true;
+}
+
+bool EventLoop::Modify(SOCKET Socket, bool bRead, bool bWrite)
+{
+	auto watcher = Watchers.find(Socket);
+	if (watcher == Watchers.end()) {
+		return false;
+	}
+
+	if (watcher->second.bRead == bRead && watcher->second.bWrite == bWrite) {
+		return true;
+	}
+
+	if (!ModifyPollSocket(Socket, bRead, bWrite)) {
+		return false;
+	}
+
+	watcher->second.bRead = bRead;
+	watcher->second.bWrite = bWrite;
+	return true;
+}
+
+void EventLoop::Unwatch(SOCKET Socket)
+{
+	auto watcher = Watchers.find(Socket);
+	if (watcher == Watchers.end()) {
+		return;
+	}
+
+	RemovePollSocket(Socket);
+
+	Watchers.erase(watcher);
+}
+
+uint64_t EventLoop::AddTimer(int DelayMsec, std::weak_ptr<ProxyContext> Context, ETimerType Type)
+{
+	LoopTimer timer;
+	timer.Context = Context;
+	timer.Type = Type;
+
+	return Timers.Add(DelayMsec, timer);
+}
+
+void EventLoop::CancelTimer(uint64_t TimerId)
+{
+	Timers.Cancel(TimerId);
+}
+
+bool EventLoop::StartRelay(SOCKET Client, SOCKET Destination)
+{
+#ifdef __linux__
+	if (Uring == nullptr) {
+		return false;
+	}
+
+	RemovePollSocket(Client);
+	RemovePollSocket(Destination);
+
+	uint8_t generation = ++NextRelayGeneration;
+
+	UringRelay& clientRelay = UringRelays[Client];
+	clientRelay.Peer = Destination;
+	clientRelay.Generation = generation;
+	clientRelay.bClientSide = true;
+
+	UringRelay& destinationRelay = UringRelays[Destination];
+	destinationRelay.Peer = Client;
+	destinationRelay.Generation = generation;
+	destinationRelay.bClientSide = false;
+
+	ArmUringRecv(Client, generation);
+	ArmUringRecv(Destination, generation);
+	return true;
+#else
+	return false;
+#endif
+}
+
+SharedUDPRelay* EventLoop::GetUDPRelay()
+{
+	if (UDPRelay != nullptr) {
+		return UDPRelay.get();
+	}
+
+	std::unique_ptr<SharedUDPRelay> relay(new SharedUDPRelay(this));
+	if (!relay->Init(ProxyServer::Get()->GetUDPRelaySocketNum())) {
+		return nullptr;
+	}
+
+	for (SOCKET relaySocket : relay->GetSockets())
+	{
+		if (!AddPollSocket(relaySocket, true, false)) {
+			for (SOCKET added : relay->GetSockets())
+			{
+				RemovePollSocket(added);
+			}
+			return nullptr;
+		}
+	}
+
+	UDPRelay = std::move(relay);
+	return UDPRelay.get();
+}
+
+void EventLoop::Run()
+{
+	bRunning = true;
+
+	while (bRunning)
+	{
+		DrainPendingTasks();
+
+		int eventNum = WaitEvents(GetWaitTimeout());
+		if (eventNum > 0) {
+			for (const SocketEvent& event : ReadyEvents)
+			{
+				DispatchEvent(event);
+			}
+		}
+
+		DispatchCompletions();
+
+		DispatchTimers();
+
+		ClosedContexts.clear();
+	}
+}
+
+void EventLoop::Stop()
+{
+	bRunning = false;
+	Wakeup();
+}
+
+bool EventLoop::InitPoller()
+{
+	EventPoller = Poller::Create(ProxyServer::Get()->GetIOBackend());
+	if (EventPoller == nullptr) {
+		return false;
+	}
+
+#ifdef __linux__
+	Uring = EventPoller->GetRing();
+
+	WakeupHandle = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (WakeupHandle < 0) {
+		return false;
+	}
+
+	return EventPoller->Add(WakeupHandle, true, false);
+#else
+	// select and WSAPoll can't be interrupted, so the loop wakes itself up by a loopback datagram.
+	WakeupSocket = socket(AF_INET, SOCK_DGRAM, 0);
+	if (WakeupSocket == INVALID_SOCKET) {
+		return false;
+	}
+
+	std::memset(&WakeupAddr, 0, sizeof(WakeupAddr));
+	WakeupAddr.sin_family = AF_INET;
+	WakeupAddr.sin_port = 0;
+	inet_pton(AF_INET, "127.0.0.1", &WakeupAddr.sin_addr);
+
+	if (bind(WakeupSocket, (SOCKADDR*)&WakeupAddr, sizeof(WakeupAddr)) == SOCKET_ERROR) {
+		return false;
+	}
+
+	int addrLen = static_cast<int>(sizeof(WakeupAddr));
+	if (getsockname(WakeupSocket, (SOCKADDR*)&WakeupAddr, &addrLen) == SOCKET_ERROR) {
+		return false;
+	}
+
+	if (!MiscHelper::SetNonBlocking(WakeupSocket)) {
+		return false;
+	}
+
+	return EventPoller->Add(WakeupSocket, true, false);
+#endif
+}
+
+void EventLoop::CollectEvent(const PollerEvent& Event)
+{
+#ifdef __linux__
+	if (Event.Socket == WakeupHandle) {
+#else
+	if (Event.Socket == WakeupSocket) {
+#endif
+		DrainWakeup();
+		return;
+	}
+
+	SocketEvent event;
+	event.Socket = Event.Socket;
+
+	if (Event.bWritable || (Event.bFailed && !Event.bReadable)) {
+		auto watcher = Watchers.find(event.Socket);
+		if (watcher != Watchers.end() && watcher->second.bWrite) {
+			event.Operation = EOperationType::Write;
+			ReadyEvents.push_back(event);
+
+			// A failed write is enough to report it, the context reads the error from the socket.
+			if (!Event.bReadable) {
+				return;
+			}
+		}
+	}
+
+	// Hang up and errors are reported as readable, the following recv will pick them up.
+	if (Event.bReadable || Event.bFailed) {
+		event.Operation = EOperationType::Read;
+		ReadyEvents.push_back(event);
+	}
+}
+
+void EventLoop::Wakeup()
+{
+#ifdef __linux__
+	uint64_t value = 1;
+	if (write(WakeupHandle, &value, sizeof(value)) < 0) {
+		return;
+	}
+#else
+	char value = 0;
+	sendto(WakeupSocket, &value, 1, 0, (SOCKADDR*)&WakeupAddr, sizeof(WakeupAddr));
+#endif
+}
+
+void EventLoop::DrainWakeup()
+{
+#ifdef __linux__
+	uint64_t value = 0;
+	while (read(WakeupHandle, &value, sizeof(value)) > 0);
+#else
+	char buffer[16];
+	while (recv(WakeupSocket, buffer, sizeof(buffer), 0) > 0);
+#endif
+}
+
+void EventLoop::DrainPendingTasks()
+{
+	std::vector<std::function<void()>> tasks;
+	{
+		std::lock_guard<std::mutex> pendingScope(PendingLock);
+		tasks.swap(PendingTasks);
+	}
+
+	for (const std::function<void()>& task : tasks)
+	{
+		task();
+	}
+}
+
+void EventLoop::AcceptConnections(SOCKET Listener)
+{
+	for (int index = 0; index < EVENT_LOOP_MAX_ACCEPTS; index++)
+	{
+		SOCKADDR_STORAGE acceptedAddr;
+		std::memset(&acceptedAddr, 0, sizeof(acceptedAddr));
+		socklen_t addrLen = static_cast<socklen_t>(sizeof(acceptedAddr));
+
+		SOCKET acceptedSock = accept(Listener, (SOCKADDR*)&acceptedAddr, &addrLen);
+		if (acceptedSock == INVALID_SOCKET) {
+			break;
+		}
+
+		unsigned long long connectionId = ProxyContext::NewConnectionId();
+		LOG(Log, "[Connection: %llu]Accept a new connection from %s.", connectionId, MiscHelper::AddressToString(acceptedAddr).c_str());
+
+		AddConnection(acceptedSock, connectionId);
+	}
+}
+
+void EventLoop::AddConnection(SOCKET Accepted, unsigned long long ConnectionId)
+{
+	std::shared_ptr<ProxyContext> context = ProxyContext::Create(Accepted, ConnectionId);
+	if (!context->AttachLoop(this)) {
+		context->DetachLoop();
+	}
+}
+
+bool EventLoop::AddPollSocket(SOCKET Socket, bool bRead, bool bWrite)
+{
+	return EventPoller != nullptr && EventPoller->Add(Socket, bRead, bWrite);
+}
+
+bool EventLoop::ModifyPollSocket(SOCKET Socket, bool bRead, bool bWrite)
+{
+	return EventPoller != nullptr && EventPoller->Modify(Socket, bRead, bWrite);
+}
+
+void EventLoop::RemovePollSocket(SOCKET Socket)
+{
+#ifdef __linux__
+	auto relay = UringRelays.find(Socket);
+	if (relay != UringRelays.end()) {
+		UringRelays.erase(relay);
+		CancelUringOperations(Socket);
+		return;
+	}
+#endif
+
+	if (EventPoller != nullptr) {
+		EventPoller->Remove(Socket);
+	}
+}
+
+int EventLoop::GetWaitTimeout()
+{
+	return Timers.GetWaitTimeout(std::chrono::steady_clock::now(), EVENT_LOOP_WAIT_MSEC);
+}
+
+int EventLoop::WaitEvents(int TimeoutMsec)
+{
+	ReadyEvents.clear();
+	PollerEvents.clear();
+
+	if (EventPoller == nullptr) {
+		return -1;
+	}
+
+	int eventNum = EventPoller->Wait(TimeoutMsec, PollerEvents);
+	if (eventNum <= 0) {
+		return eventNum;
+	}
+
+	for (const PollerEvent& event : PollerEvents)
+	{
+		CollectEvent(event);
+	}
+
+	return static_cast<int>(ReadyEvents.size());
+}
+
+void EventLoop::DispatchEvent(const SocketEvent& Event)
+{
+	if (Listeners.count(Event.Socket) != 0) {
+		AcceptConnections(Event.Socket);
+		return;
+	}
+
+	if (UDPRelay != nullptr && UDPRelay->IsRelaySocket(Event.Socket)) {
+		UDPRelay->HandleReadable(Event.Socket);
+		return;
+	}
+
+	auto watcher = Watchers.find(Event.Socket);
+	if (watcher == Watchers.end()) {
+		return;
+	}
+
+#ifdef __linux__
+	// Collected before the relay started in this batch, the ring receives from it now.
+	if (UringRelays.count(Event.Socket) != 0) {
+		return;
+	}
+#endif
+
+	std::shared_ptr<ProxyContext> context = watcher->second.Context;
+
+	context->HandleEvent(Event.Socket, Event.Operation);
+
+	CloseIfDone(context);
+}
+
+void EventLoop::DispatchTimers()
+{
+	Timers.Advance(std::chrono::steady_clock::now());
+
+	LoopTimer timer;
+	while (Timers.PopDue(timer))
+	{
+		std::shared_ptr<ProxyContext> context = timer.Context.lock();
+		if (context == nullptr) {
+			continue;
+		}
+
+		context->HandleTimer(timer.Type);
+
+		CloseIfDone(context);
+	}
+}
+
+void EventLoop::DispatchCompletions()
+{
+#ifdef __linux__
+	std::vector<UringCompletion>* completions = EventPoller != nullptr ? EventPoller->GetCompletions() : nullptr;
+	if (completions == nullptr) {
+		return;
+	}
+
+	for (const UringCompletion& completion : *completions)
+	{
+		EUringOperation operation = static_cast<EUringOperation>(completion.UserData >> 56);
+		unsigned short bufferId = static_cast<unsigned short>((completion.UserData >> 40) & 0xFFFF);
+		uint8_t generation = static_cast<uint8_t>((completion.UserData >> 32) & 0xFF);
+		SOCKET socket = static_cast<SOCKET>(completion.UserData & 0xFFFFFFFF);
+
+		switch (operation)
+		{
+		case EUringOperation::Accept:
+			HandleUringAccept(socket, completion);
+			break;
+
+		case EUringOperation::Recv:
+			HandleUringRecv(socket, generation, completion);
+			break;
+
+		case EUringOperation::Send:
+			HandleUringSend(socket, generation, bufferId, completion);
+			break;
+
+		default:
+			// Polls are handled while waiting, cancel results aren't needed.
+			break;
+		}
+	}
+
+	completions->clear();
+#endif
+}
+
+void EventLoop::CloseIfDone(const std::shared_ptr<ProxyContext>& Context)
+{
+	if (Context->IsClosing() && Context->IsAttached()) {
+		Context->DetachLoop();
+		ClosedContexts.push_back(Context);
+	}
+}
+
+#ifdef __linux__
+bool EventLoop::ArmUringAccept(SOCKET Listener)
+{
+	io_uring_sqe* sqe = Uring->GetSqe();
+	if (sqe == nullptr) {
+		LOG(Error, "Accept by io_uring failed, submission queue is full.");
+		return false;
+	}
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = static_cast<int>(Listener);
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = MakeUringData(EUringOperation::Accept, Listener);
+	return true;
+}
+
+bool EventLoop::ArmUringRecv(SOCKET Socket, uint8_t Generation)
+{
+	io_uring_sqe* sqe = Uring->GetSqe();
+	if (sqe == nullptr) {
+		// Tried again when a buffer comes back, completions free the queue too.
+		StarvedRelays.emplace_back(Socket, Generation);
+		return false;
+	}
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = static_cast<int>(Socket);
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = Uring->GetBufferGroup();
+	sqe->len = Uring->GetBufferSize();
+	sqe->user_data = MakeUringData(EUringOperation::Recv, Socket, Generation);
+	return true;
+}
+
+bool EventLoop::ArmUringSend(SOCKET Socket, uint8_t Generation, unsigned short BufferId)
+{
+	auto relay = UringRelays.find(Socket);
+	if (relay == UringRelays.end()) {
+		return false;
+	}
+
+	// The send and the next receive go in one submit, so the link between them holds.
+	if (!Uring->Reserve(2)) {
+		return false;
+	}
+
+	io_uring_sqe* sqe = Uring->GetSqe();
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = static_cast<int>(relay->second.Peer);
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->addr = reinterpret_cast<uint64_t>(Uring->GetBuffer(BufferId) + relay->second.SendOffset);
+	sqe->len = relay->second.SendLen - relay->second.SendOffset;
+	sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+	sqe->user_data = MakeUringData(EUringOperation::Send, Socket, Generation, BufferId);
+
+	ArmUringRecv(Socket, Generation);
+	return true;
+}
+
+void EventLoop::CancelUringOperations(SOCKET Socket)
+{
+	io_uring_sqe* sqe = Uring->GetSqe();
+	if (sqe == nullptr) {
+		LOG(Error, "Cancel io_uring operations of socket %d failed, submission queue is full.", static_cast<int>(Socket));
+		return;
+	}
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = static_cast<int>(Socket);
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+	sqe->user_data = MakeUringData(EUringOperation::Cancel, Socket);
+
+	// The socket number is looked up on submit, it has to happen before the context closes it.
+	Uring->Submit();
+}
+
+void EventLoop::HandleUringAccept(SOCKET Listener, const UringCompletion& Completion)
+{
+	if ((Completion.Flags & IORING_CQE_F_MORE) == 0 && Listeners.count(Listener) != 0) {
+		ArmUringAccept(Listener);
+	}
+
+	// Cancelled by UnwatchListener
+	if (Completion.Result == -ECANCELED) {
+		return;
+	}
+
+	if (Completion.Result < 0) {
+		LOG(Error, "Incoming a new connection, but can't accept, code: %d", -Completion.Result);
+		return;
+	}
+
+	SOCKET acceptedSock = static_cast<SOCKET>(Completion.Result);
+
+	SOCKADDR_STORAGE acceptedAddr;
+	std::memset(&acceptedAddr, 0, sizeof(acceptedAddr));
+	socklen_t addrLen = static_cast<socklen_t>(sizeof(acceptedAddr));
+	getpeername(acceptedSock, (SOCKADDR*)&acceptedAddr, &addrLen);
+
+	unsigned long long connectionId = ProxyContext::NewConnectionId();
+	LOG(Log, "[Connection: %llu]Accept a new connection from %s.", connectionId, MiscHelper::AddressToString(acceptedAddr).c_str());
+
+	AddConnection(acceptedSock, connectionId);
+}
+
+void EventLoop::HandleUringRecv(SOCKET Socket, uint8_t Generation, const UringCompletion& Completion)
+{
+	bool bBuffer = (Completion.Flags & IORING_CQE_F_BUFFER) != 0;
+	unsigned short bufferId = static_cast<unsigned short>(Completion.Flags >> IORING_CQE_BUFFER_SHIFT);
+
+	auto relay = UringRelays.find(Socket);
+	if (relay == UringRelays.end() || relay->second.Generation != Generation) {
+		if (bBuffer) {
+			RecycleUringBuffer(bufferId);
+		}
+		return;
+	}
+
+	if (Completion.Result == -ENOBUFS) {
+		StarvedRelays.emplace_back(Socket, Generation);
+		return;
+	}
+
+	// A short send broke the link, the receive is armed again once the rest of the chunk is sent.
+	if (Completion.Result == -ECANCELED && relay->second.SendOffset < relay->second.SendLen) {
+		return;
+	}
+
+	// Data behind a chunk the peer didn't fully take yet would be sent out of order.
+	if (Completion.Result > 0 && relay->second.SendOffset < relay->second.SendLen) {
+		if (bBuffer) {
+			RecycleUringBuffer(bufferId);
+		}
+
+		StopRelay(Socket, EIO);
+		return;
+	}
+
+	if (Completion.Result <= 0 || !bBuffer) {
+		if (bBuffer) {
+			RecycleUringBuffer(bufferId);
+		}
+
+		StopRelay(Socket, -Completion.Result);
+		return;
+	}
+
+	relay->second.SendLen = static_cast<unsigned int>(Completion.Result);
+	relay->second.SendOffset = 0;
+	if (!ArmUringSend(Socket, Generation, bufferId)) {
+		RecycleUringBuffer(bufferId);
+		StopRelay(Socket, EBUSY);
+	}
+}
+
+void EventLoop::HandleUringSend(SOCKET Socket, uint8_t Generation, unsigned short BufferId, const UringCompletion& Completion)
+{
+	auto relay = UringRelays.find(Socket);
+	if (relay == UringRelays.end() || relay->second.Generation != Generation) {
+		RecycleUringBuffer(BufferId);
+		return;
+	}
+
+	if (Completion.Result <= 0) {
+		RecycleUringBuffer(BufferId);
+		StopRelay(Socket, Completion.Result < 0 ? -Completion.Result : EPIPE);
+		return;
+	}
+
+	Metrics::Add(relay->second.bClientSide ? EMetricCounter::ClientBytes : EMetricCounter::DestinationBytes, static_cast<uint64_t>(Completion.Result));
+
+	auto watcher = Watchers.find(Socket);
+	if (watcher != Watchers.end()) {
+		watcher->second.Context->AddRelayedBytes(relay->second.bClientSide, static_cast<unsigned long long>(Completion.Result));
+		watcher->second.Context->MarkActive();
+	}
+
+	// The peer took only a part of the chunk, the buffer is kept until the rest is sent.
+	relay->second.SendOffset += static_cast<unsigned int>(Completion.Result);
+	if (relay->second.SendOffset < relay->second.SendLen) {
+		if (!ArmUringSend(Socket, Generation, BufferId)) {
+			RecycleUringBuffer(BufferId);
+			StopRelay(Socket, EBUSY);
+		}
+		return;
+	}
+
+	relay->second.SendLen = 0;
+	relay->second.SendOffset = 0;
+	RecycleUringBuffer(BufferId);
+}
+
+void EventLoop::RecycleUringBuffer(unsigned short BufferId)
+{
+	Uring->RecycleBuffer(BufferId);
+
+	while (!StarvedRelays.empty())
+	{
+		std::pair<SOCKET, uint8_t> starved = StarvedRelays.back();
+		StarvedRelays.pop_back();
+
+		auto relay = UringRelays.find(starved.first);
+		if (relay != UringRelays.end() && relay->second.Generation == starved.second) {
+			ArmUringRecv(starved.first, starved.second);
+			break;
+		}
+	}
+}
+
+void EventLoop::StopRelay(SOCKET Socket, int ErrorCode)
+{
+	auto watcher = Watchers.find(Socket);
+	if (watcher == Watchers.end()) {
+		return;
+	}
+
+	std::shared_ptr<ProxyContext> context = watcher->second.Context;
+
+	context->OnRelayStopped(Socket, ErrorCode);
+
+	CloseIfDone(context);
+}
+#endif
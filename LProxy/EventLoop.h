@@ -0,0 +1,237 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include "ProxyStructures.h"
+#include "SharedUDPRelay.h"
+#include "PlatformSocket.h"
+#include "Poller.h"
+#include "TimingWheel.h"
+
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+
+#define EVENT_LOOP_WAIT_MSEC 1000
+#define EVENT_LOOP_MAX_ACCEPTS 64
+
+class ProxyContext;
+
+struct SocketEvent
+{
+	SOCKET Socket{INVALID_SOCKET};
+
+	EOperationType Operation{EOperationType::Read};
+};
+
+struct SocketWatcher
+{
+	std::shared_ptr<ProxyContext> Context;
+
+	bool bRead{true};
+
+	bool bWrite{false};
+};
+
+#ifdef __linux__
+// One direction of a connection relayed by io_uring, keyed by its receiving socket
+struct UringRelay
+{
+	SOCKET Peer{INVALID_SOCKET};
+
+	// Tells completions of a reused socket number apart
+	uint8_t Generation{0};
+
+	// Received bytes are counted as client bytes
+	bool bClientSide{false};
+
+	// Chunk sent to the peer, the next receive waits until all of it is taken.
+	unsigned int SendLen{0};
+	unsigned int SendOffset{0};
+};
+#endif
+
+/**
+* Readiness driven loop owned by one worker thread.
+* Every socket of a context is registered once, the context is only
+* touched when one of its sockets becomes ready or one of its timers expires.
+* How the loop waits is up to the poller of the configured backend, @see Poller
+*/
+class EventLoop
+{
+public:
+	EventLoop();
+
+	virtual ~EventLoop();
+
+	/**
+	* Hand an accepted socket to this loop, can be called from any thread.
+	* Its context is created in the loop thread, so it's allocated and recycled by the same thread.
+	*/
+	virtual void PostConnection(SOCKET Accepted, unsigned long long ConnectionId);
+
+	// Run a task in the loop thread, can be called from any thread.
+	virtual void PostTask(std::function<void()> Task);
+
+	/**
+	* Run a task for a context in the loop thread, can be called from any thread.
+	* Skipped when the context is already gone or closed, the context is closed after it when it's done.
+	*/
+	virtual void PostContextTask(std::weak_ptr<ProxyContext> Context, std::function<void(const std::shared_ptr<ProxyContext>&)> Task);
+
+	/**
+	* Accept connections of a non-blocking listener in this loop,
+	* so the whole life of these connections stays on this thread.
+	* Must be called in the loop thread, @see PostTask
+	*/
+	virtual bool WatchListener(SOCKET Listener);
+
+	// Stop accepting on a listener, it's closed by its owner afterwards. Must be called in the loop thread.
+	virtual void UnwatchListener(SOCKET Listener);
+
+	// Report readiness of a socket owned by the shared udp relay to it, @see SharedUDPRelay::HandleReadable
+	virtual bool WatchRelaySocket(SOCKET Socket);
+
+	virtual void UnwatchRelaySocket(SOCKET Socket);
+
+	virtual bool Watch(SOCKET Socket, std::shared_ptr<ProxyContext> Context, bool bRead = true, bool bWrite = false);
+
+	/**
+	* Change the readiness a watched socket is interested in.
+	* Errors and hang up are still reported as readable when nothing is watched.
+	*/
+	virtual bool Modify(SOCKET Socket, bool bRead, bool bWrite);
+
+	virtual void Unwatch(SOCKET Socket);
+
+	/**
+	* Call ProxyContext::HandleTimer after the delay, unless cancelled before.
+	* The delay is rounded up to TIMING_WHEEL_TICK_MSEC.
+	* @return Timer id, never 0.
+	*/
+	virtual uint64_t AddTimer(int DelayMsec, std::weak_ptr<ProxyContext> Context, ETimerType Type);
+
+	virtual void CancelTimer(uint64_t TimerId);
+
+	/**
+	* Relay a connected pair through io_uring, each side receives into a provided buffer
+	* and the send to its peer is linked with the next receive.
+	* The sockets leave the poller, the context is only called again to close it, @see ProxyContext::OnRelayStopped
+	* Must be called in the loop thread.
+	* @return false when the loop doesn't run on io_uring, the context keeps relaying readiness events then.
+	*/
+	virtual bool StartRelay(SOCKET Client, SOCKET Destination);
+
+	virtual void Run();
+
+	virtual void Stop();
+
+	virtual inline size_t GetWatchNum() const { return Watchers.size(); }
+
+	/**
+	* Relay sockets shared by the UDP associations of this loop, created on first use.
+	* @return nullptr when they can't be created.
+	*/
+	virtual SharedUDPRelay* GetUDPRelay();
+
+protected:
+	virtual bool InitPoller();
+
+	// Turn a ready socket of the poller into events of the loop.
+	virtual void CollectEvent(const PollerEvent& Event);
+
+	virtual void Wakeup();
+
+	virtual void DrainWakeup();
+
+	virtual void DrainPendingTasks();
+
+	virtual void AcceptConnections(SOCKET Listener);
+
+	virtual void AddConnection(SOCKET Accepted, unsigned long long ConnectionId);
+
+	virtual bool AddPollSocket(SOCKET Socket, bool bRead, bool bWrite);
+
+	virtual bool ModifyPollSocket(SOCKET Socket, bool bRead, bool bWrite);
+
+	virtual void RemovePollSocket(SOCKET Socket);
+
+	virtual int GetWaitTimeout();
+
+	virtual int WaitEvents(int TimeoutMsec);
+
+	virtual void DispatchEvent(const SocketEvent& Event);
+
+	virtual void DispatchTimers();
+
+	virtual void DispatchCompletions();
+
+	virtual void CloseIfDone(const std::shared_ptr<ProxyContext>& Context);
+
+#ifdef __linux__
+	virtual bool ArmUringAccept(SOCKET Listener);
+
+	virtual bool ArmUringRecv(SOCKET Socket, uint8_t Generation);
+
+	// Send the rest of the chunk in a buffer to the peer, linked with the next receive.
+	virtual bool ArmUringSend(SOCKET Socket, uint8_t Generation, unsigned short BufferId);
+
+	virtual void CancelUringOperations(SOCKET Socket);
+
+	virtual void HandleUringAccept(SOCKET Listener, const UringCompletion& Completion);
+
+	virtual void HandleUringRecv(SOCKET Socket, uint8_t Generation, const UringCompletion& Completion);
+
+	virtual void HandleUringSend(SOCKET Socket, uint8_t Generation, unsigned short BufferId, const UringCompletion& Completion);
+
+	// A buffer is free again, one relay which ran out of buffers receives into it.
+	virtual void RecycleUringBuffer(unsigned short BufferId);
+
+	virtual void StopRelay(SOCKET Socket, int ErrorCode);
+#endif
+
+protected:
+	std::unique_ptr<Poller> EventPoller;
+	std::vector<PollerEvent> PollerEvents;
+
+#ifdef __linux__
+	int WakeupHandle;
+
+	// Ring of the poller, only when IOBackend is IoUring and the kernel supports it.
+	IoUring* Uring;
+
+	std::unordered_map<SOCKET, UringRelay> UringRelays;
+	uint8_t NextRelayGeneration;
+
+	// Relays whose receive found no free buffer, they're armed again as buffers come back.
+	std::vector<std::pair<SOCKET, uint8_t>> StarvedRelays;
+#else
+	SOCKET WakeupSocket;
+	SOCKADDR_IN WakeupAddr;
+#endif
+
+	std::vector<SocketEvent> ReadyEvents;
+
+	std::unordered_map<SOCKET, SocketWatcher> Watchers;
+
+	std::unordered_set<SOCKET> Listeners;
+
+	std::unique_ptr<SharedUDPRelay> UDPRelay;
+
+	TimingWheel Timers;
+
+	// Closed contexts are kept until the current batch is dispatched, so their sockets can't be reused in it.
+	std::vector<std::shared_ptr<ProxyContext>> ClosedContexts;
+
+	std::vector<std::function<void()>> PendingTasks;
+	std::mutex PendingLock;
+
+	std::atomic<bool> bRunning;
+};
+
+#endif // !EVENT_LOOP_H
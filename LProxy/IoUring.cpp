@@ -0,0 +1,279 @@
+#include "IoUring.h"
+
+#ifdef __linux__
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+IoUring::IoUring()
+	: RingHandle(-1)
+	, SqRing(MAP_FAILED)
+	, SqRingSize(0)
+	, CqRing(MAP_FAILED)
+	, CqRingSize(0)
+	, Sqes(nullptr)
+	, SqesSize(0)
+	, SqHead(nullptr)
+	, SqTail(nullptr)
+	, SqArray(nullptr)
+	, SqMask(0)
+	, SqEntries(0)
+	, CqHead(nullptr)
+	, CqTail(nullptr)
+	, Cqes(nullptr)
+	, CqMask(0)
+	, SqeTail(0)
+	, PendingSubmits(0)
+	, BufferRing(nullptr)
+	, BufferRingSize(0)
+	, Buffers(nullptr)
+	, BufferNum(0)
+	, BufferSize(0)
+	, BufferGroup(0)
+	, BufferTail(0)
+{
+
+}
+
+IoUring::~IoUring()
+{
+	// Closing the ring cancels what's still in flight, the buffers are unmapped after it.
+	if (RingHandle >= 0) {
+		close(RingHandle);
+	}
+
+	if (Sqes != nullptr) {
+		munmap(Sqes, SqesSize);
+	}
+
+	if (CqRing != MAP_FAILED && CqRing != SqRing) {
+		munmap(CqRing, CqRingSize);
+	}
+
+	if (SqRing != MAP_FAILED) {
+		munmap(SqRing, SqRingSize);
+	}
+
+	if (BufferRing != nullptr) {
+		munmap(BufferRing, BufferRingSize);
+	}
+
+	if (Buffers != nullptr) {
+		munmap(Buffers, static_cast<size_t>(BufferNum) * BufferSize);
+	}
+}
+
+bool IoUring::Init(unsigned int QueueDepth, unsigned int CompletionDepth)
+{
+	io_uring_params params;
+	std::memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+	params.cq_entries = CompletionDepth;
+
+	RingHandle = static_cast<int>(syscall(__NR_io_uring_setup, QueueDepth, &params));
+	if (RingHandle < 0) {
+		return false;
+	}
+
+	// Waits with a timeout need EXT_ARG, and completions must never be dropped when the queue overflows.
+	if ((params.features & IORING_FEAT_EXT_ARG) == 0 || (params.features & IORING_FEAT_NODROP) == 0) {
+		errno = ENOSYS;
+		return false;
+	}
+
+	SqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	CqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+	bool bSingleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (bSingleMap) {
+		SqRingSize = CqRingSize = std::max(SqRingSize, CqRingSize);
+	}
+
+	SqRing = mmap(nullptr, SqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, RingHandle, IORING_OFF_SQ_RING);
+	if (SqRing == MAP_FAILED) {
+		return false;
+	}
+
+	CqRing = bSingleMap ? SqRing : mmap(nullptr, CqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, RingHandle, IORING_OFF_CQ_RING);
+	if (CqRing == MAP_FAILED) {
+		return false;
+	}
+
+	SqesSize = params.sq_entries * sizeof(io_uring_sqe);
+	void* sqes = mmap(nullptr, SqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, RingHandle, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		return false;
+	}
+	Sqes = static_cast<io_uring_sqe*>(sqes);
+
+	char* sqRing = static_cast<char*>(SqRing);
+	SqHead = reinterpret_cast<unsigned int*>(sqRing + params.sq_off.head);
+	SqTail = reinterpret_cast<unsigned int*>(sqRing + params.sq_off.tail);
+	SqArray = reinterpret_cast<unsigned int*>(sqRing + params.sq_off.array);
+	SqMask = *reinterpret_cast<unsigned int*>(sqRing + params.sq_off.ring_mask);
+	SqEntries = params.sq_entries;
+
+	char* cqRing = static_cast<char*>(CqRing);
+	CqHead = reinterpret_cast<unsigned int*>(cqRing + params.cq_off.head);
+	CqTail = reinterpret_cast<unsigned int*>(cqRing + params.cq_off.tail);
+	Cqes = reinterpret_cast<io_uring_cqe*>(cqRing + params.cq_off.cqes);
+	CqMask = *reinterpret_cast<unsigned int*>(cqRing + params.cq_off.ring_mask);
+
+	// Entries are always used in ring order, so the indirection array never changes.
+	for (unsigned int index = 0; index < SqEntries; index++)
+	{
+		SqArray[index] = index;
+	}
+
+	SqeTail = *SqTail;
+	return true;
+}
+
+bool IoUring::InitBufferRing(unsigned short InGroupId, unsigned int InBufferNum, unsigned int InBufferSize)
+{
+	BufferNum = InBufferNum;
+	BufferSize = InBufferSize;
+	BufferGroup = InGroupId;
+
+	BufferRingSize = BufferNum * sizeof(io_uring_buf);
+	void* bufferRing = mmap(nullptr, BufferRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (bufferRing == MAP_FAILED) {
+		return false;
+	}
+	BufferRing = static_cast<io_uring_buf_ring*>(bufferRing);
+
+	void* buffers = mmap(nullptr, static_cast<size_t>(BufferNum) * BufferSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buffers == MAP_FAILED) {
+		return false;
+	}
+	Buffers = static_cast<char*>(buffers);
+
+	io_uring_buf_reg reg;
+	std::memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = reinterpret_cast<uint64_t>(BufferRing);
+	reg.ring_entries = BufferNum;
+	reg.bgid = BufferGroup;
+
+	if (syscall(__NR_io_uring_register, RingHandle, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+		return false;
+	}
+
+	for (unsigned int index = 0; index < BufferNum; index++)
+	{
+		RecycleBuffer(static_cast<unsigned short>(index));
+	}
+
+	return true;
+}
+
+bool IoUring::Reserve(unsigned int Num)
+{
+	if (SqEntries - (SqeTail - __atomic_load_n(SqHead, __ATOMIC_ACQUIRE)) >= Num) {
+		return true;
+	}
+
+	Submit();
+
+	return SqEntries - (SqeTail - __atomic_load_n(SqHead, __ATOMIC_ACQUIRE)) >= Num;
+}
+
+io_uring_sqe* IoUring::GetSqe()
+{
+	if (!Reserve(1)) {
+		return nullptr;
+	}
+
+	io_uring_sqe* sqe = &Sqes[SqeTail & SqMask];
+	std::memset(sqe, 0, sizeof(*sqe));
+
+	SqeTail++;
+	PendingSubmits++;
+	__atomic_store_n(SqTail, SqeTail, __ATOMIC_RELEASE);
+
+	return sqe;
+}
+
+int IoUring::Submit()
+{
+	if (PendingSubmits == 0) {
+		return 0;
+	}
+
+	return Enter(PendingSubmits, 0, 0, nullptr, 0);
+}
+
+int IoUring::Wait(int TimeoutMsec, std::vector<UringCompletion>& Completions)
+{
+	// Nothing to wait for when completions are already queued.
+	if (__atomic_load_n(CqTail, __ATOMIC_ACQUIRE) != *CqHead) {
+		TimeoutMsec = 0;
+	}
+
+	if (TimeoutMsec > 0) {
+		__kernel_timespec timeout;
+		timeout.tv_sec = TimeoutMsec / 1000;
+		timeout.tv_nsec = static_cast<long long>(TimeoutMsec % 1000) * 1000000;
+
+		io_uring_getevents_arg arg;
+		std::memset(&arg, 0, sizeof(arg));
+		arg.ts = reinterpret_cast<uint64_t>(&timeout);
+
+		if (Enter(PendingSubmits, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) < 0 && errno != ETIME && errno != EINTR) {
+			return -1;
+		}
+	}
+	else if (Submit() < 0 && errno != EINTR) {
+		return -1;
+	}
+
+	return ReapCompletions(Completions);
+}
+
+void IoUring::RecycleBuffer(unsigned short BufferId)
+{
+	// The ring is an array of io_uring_buf, not bufs of io_uring_buf_ring, C++ puts that one behind an empty struct.
+	io_uring_buf* buffer = reinterpret_cast<io_uring_buf*>(BufferRing) + (BufferTail & (BufferNum - 1));
+	buffer->addr = reinterpret_cast<uint64_t>(GetBuffer(BufferId));
+	buffer->len = BufferSize;
+	buffer->bid = BufferId;
+
+	BufferTail++;
+	__atomic_store_n(&BufferRing->tail, BufferTail, __ATOMIC_RELEASE);
+}
+
+int IoUring::Enter(unsigned int SubmitNum, unsigned int WaitNum, unsigned int Flags, void* Arg, size_t ArgSize)
+{
+	int result = static_cast<int>(syscall(__NR_io_uring_enter, RingHandle, SubmitNum, WaitNum, Flags, Arg, ArgSize));
+	if (result > 0 && SubmitNum > 0) {
+		PendingSubmits -= std::min(static_cast<unsigned int>(result), PendingSubmits);
+	}
+
+	return result;
+}
+
+int IoUring::ReapCompletions(std::vector<UringCompletion>& Completions)
+{
+	unsigned int head = *CqHead;
+	unsigned int tail = __atomic_load_n(CqTail, __ATOMIC_ACQUIRE);
+
+	int reapNum(0);
+	for (; head != tail; head++, reapNum++)
+	{
+		const io_uring_cqe& cqe = Cqes[head & CqMask];
+
+		UringCompletion completion;
+		completion.UserData = cqe.user_data;
+		completion.Result = cqe.res;
+		completion.Flags = cqe.flags;
+		Completions.push_back(completion);
+	}
+
+	__atomic_store_n(CqHead, head, __ATOMIC_RELEASE);
+
+	return reapNum;
+}
+#endif
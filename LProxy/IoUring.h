@@ -0,0 +1,114 @@
+#ifndef IO_URING_H
+#define IO_URING_H
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#define IO_URING_QUEUE_DEPTH 1024
+#define IO_URING_COMPLETION_DEPTH 4096
+// Recv buffers shared by every relay of a loop, the number must be a power of 2
+#define IO_URING_BUFFER_NUM 512
+#define IO_URING_BUFFER_SIZE 16384
+#define IO_URING_BUFFER_GROUP 0
+
+struct UringCompletion
+{
+	uint64_t UserData{0};
+
+	int Result{0};
+
+	uint32_t Flags{0};
+};
+
+/**
+* Submission and completion rings of one event loop, over the raw system calls.
+* Recv buffers come from a provided buffer ring, the kernel picks one when data arrives,
+* so an idle connection holds no buffer while its recv is pending.
+* Needs Linux 5.19 or newer, Init fails on older kernels and the loop stays on epoll.
+*/
+class IoUring
+{
+public:
+	IoUring();
+
+	virtual ~IoUring();
+
+	virtual bool Init(unsigned int QueueDepth, unsigned int CompletionDepth);
+
+	// Register the buffers recv with IOSQE_BUFFER_SELECT picks from.
+	virtual bool InitBufferRing(unsigned short InGroupId, unsigned int InBufferNum, unsigned int InBufferSize);
+
+	// Make room for Num entries, so a linked chain isn't split by a submit in the middle.
+	virtual bool Reserve(unsigned int Num);
+
+	/**
+	* Next free submission entry, zeroed.
+	* The queued entries are submitted first when the queue is full.
+	* @return nullptr when the kernel doesn't take any of them.
+	*/
+	virtual io_uring_sqe* GetSqe();
+
+	// Hand the queued entries to the kernel without waiting.
+	virtual int Submit();
+
+	/**
+	* Submit the queued entries and wait up to TimeoutMsec for completions.
+	* @return Number of completions appended, -1 on failure.
+	*/
+	virtual int Wait(int TimeoutMsec, std::vector<UringCompletion>& Completions);
+
+	virtual inline char* GetBuffer(unsigned short BufferId) const { return Buffers + static_cast<size_t>(BufferId) * BufferSize; }
+
+	// Give a buffer back to the kernel once its data is consumed.
+	virtual void RecycleBuffer(unsigned short BufferId);
+
+	virtual inline unsigned short GetBufferGroup() const { return BufferGroup; }
+
+	virtual inline unsigned int GetBufferSize() const { return BufferSize; }
+
+protected:
+	virtual int Enter(unsigned int SubmitNum, unsigned int WaitNum, unsigned int Flags, void* Arg, size_t ArgSize);
+
+	virtual int ReapCompletions(std::vector<UringCompletion>& Completions);
+
+protected:
+	int RingHandle;
+
+	// Both rings share one mapping on kernels with IORING_FEAT_SINGLE_MMAP
+	void* SqRing;
+	size_t SqRingSize;
+	void* CqRing;
+	size_t CqRingSize;
+
+	io_uring_sqe* Sqes;
+	size_t SqesSize;
+
+	unsigned int* SqHead;
+	unsigned int* SqTail;
+	unsigned int* SqArray;
+	unsigned int SqMask;
+	unsigned int SqEntries;
+
+	unsigned int* CqHead;
+	unsigned int* CqTail;
+	io_uring_cqe* Cqes;
+	unsigned int CqMask;
+
+	// Local tail of the submission queue, published on submit
+	unsigned int SqeTail;
+	unsigned int PendingSubmits;
+
+	io_uring_buf_ring* BufferRing;
+	size_t BufferRingSize;
+	char* Buffers;
+	unsigned int BufferNum;
+	unsigned int BufferSize;
+	unsigned short BufferGroup;
+	unsigned short BufferTail;
+};
+#endif
+
+#endif // !IO_URING_H
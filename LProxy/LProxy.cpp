@@ -1,8 +1,6 @@
 // LProxy.cpp : This file contains the 'main' function. Program execution begins and ends there.
 //
 
-#include <iostream>
-
 #include "ProxyServer.h"
 #include "EasyLog.h"
 
@@ -10,9 +8,10 @@ int main()
 {
 	std::shared_ptr<ProxyServer> server = ProxyServer::Get();
 
-	server->RunServer();
-
-	std::cin.get();
+	// Serves until stopped, so it doesn't depend on stdin staying open when run as a daemon.
+	if (!server->RunServer()) {
+		return -1;
+	}
 
 	return 0;
 }
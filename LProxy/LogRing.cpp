@@ -0,0 +1,102 @@
+#include "LogRing.h"
+
+#include <cstring>
+
+LogRing::LogRing(size_t InCapacity)
+	: Capacity(64)
+	, Mask(0)
+	, Head(0)
+	, PeekSize(0)
+	, Tail(0)
+	, ReservedTail(0)
+	, ReservedSize(0)
+	, bDetached(false)
+{
+	while (Capacity < InCapacity)
+	{
+		Capacity <<= 1;
+	}
+
+	Mask = Capacity - 1;
+	Storage.resize(Capacity);
+}
+
+LogRing::~LogRing()
+{
+
+}
+
+char* LogRing::Reserve(uint32_t Size)
+{
+	uint64_t entrySize = GetEntrySize(Size);
+	if (entrySize > Capacity / 2) {
+		return nullptr;
+	}
+
+	uint64_t tail = Tail.load(std::memory_order_relaxed);
+	uint64_t head = Head.load(std::memory_order_acquire);
+
+	uint64_t offset = tail & Mask;
+	uint64_t contiguous = Capacity - offset;
+	uint64_t padding = entrySize > contiguous ? contiguous : 0;
+
+	if (tail + padding + entrySize - head > Capacity) {
+		return nullptr;
+	}
+
+	if (padding != 0) {
+		// Published together with the entry by Commit.
+		EntryHeader header{ static_cast<uint32_t>(padding), 1 };
+		std::memcpy(Storage.data() + offset, &header, sizeof(header));
+
+		tail += padding;
+		offset = 0;
+	}
+
+	ReservedTail = tail;
+	ReservedSize = Size;
+	return Storage.data() + offset + sizeof(EntryHeader);
+}
+
+void LogRing::Commit()
+{
+	EntryHeader header{ ReservedSize, 0 };
+	std::memcpy(Storage.data() + (ReservedTail & Mask), &header, sizeof(header));
+
+	Tail.store(ReservedTail + GetEntrySize(ReservedSize), std::memory_order_release);
+}
+
+const char* LogRing::Peek(uint32_t& Size)
+{
+	uint64_t head = Head.load(std::memory_order_relaxed);
+	uint64_t tail = Tail.load(std::memory_order_acquire);
+
+	while (head != tail)
+	{
+		EntryHeader header;
+		std::memcpy(&header, Storage.data() + (head & Mask), sizeof(header));
+
+		if (header.bPadding != 0) {
+			head += header.Size;
+			Head.store(head, std::memory_order_release);
+			continue;
+		}
+
+		Size = header.Size;
+		PeekSize = GetEntrySize(header.Size);
+		return Storage.data() + (head & Mask) + sizeof(EntryHeader);
+	}
+
+	return nullptr;
+}
+
+void LogRing::Pop()
+{
+	Head.store(Head.load(std::memory_order_relaxed) + PeekSize, std::memory_order_release);
+	PeekSize = 0;
+}
+
+size_t LogRing::GetUsedSize() const
+{
+	return static_cast<size_t>(Tail.load(std::memory_order_acquire) - Head.load(std::memory_order_acquire));
+}
@@ -0,0 +1,71 @@
+#ifndef LOG_RING_H
+#define LOG_RING_H
+
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/**
+* Single producer, single consumer ring of variable sized entries.
+* The producer is the thread owning the ring, the consumer is the log thread, neither ever takes a lock.
+* Entries are contiguous and 8 bytes aligned, an entry which doesn't fit before the end wraps around behind a padding.
+*/
+class LogRing
+{
+public:
+	// Capacity is rounded up to a power of two.
+	LogRing(size_t InCapacity);
+
+	virtual ~LogRing();
+
+	// Producer: space for an entry, nullptr when the ring is full.
+	virtual char* Reserve(uint32_t Size);
+
+	// Producer: publish the entry of the last successful Reserve.
+	virtual void Commit();
+
+	// Consumer: the oldest entry, nullptr when the ring is empty.
+	virtual const char* Peek(uint32_t& Size);
+
+	// Consumer: drop the entry of the last successful Peek.
+	virtual void Pop();
+
+	virtual size_t GetUsedSize() const;
+
+	virtual inline size_t GetCapacity() const { return Capacity; }
+
+	// The producer thread is gone, the ring goes away once it's drained.
+	virtual inline void SetDetached() { bDetached.store(true, std::memory_order_release); }
+
+	virtual inline bool IsDetached() const { return bDetached.load(std::memory_order_acquire); }
+
+protected:
+	struct EntryHeader
+	{
+		uint32_t Size;
+
+		// The rest of the ring before the end is unused.
+		uint32_t bPadding;
+	};
+
+	static inline uint64_t GetEntrySize(uint32_t Size) { return (sizeof(EntryHeader) + Size + 7) & ~static_cast<uint64_t>(7); }
+
+protected:
+	std::vector<char> Storage;
+	size_t Capacity;
+	uint64_t Mask;
+
+	// Written by the consumer only
+	alignas(64) std::atomic<uint64_t> Head;
+	uint64_t PeekSize;
+
+	// Written by the producer only
+	alignas(64) std::atomic<uint64_t> Tail;
+	uint64_t ReservedTail;
+	uint32_t ReservedSize;
+
+	std::atomic<bool> bDetached;
+};
+
+#endif // !LOG_RING_H
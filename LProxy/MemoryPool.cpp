@@ -0,0 +1,24 @@
+#include "MemoryPool.h"
+
+#include <cstdio>
+
+PoolCounters MemoryPool::ContextCounters;
+PoolCounters MemoryPool::BufferCounters;
+PoolCounters MemoryPool::FrameCounters;
+
+std::string MemoryPool::GetStatsString()
+{
+	char buffer[384] = { 0 };
+	std::snprintf(buffer, sizeof(buffer), "Context pool hits: %llu, misses: %llu, recycled: %llu. Buffer pool hits: %llu, misses: %llu, recycled: %llu. Frame pool hits: %llu, misses: %llu, recycled: %llu.",
+		static_cast<unsigned long long>(ContextCounters.Hits.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(ContextCounters.Misses.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(ContextCounters.Recycled.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(BufferCounters.Hits.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(BufferCounters.Misses.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(BufferCounters.Recycled.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(FrameCounters.Hits.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(FrameCounters.Misses.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(FrameCounters.Recycled.load(std::memory_order_relaxed)));
+
+	return buffer;
+}
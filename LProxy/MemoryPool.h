@@ -0,0 +1,134 @@
+#ifndef MEMORY_POOL_H
+#define MEMORY_POOL_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include <string>
+#include <vector>
+
+#define POOL_MAX_CACHED_BLOCKS 4096
+
+struct PoolCounters
+{
+	// Allocations served by a free list
+	std::atomic<uint64_t> Hits{0};
+
+	// Allocations which fell through to the global allocator
+	std::atomic<uint64_t> Misses{0};
+
+	// Frees kept in a free list for reuse
+	std::atomic<uint64_t> Recycled{0};
+};
+
+class MemoryPool
+{
+public:
+	static PoolCounters ContextCounters;
+	static PoolCounters BufferCounters;
+
+	// Coroutine frames of connection tasks, @see ConnectionTask::promise_type
+	static PoolCounters FrameCounters;
+
+	static std::string GetStatsString();
+};
+
+/**
+* Fixed size blocks cached per thread.
+* Event loops allocate and free a context in the same thread,
+* so the free list never needs a lock.
+*/
+template<size_t BlockSize>
+class ThreadBlockCache
+{
+public:
+	static void* Allocate(PoolCounters& Counters)
+	{
+		std::vector<void*>& blocks = GetFreeList().Blocks;
+		if (!blocks.empty()) {
+			void* block = blocks.back();
+			blocks.pop_back();
+			Counters.Hits.fetch_add(1, std::memory_order_relaxed);
+			return block;
+		}
+
+		Counters.Misses.fetch_add(1, std::memory_order_relaxed);
+		return ::operator new(BlockSize);
+	}
+
+	static void Free(void* Block, PoolCounters& Counters)
+	{
+		std::vector<void*>& blocks = GetFreeList().Blocks;
+		if (blocks.size() < POOL_MAX_CACHED_BLOCKS) {
+			blocks.push_back(Block);
+			Counters.Recycled.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+
+		::operator delete(Block);
+	}
+
+private:
+	struct FreeList
+	{
+		std::vector<void*> Blocks;
+
+		~FreeList()
+		{
+			for (void* block : Blocks)
+			{
+				::operator delete(block);
+			}
+		}
+	};
+
+	static FreeList& GetFreeList()
+	{
+		static thread_local FreeList freeList;
+		return freeList;
+	}
+};
+
+/**
+* Allocator for std::allocate_shared, the object and its control block
+* come from one pooled block.
+*/
+template<typename T>
+class PoolAllocator
+{
+public:
+	using value_type = T;
+
+	PoolAllocator() = default;
+
+	template<typename U>
+	PoolAllocator(const PoolAllocator<U>&) {}
+
+	T* allocate(size_t Num)
+	{
+		if (Num != 1) {
+			return static_cast<T*>(::operator new(Num * sizeof(T)));
+		}
+
+		return static_cast<T*>(ThreadBlockCache<sizeof(T)>::Allocate(MemoryPool::ContextCounters));
+	}
+
+	void deallocate(T* Block, size_t Num)
+	{
+		if (Num != 1) {
+			::operator delete(Block);
+			return;
+		}
+
+		ThreadBlockCache<sizeof(T)>::Free(Block, MemoryPool::ContextCounters);
+	}
+
+	template<typename U>
+	bool operator==(const PoolAllocator<U>&) const { return true; }
+
+	template<typename U>
+	bool operator!=(const PoolAllocator<U>&) const { return false; }
+};
+
+#endif // !MEMORY_POOL_H
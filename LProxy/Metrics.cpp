@@ -0,0 +1,287 @@
+#include "Metrics.h"
+#include "EasyLog.h"
+#include "MiscHelper.h"
+#include "MemoryPool.h"
+
+#include <thread>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+
+Metrics::MetricShard Metrics::Shards[METRICS_SHARD_NUM];
+std::atomic<int> Metrics::NextShard(0);
+
+const Metrics::HistogramInfo Metrics::Histograms[static_cast<int>(EMetricHistogram::Num)] =
+{
+	{ "lproxy_connect_duration_seconds", "Time to connect a destination, all attempts included.",
+		{ 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000 }, 13 },
+	{ "lproxy_dns_duration_seconds", "Time to resolve a destination name which missed the cache.",
+		{ 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000 }, 12 },
+	{ "lproxy_session_duration_seconds", "Lifetime of a client connection.",
+		{ 100000, 1000000, 5000000, 10000000, 30000000, 60000000, 300000000, 600000000, 1800000000, 3600000000LL, 21600000000LL, 86400000000LL }, 12 },
+};
+
+std::once_flag MetricsServer::InstanceOnceFlag;
+std::shared_ptr<MetricsServer> MetricsServer::Instance;
+
+void Metrics::Observe(EMetricHistogram Histogram, int64_t Micros)
+{
+	const HistogramInfo& info = Histograms[static_cast<int>(Histogram)];
+
+	int bucket(0);
+	while (bucket < info.BoundNum && Micros > info.Bounds[bucket])
+	{
+		bucket++;
+	}
+
+	MetricShard& shard = GetShard();
+	shard.Buckets[static_cast<int>(Histogram)][bucket].fetch_add(1, std::memory_order_relaxed);
+	shard.SumMicros[static_cast<int>(Histogram)].fetch_add(static_cast<uint64_t>(Micros > 0 ? Micros : 0), std::memory_order_relaxed);
+}
+
+std::string Metrics::GetText()
+{
+	std::string text;
+
+	uint64_t accepted = SumCounter(EMetricCounter::AcceptedConnections);
+	uint64_t closed = SumCounter(EMetricCounter::ClosedConnections);
+
+	AppendCounter(text, "lproxy_connections_accepted_total", "Accepted client connections.", "counter", accepted);
+	AppendCounter(text, "lproxy_connections_closed_total", "Closed client connections.", "counter", closed);
+	AppendCounter(text, "lproxy_connections_active", "Open client connections.", "gauge", accepted > closed ? accepted - closed : 0);
+	AppendCounter(text, "lproxy_client_bytes_total", "Bytes relayed from clients to destinations.", "counter", SumCounter(EMetricCounter::ClientBytes));
+	AppendCounter(text, "lproxy_destination_bytes_total", "Bytes relayed from destinations to clients.", "counter", SumCounter(EMetricCounter::DestinationBytes));
+	AppendCounter(text, "lproxy_udp_client_datagrams_total", "Datagrams relayed from UDP clients.", "counter", SumCounter(EMetricCounter::UDPClientDatagrams));
+	AppendCounter(text, "lproxy_udp_client_bytes_total", "Payload bytes relayed from UDP clients.", "counter", SumCounter(EMetricCounter::UDPClientBytes));
+	AppendCounter(text, "lproxy_udp_remote_datagrams_total", "Datagrams relayed to UDP clients.", "counter", SumCounter(EMetricCounter::UDPRemoteDatagrams));
+	AppendCounter(text, "lproxy_udp_remote_bytes_total", "Payload bytes relayed to UDP clients.", "counter", SumCounter(EMetricCounter::UDPRemoteBytes));
+	AppendCounter(text, "lproxy_udp_dropped_datagrams_total", "UDP datagrams dropped without a way to their destination.", "counter", SumCounter(EMetricCounter::UDPDroppedDatagrams));
+	AppendCounter(text, "lproxy_handshake_errors_total", "Clients rejected during method negotiation.", "counter", SumCounter(EMetricCounter::HandshakeErrors));
+	AppendCounter(text, "lproxy_dns_failures_total", "Destination names which couldn't be resolved.", "counter", SumCounter(EMetricCounter::DnsFailures));
+
+	static const char* ReplyNames[METRICS_REPLY_NUM] =
+	{
+		"Succeeded", "GeneralFailure", "RulesetNotAllowed", "NetworkUnreachable", "HostUnreachable",
+		"ConnectionRefused", "TTLExpired", "CmdNotSupported", "AddrNotSupported", "Unassigned",
+	};
+
+	text.append("# HELP lproxy_replies_total SOCKS5 replies sent to clients by reply code.\n");
+	text.append("# TYPE lproxy_replies_total counter\n");
+	for (int reply = 0; reply < METRICS_REPLY_NUM; reply++)
+	{
+		uint64_t value(0);
+		for (const MetricShard& shard : Shards)
+		{
+			value += shard.Replies[reply].load(std::memory_order_relaxed);
+		}
+
+		text.append("lproxy_replies_total{reply=\"").append(ReplyNames[reply]).append("\"} ").append(std::to_string(value)).append("\n");
+	}
+
+	for (int histogram = 0; histogram < static_cast<int>(EMetricHistogram::Num); histogram++)
+	{
+		AppendHistogram(text, static_cast<EMetricHistogram>(histogram));
+	}
+
+	AppendCounter(text, "lproxy_context_pool_hits_total", "Connection contexts served by a free list.", "counter", MemoryPool::ContextCounters.Hits.load(std::memory_order_relaxed));
+	AppendCounter(text, "lproxy_context_pool_misses_total", "Connection contexts taken from the global allocator.", "counter", MemoryPool::ContextCounters.Misses.load(std::memory_order_relaxed));
+	AppendCounter(text, "lproxy_buffer_pool_hits_total", "Relay buffers served by a free list.", "counter", MemoryPool::BufferCounters.Hits.load(std::memory_order_relaxed));
+	AppendCounter(text, "lproxy_buffer_pool_misses_total", "Relay buffers taken from the global allocator.", "counter", MemoryPool::BufferCounters.Misses.load(std::memory_order_relaxed));
+	AppendCounter(text, "lproxy_frame_pool_hits_total", "Connection task frames served by a free list.", "counter", MemoryPool::FrameCounters.Hits.load(std::memory_order_relaxed));
+	AppendCounter(text, "lproxy_frame_pool_misses_total", "Connection task frames taken from the global allocator.", "counter", MemoryPool::FrameCounters.Misses.load(std::memory_order_relaxed));
+
+	return text;
+}
+
+Metrics::MetricShard& Metrics::GetShard()
+{
+	// Event loops are long lived, each of them keeps the shard it got first.
+	static thread_local MetricShard* shard = &Shards[NextShard.fetch_add(1, std::memory_order_relaxed) % METRICS_SHARD_NUM];
+	return *shard;
+}
+
+uint64_t Metrics::SumCounter(EMetricCounter Counter)
+{
+	uint64_t value(0);
+	for (const MetricShard& shard : Shards)
+	{
+		value += shard.Counters[static_cast<int>(Counter)].load(std::memory_order_relaxed);
+	}
+
+	return value;
+}
+
+void Metrics::AppendCounter(std::string& Text, const char* Name, const char* Help, const char* Type, uint64_t Value)
+{
+	Text.append("# HELP ").append(Name).append(" ").append(Help).append("\n");
+	Text.append("# TYPE ").append(Name).append(" ").append(Type).append("\n");
+	Text.append(Name).append(" ").append(std::to_string(Value)).append("\n");
+}
+
+void Metrics::AppendHistogram(std::string& Text, EMetricHistogram Histogram)
+{
+	const HistogramInfo& info = Histograms[static_cast<int>(Histogram)];
+
+	Text.append("# HELP ").append(info.Name).append(" ").append(info.Help).append("\n");
+	Text.append("# TYPE ").append(info.Name).append(" histogram\n");
+
+	uint64_t count(0), sumMicros(0);
+	for (int bucket = 0; bucket <= info.BoundNum; bucket++)
+	{
+		for (const MetricShard& shard : Shards)
+		{
+			count += shard.Buckets[static_cast<int>(Histogram)][bucket].load(std::memory_order_relaxed);
+		}
+
+		char bound[32] = "+Inf";
+		if (bucket < info.BoundNum) {
+			std::snprintf(bound, sizeof(bound), "%g", static_cast<double>(info.Bounds[bucket]) / 1000000);
+		}
+
+		Text.append(info.Name).append("_bucket{le=\"").append(bound).append("\"} ").append(std::to_string(count)).append("\n");
+	}
+
+	for (const MetricShard& shard : Shards)
+	{
+		sumMicros += shard.SumMicros[static_cast<int>(Histogram)].load(std::memory_order_relaxed);
+	}
+
+	char sum[32] = { 0 };
+	std::snprintf(sum, sizeof(sum), "%.6f", static_cast<double>(sumMicros) / 1000000);
+
+	Text.append(info.Name).append("_sum ").append(sum).append("\n");
+	Text.append(info.Name).append("_count ").append(std::to_string(count)).append("\n");
+}
+
+MetricsServer::MetricsServer()
+	: Listener(INVALID_SOCKET)
+{
+
+}
+
+MetricsServer::~MetricsServer()
+{
+	if (Listener != INVALID_SOCKET) {
+		MiscHelper::CloseSocket(Listener);
+	}
+}
+
+std::shared_ptr<MetricsServer> MetricsServer::Get()
+{
+	std::call_once(InstanceOnceFlag,
+	[&]()
+	{
+		Instance = std::make_shared<MetricsServer>();
+	});
+
+	return Instance;
+}
+
+bool MetricsServer::Start(const std::string& InIP, int InPort)
+{
+	if (InPort <= 0 || Listener != INVALID_SOCKET) {
+		return false;
+	}
+
+	SOCKADDR_STORAGE addr;
+	if (!MiscHelper::ParseAddress(InIP, static_cast<unsigned short>(InPort), addr)) {
+		LOG(Error, "Wrong metrics address %s, it must be an IPv4 or IPv6 literal.", InIP.c_str());
+		return false;
+	}
+
+	SOCKET listener = socket(addr.ss_family, SOCK_STREAM, 0);
+	if (listener == INVALID_SOCKET) {
+		LOG(Error, "Create metrics listener failed, code: %d", MiscHelper::GetLastSocketError());
+		return false;
+	}
+
+	if (bind(listener, (SOCKADDR*)&addr, MiscHelper::GetAddressLength(addr)) == SOCKET_ERROR || listen(listener, SOMAXCONN) == SOCKET_ERROR) {
+		LOG(Error, "Metrics listen at %s:%d failed, code: %d", InIP.c_str(), InPort, MiscHelper::GetLastSocketError());
+		MiscHelper::CloseSocket(listener);
+		return false;
+	}
+
+	Listener = listener;
+
+	std::thread(
+	[this]()
+	{
+		ServeRequests();
+	}).detach();
+
+	LOG(Log, "Metrics endpoint listen at [%s:%d]", InIP.c_str(), InPort);
+	return true;
+}
+
+void MetricsServer::ServeRequests()
+{
+	while (true)
+	{
+		SOCKET accepted = accept(Listener, nullptr, nullptr);
+		if (accepted == INVALID_SOCKET) {
+			int errorCode = MiscHelper::GetLastSocketError();
+#ifdef __linux__
+			bool bClosed = errorCode == EBADF || errorCode == EINVAL;
+#else
+			bool bClosed = errorCode == WSAENOTSOCK || errorCode == WSAEINVAL || errorCode == WSANOTINITIALISED;
+#endif
+			if (bClosed) {
+				break;
+			}
+
+			continue;
+		}
+
+		HandleRequest(accepted);
+		MiscHelper::CloseSocket(accepted);
+	}
+}
+
+void MetricsServer::HandleRequest(SOCKET Accepted)
+{
+	// Scrapers send small requests at once, a client that stalls only holds this thread for the timeout.
+#ifdef __linux__
+	timeval timeout = { METRICS_RECV_TIMEOUT_MSEC / 1000, (METRICS_RECV_TIMEOUT_MSEC % 1000) * 1000 };
+#else
+	DWORD timeout = static_cast<DWORD>(METRICS_RECV_TIMEOUT_MSEC);
+#endif
+	setsockopt(Accepted, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+
+	char request[METRICS_REQUEST_MAX_SIZE + 1] = { 0 };
+	int requestLen(0);
+	while (requestLen < METRICS_REQUEST_MAX_SIZE && std::strstr(request, "\r\n\r\n") == nullptr)
+	{
+		int recvState = recv(Accepted, request + requestLen, METRICS_REQUEST_MAX_SIZE - requestLen, 0);
+		if (recvState <= 0) {
+			return;
+		}
+
+		requestLen += recvState;
+	}
+
+	if (std::strncmp(request, "GET /metrics ", 13) == 0 || std::strncmp(request, "GET / ", 6) == 0) {
+		SendResponse(Accepted, "200 OK", Metrics::GetText());
+	}
+	else {
+		SendResponse(Accepted, "404 Not Found", "Metrics are served at /metrics.\n");
+	}
+}
+
+void MetricsServer::SendResponse(SOCKET Accepted, const char* Status, const std::string& Body)
+{
+	std::string response = std::string("HTTP/1.0 ") + Status + "\r\n" +
+		"Content-Type: text/plain; version=0.0.4\r\n" +
+		"Content-Length: " + std::to_string(Body.size()) + "\r\n" +
+		"Connection: close\r\n\r\n" + Body;
+
+	int sentBytes(0);
+	while (sentBytes < static_cast<int>(response.size()))
+	{
+		int sendState = send(Accepted, response.data() + sentBytes, static_cast<int>(response.size()) - sentBytes, 0);
+		if (sendState == SOCKET_ERROR) {
+			return;
+		}
+
+		sentBytes += sendState;
+	}
+}
@@ -0,0 +1,153 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "PlatformSocket.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+// Counter shards, threads beyond it share shards round-robin
+#define METRICS_SHARD_NUM 16
+#define METRICS_MAX_BUCKETS 16
+// SOCKS5 reply codes counted by their value, Succeeded up to Unassigned
+#define METRICS_REPLY_NUM 10
+#define METRICS_REQUEST_MAX_SIZE 4096
+#define METRICS_RECV_TIMEOUT_MSEC 1000
+
+enum class EMetricCounter
+{
+	AcceptedConnections = 0,
+	ClosedConnections,
+
+	// Bytes relayed from clients to destinations and back
+	ClientBytes,
+	DestinationBytes,
+
+	UDPClientDatagrams,
+	UDPClientBytes,
+	UDPRemoteDatagrams,
+	UDPRemoteBytes,
+
+	// Datagrams with no way to their destination
+	UDPDroppedDatagrams,
+
+	// Method negotiation failed before any request
+	HandshakeErrors,
+	DnsFailures,
+
+	Num,
+};
+
+enum class EMetricHistogram
+{
+	// From the first connect attempt to the connected destination
+	ConnectTime = 0,
+
+	// Lookups which missed the cache
+	DnsTime,
+
+	// From accept to close of a connection
+	SessionDuration,
+
+	Num,
+};
+
+/**
+* Process wide counters and histograms.
+* Every thread updates its own cache line sized shard with relaxed atomics,
+* only the export sums the shards, so event loops never contend on a counter.
+*/
+class Metrics
+{
+public:
+	static inline void Add(EMetricCounter Counter, uint64_t Value = 1)
+	{
+		GetShard().Counters[static_cast<int>(Counter)].fetch_add(Value, std::memory_order_relaxed);
+	}
+
+	// Count a SOCKS5 reply by its code, @see ETravelResponse
+	static inline void AddReply(int Response)
+	{
+		if (Response >= 0 && Response < METRICS_REPLY_NUM) {
+			GetShard().Replies[Response].fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	static void Observe(EMetricHistogram Histogram, int64_t Micros);
+
+	// All metrics in the Prometheus text exposition format.
+	static std::string GetText();
+
+protected:
+	struct alignas(64) MetricShard
+	{
+		std::atomic<uint64_t> Counters[static_cast<int>(EMetricCounter::Num)];
+
+		std::atomic<uint64_t> Replies[METRICS_REPLY_NUM];
+
+		// Observations per bucket, not cumulative, the last one is +Inf.
+		std::atomic<uint64_t> Buckets[static_cast<int>(EMetricHistogram::Num)][METRICS_MAX_BUCKETS + 1];
+
+		std::atomic<uint64_t> SumMicros[static_cast<int>(EMetricHistogram::Num)];
+	};
+
+	struct HistogramInfo
+	{
+		const char* Name;
+		const char* Help;
+
+		// Upper bounds in microseconds, ascending
+		int64_t Bounds[METRICS_MAX_BUCKETS];
+		int BoundNum;
+	};
+
+	static MetricShard& GetShard();
+
+	static uint64_t SumCounter(EMetricCounter Counter);
+
+	static void AppendCounter(std::string& Text, const char* Name, const char* Help, const char* Type, uint64_t Value);
+
+	static void AppendHistogram(std::string& Text, EMetricHistogram Histogram);
+
+protected:
+	static MetricShard Shards[METRICS_SHARD_NUM];
+	static std::atomic<int> NextShard;
+
+	static const HistogramInfo Histograms[static_cast<int>(EMetricHistogram::Num)];
+};
+
+/**
+* Serves GET /metrics over plain HTTP on its own thread and port, away from the proxy listener.
+* Meant for a local scraper, it answers one short request per connection.
+*/
+class MetricsServer
+{
+public:
+	MetricsServer();
+
+	virtual ~MetricsServer();
+
+	static std::shared_ptr<MetricsServer> Get();
+
+	// Bind the endpoint and start serving, a port of 0 leaves it off.
+	virtual bool Start(const std::string& InIP, int InPort);
+
+protected:
+	virtual void ServeRequests();
+
+	virtual void HandleRequest(SOCKET Accepted);
+
+	virtual void SendResponse(SOCKET Accepted, const char* Status, const std::string& Body);
+
+protected:
+	static std::once_flag InstanceOnceFlag;
+	static std::shared_ptr<MetricsServer> Instance;
+
+	SOCKET Listener;
+};
+
+#endif // !METRICS_H
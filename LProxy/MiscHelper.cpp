@@ -8,7 +8,13 @@
 #include <iostream>
 #include <ctime>
 #include <random>
-#include <WS2tcpip.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <csignal>
+#include <cerrno>
+#include <sys/uio.h>
+#endif
 
 std::string MiscHelper::GetDateNow()
 {
@@ -35,6 +41,7 @@ std::string MiscHelper::GetDateTime()
 	return buffer;
 }
 
+#ifndef __linux__
 void MiscHelper::CloseProcessByHandle(DWORD ProcessId)
 {
 	EnumWindows(
@@ -53,6 +60,7 @@ void MiscHelper::CloseProcessByHandle(DWORD ProcessId)
 		return TRUE;
 	}, (LPARAM)&ProcessId);
 }
+#endif
 
 Json MiscHelper::LoadConfig()
 {
@@ -100,7 +108,7 @@ bool MiscHelper::GetLocalHostS(unsigned long& IP)
 
 	int error = getaddrinfo(hostName, nullptr, &info, &result);
 	if (error != 0) {
-		LOG(Warning, "Convert hostname to ip address failed, err: %s.", gai_strerrorA(error));
+		LOG(Warning, "Convert hostname to ip address failed, err: %s.", GetAddressInfoError(error));
 		return false;
 	}
 
@@ -131,32 +139,292 @@ std::string MiscHelper::NewGuid(int Length)
 	return stream.str();
 }
 
-bool MiscHelper::GetAvaliablePort(unsigned short Port, bool bTCP, int IPType)
+bool MiscHelper::GetAvaliablePort(unsigned short& Port, bool bTCP, int IPType)
 {
 	SOCKET sock = socket(IPType, bTCP ? SOCK_STREAM : SOCK_DGRAM, 0);
 
 	SOCKADDR_IN addr;
 	std::memset(&addr, 0, sizeof(addr));
 	addr.sin_family = IPType;
-	addr.sin_addr.s_addr = htonl(ADDR_ANY);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
 	addr.sin_port = 0;
 
 	int state = bind(sock, (SOCKADDR*)&addr, sizeof(addr));
 	if (state != 0) {
-		closesocket(sock);
+		CloseSocket(sock);
 		return false;
 	}
 
 	SOCKADDR_IN resultAddr;
 	std::memset(&resultAddr, 0, sizeof(resultAddr));
-	int addrLen = static_cast<int>(sizeof(resultAddr));
+	socklen_t addrLen = static_cast<socklen_t>(sizeof(resultAddr));
 	state = getsockname(sock, (SOCKADDR*)&resultAddr, &addrLen);
 	if (state != 0) {
-		closesocket(sock);
+		CloseSocket(sock);
 		return false;
 	}
 
 	Port = ntohs(resultAddr.sin_port);
-	closesocket(sock);
+	CloseSocket(sock);
+	return true;
+}
+
+bool MiscHelper::SetNonBlocking(SOCKET Socket, bool bNonBlocking)
+{
+#ifdef __linux__
+	int flags = fcntl(static_cast<int>(Socket), F_GETFL, 0);
+	if (flags < 0) {
+		return false;
+	}
+
+	flags = bNonBlocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+	return fcntl(static_cast<int>(Socket), F_SETFL, flags) == 0;
+#else
+	u_long mode = bNonBlocking ? 1 : 0;
+	return ioctlsocket(Socket, FIONBIO, &mode) == 0;
+#endif
+}
+
+bool MiscHelper::StartupSockets()
+{
+#ifdef __linux__
+	// A send to a peer which closed must fail with EPIPE instead of killing the process.
+	signal(SIGPIPE, SIG_IGN);
 	return true;
+#else
+	WSADATA wsaData;
+	if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+		LOG(Error, "Startup WSA failed.");
+		return false;
+	}
+
+	if (LOBYTE(wsaData.wVersion) != 2 || HIBYTE(wsaData.wVersion) != 2) {
+		LOG(Error, "Incorrect socket library version.");
+		WSACleanup();
+		return false;
+	}
+
+	return true;
+#endif
+}
+
+void MiscHelper::CleanupSockets()
+{
+#ifndef __linux__
+	WSACleanup();
+#endif
+}
+
+int MiscHelper::CloseSocket(SOCKET Socket)
+{
+#ifdef __linux__
+	return close(Socket);
+#else
+	return closesocket(Socket);
+#endif
+}
+
+const char* MiscHelper::GetAddressInfoError(int ErrorCode)
+{
+#ifdef __linux__
+	return gai_strerror(ErrorCode);
+#else
+	return gai_strerrorA(ErrorCode);
+#endif
+}
+
+int MiscHelper::WaitReadable(SOCKET Socket, int TimeoutMsec)
+{
+#ifdef __linux__
+	pollfd pollSocket;
+	pollSocket.fd = Socket;
+	pollSocket.events = POLLIN;
+	pollSocket.revents = 0;
+	int readyNum = poll(&pollSocket, 1, TimeoutMsec);
+#else
+	WSAPOLLFD pollSocket;
+	pollSocket.fd = Socket;
+	pollSocket.events = POLLRDNORM;
+	pollSocket.revents = 0;
+	int readyNum = WSAPoll(&pollSocket, 1, TimeoutMsec);
+#endif
+	return readyNum > 0 ? 1 : readyNum;
+}
+
+int MiscHelper::GetLastSocketError()
+{
+#ifdef __linux__
+	return errno;
+#else
+	return WSAGetLastError();
+#endif
+}
+
+bool MiscHelper::IsConnectInProgress(int ErrorCode)
+{
+#ifdef __linux__
+	return ErrorCode == EINPROGRESS;
+#else
+	return ErrorCode == WSAEWOULDBLOCK;
+#endif
+}
+
+bool MiscHelper::IsWouldBlock(int ErrorCode)
+{
+#ifdef __linux__
+	return ErrorCode == EAGAIN || ErrorCode == EWOULDBLOCK || ErrorCode == EINTR;
+#else
+	return ErrorCode == WSAEWOULDBLOCK || ErrorCode == WSAEINTR;
+#endif
+}
+
+bool MiscHelper::IsDatagramError(int ErrorCode)
+{
+#ifdef __linux__
+	return ErrorCode == ECONNREFUSED || ErrorCode == EMSGSIZE;
+#else
+	return ErrorCode == WSAECONNRESET || ErrorCode == WSAEMSGSIZE;
+#endif
+}
+
+bool MiscHelper::ParseAddress(const std::string& IP, unsigned short Port, SOCKADDR_STORAGE& Addr)
+{
+	std::memset(&Addr, 0, sizeof(Addr));
+
+	SOCKADDR_IN6* addrIn6 = (SOCKADDR_IN6*)&Addr;
+	if (inet_pton(AF_INET6, IP.c_str(), &addrIn6->sin6_addr) == 1) {
+		addrIn6->sin6_family = AF_INET6;
+		addrIn6->sin6_port = htons(Port);
+		return true;
+	}
+
+	SOCKADDR_IN* addrIn = (SOCKADDR_IN*)&Addr;
+	if (inet_pton(AF_INET, IP.c_str(), &addrIn->sin_addr) == 1) {
+		addrIn->sin_family = AF_INET;
+		addrIn->sin_port = htons(Port);
+		return true;
+	}
+
+	std::memset(&Addr, 0, sizeof(Addr));
+	return false;
+}
+
+int MiscHelper::GetAddressLength(const SOCKADDR_STORAGE& Addr)
+{
+	return static_cast<int>(Addr.ss_family == AF_INET6 ? sizeof(SOCKADDR_IN6) : sizeof(SOCKADDR_IN));
+}
+
+std::string MiscHelper::AddressToString(const SOCKADDR_STORAGE& Addr)
+{
+	char addrBuffer[INET6_ADDRSTRLEN] = { 0 };
+
+	if (Addr.ss_family == AF_INET6) {
+		const SOCKADDR_IN6* addrIn6 = (const SOCKADDR_IN6*)&Addr;
+		inet_ntop(AF_INET6, &addrIn6->sin6_addr, addrBuffer, INET6_ADDRSTRLEN);
+		std::string addrString("[");
+		addrString += addrBuffer;
+		addrString += "]:";
+		addrString += std::to_string(ntohs(addrIn6->sin6_port));
+		return addrString;
+	}
+
+	const SOCKADDR_IN* addrIn = (const SOCKADDR_IN*)&Addr;
+	inet_ntop(AF_INET, &addrIn->sin_addr, addrBuffer, INET6_ADDRSTRLEN);
+	return std::string(addrBuffer) + ":" + std::to_string(ntohs(addrIn->sin_port));
+}
+
+void MiscHelper::UnmapAddress(SOCKADDR_STORAGE& Addr)
+{
+	if (Addr.ss_family != AF_INET6) {
+		return;
+	}
+
+	// ::ffff:a.b.c.d, an IPv4 peer of a dual-stack socket
+	static const unsigned char mappedPrefix[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+	SOCKADDR_IN6 addrIn6 = *(SOCKADDR_IN6*)&Addr;
+	if (std::memcmp(&addrIn6.sin6_addr, mappedPrefix, sizeof(mappedPrefix)) != 0) {
+		return;
+	}
+
+	std::memset(&Addr, 0, sizeof(Addr));
+
+	SOCKADDR_IN* addrIn = (SOCKADDR_IN*)&Addr;
+	addrIn->sin_family = AF_INET;
+	addrIn->sin_port = addrIn6.sin6_port;
+	std::memcpy(&addrIn->sin_addr, ((const unsigned char*)&addrIn6.sin6_addr) + 12, 4);
+}
+
+bool MiscHelper::MapAddress(SOCKADDR_STORAGE& Addr, int Family)
+{
+	if (Addr.ss_family == Family) {
+		return true;
+	}
+
+	// Only an IPv4 address can be carried by an IPv6 socket, as ::ffff:a.b.c.d
+	if (Addr.ss_family != AF_INET || Family != AF_INET6) {
+		return false;
+	}
+
+	SOCKADDR_IN addrIn = *(SOCKADDR_IN*)&Addr;
+
+	std::memset(&Addr, 0, sizeof(Addr));
+
+	SOCKADDR_IN6* addrIn6 = (SOCKADDR_IN6*)&Addr;
+	addrIn6->sin6_family = AF_INET6;
+	addrIn6->sin6_port = addrIn.sin_port;
+
+	unsigned char* bytes = (unsigned char*)&addrIn6->sin6_addr;
+	bytes[10] = 0xff;
+	bytes[11] = 0xff;
+	std::memcpy(bytes + 12, &addrIn.sin_addr, 4);
+
+	return true;
+}
+
+bool MiscHelper::IsSameAddress(const SOCKADDR_STORAGE& Left, const SOCKADDR_STORAGE& Right, bool bComparePort)
+{
+	if (Left.ss_family != Right.ss_family) {
+		return false;
+	}
+
+	if (Left.ss_family == AF_INET6) {
+		const SOCKADDR_IN6* left = (const SOCKADDR_IN6*)&Left;
+		const SOCKADDR_IN6* right = (const SOCKADDR_IN6*)&Right;
+		return std::memcmp(&left->sin6_addr, &right->sin6_addr, 16) == 0 && (!bComparePort || left->sin6_port == right->sin6_port);
+	}
+
+	const SOCKADDR_IN* left = (const SOCKADDR_IN*)&Left;
+	const SOCKADDR_IN* right = (const SOCKADDR_IN*)&Right;
+	return left->sin_addr.s_addr == right->sin_addr.s_addr && (!bComparePort || left->sin_port == right->sin_port);
+}
+
+bool MiscHelper::SendDatagram(SOCKET Socket, const char* Header, int HeaderLen, const char* Data, int DataLen, const SOCKADDR_STORAGE& Addr)
+{
+	// Header and payload leave in one gather write, the payload is never copied behind the header.
+#ifdef __linux__
+	iovec vectors[2];
+	vectors[0].iov_base = (void*)Header;
+	vectors[0].iov_len = static_cast<size_t>(HeaderLen);
+	vectors[1].iov_base = (void*)Data;
+	vectors[1].iov_len = static_cast<size_t>(DataLen);
+
+	msghdr message;
+	std::memset(&message, 0, sizeof(message));
+	message.msg_name = (void*)&Addr;
+	message.msg_namelen = static_cast<socklen_t>(GetAddressLength(Addr));
+	message.msg_iov = vectors;
+	message.msg_iovlen = 2;
+
+	return sendmsg(static_cast<int>(Socket), &message, 0) >= 0;
+#else
+	WSABUF buffers[2];
+	buffers[0].len = static_cast<ULONG>(HeaderLen);
+	buffers[0].buf = (CHAR*)Header;
+	buffers[1].len = static_cast<ULONG>(DataLen);
+	buffers[1].buf = (CHAR*)Data;
+
+	DWORD sentBytes(0);
+	return WSASendTo(Socket, buffers, 2, &sentBytes, 0, (const SOCKADDR*)&Addr, GetAddressLength(Addr), nullptr, nullptr) == 0;
+#endif
 }
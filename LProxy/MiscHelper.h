@@ -2,12 +2,15 @@
 #define MISC_HELPER_H
 
 #include "json.hpp"
+#include "PlatformSocket.h"
 
 #include <string>
-#include <WinSock2.h>
-#include <windows.h>
 #include <vector>
 
+#ifndef __linux__
+#include <windows.h>
+#endif
+
 using Json = nlohmann::json;
 
 class MiscHelper
@@ -15,11 +18,32 @@ class MiscHelper
 public:
 	static std::string GetDateNow();
 	static std::string GetDateTime();
+#ifndef __linux__
 	static void CloseProcessByHandle(DWORD ProcessId);
+#endif
 	static Json	LoadConfig();
 	static bool GetLocalHostS(unsigned long& IP);
 	static std::string NewGuid(int Length);
-	static bool GetAvaliablePort(unsigned short Port, bool bTCP = true, int IPType = AF_INET);
+	static bool GetAvaliablePort(unsigned short& Port, bool bTCP = true, int IPType = AF_INET);
+	// The socket library has to be started before the first socket is created.
+	static bool StartupSockets();
+	static void CleanupSockets();
+	static int CloseSocket(SOCKET Socket);
+	static const char* GetAddressInfoError(int ErrorCode);
+	static bool SetNonBlocking(SOCKET Socket, bool bNonBlocking = true);
+	// @return 1 when readable, 0 on timeout, SOCKET_ERROR on failure.
+	static int WaitReadable(SOCKET Socket, int TimeoutMsec);
+	static int GetLastSocketError();
+	static bool IsConnectInProgress(int ErrorCode);
+	static bool IsWouldBlock(int ErrorCode);
+	static bool IsDatagramError(int ErrorCode);
+	static bool ParseAddress(const std::string& IP, unsigned short Port, SOCKADDR_STORAGE& Addr);
+	static int GetAddressLength(const SOCKADDR_STORAGE& Addr);
+	static std::string AddressToString(const SOCKADDR_STORAGE& Addr);
+	static void UnmapAddress(SOCKADDR_STORAGE& Addr);
+	static bool MapAddress(SOCKADDR_STORAGE& Addr, int Family);
+	static bool IsSameAddress(const SOCKADDR_STORAGE& Left, const SOCKADDR_STORAGE& Right, bool bComparePort);
+	static bool SendDatagram(SOCKET Socket, const char* Header, int HeaderLen, const char* Data, int DataLen, const SOCKADDR_STORAGE& Addr);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,35 @@
+#ifndef PLATFORM_SOCKET_H
+#define PLATFORM_SOCKET_H
+
+/**
+* Socket headers of the platform, the proxy includes this instead of WinSock directly.
+* Linux gets the few WinSock type names the code shares, calls which differ go through MiscHelper.
+*/
+#ifdef __linux__
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+
+typedef int SOCKET;
+
+typedef struct sockaddr SOCKADDR;
+typedef struct sockaddr_in SOCKADDR_IN;
+typedef struct sockaddr_in6 SOCKADDR_IN6;
+typedef struct sockaddr_storage SOCKADDR_STORAGE;
+typedef struct addrinfo ADDRINFO;
+
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#else
+#include <WinSock2.h>
+#include <WS2tcpip.h>
+#endif
+
+#endif // !PLATFORM_SOCKET_H
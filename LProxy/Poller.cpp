@@ -0,0 +1,458 @@
+#include "Poller.h"
+#include "EasyLog.h"
+#include "MiscHelper.h"
+
+#include <algorithm>
+#include <cstring>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/select.h>
+
+#define POLLER_INTERRUPTED EINTR
+#else
+#define POLLER_INTERRUPTED WSAEINTR
+#endif
+
+Poller::Poller()
+{
+
+}
+
+Poller::~Poller()
+{
+
+}
+
+std::unique_ptr<Poller> Poller::Create(EIOBackend Backend)
+{
+	std::unique_ptr<Poller> poller;
+
+	switch (Backend)
+	{
+	case EIOBackend::Select:
+		poller.reset(new SelectPoller());
+		break;
+
+	case EIOBackend::Poll:
+		poller.reset(new PollPoller());
+		break;
+
+#ifdef __linux__
+	case EIOBackend::Epoll:
+		poller.reset(new EpollPoller());
+		break;
+
+	case EIOBackend::IoUring:
+		poller.reset(new UringPoller());
+		break;
+#endif
+
+	default:
+		LOG(Warning, "IO backend %d is not available on this platform, fall back to the default one.", static_cast<int>(Backend));
+		break;
+	}
+
+	if (poller != nullptr && poller->Init()) {
+		return poller;
+	}
+
+	if (poller != nullptr) {
+		LOG(Warning, "Init %s poller failed, code: %d, fall back to the default one.", poller->GetName(), MiscHelper::GetLastSocketError());
+	}
+
+#ifdef __linux__
+	poller.reset(new EpollPoller());
+#else
+	poller.reset(new PollPoller());
+#endif
+
+	if (!poller->Init()) {
+		LOG(Error, "Init %s poller failed, code: %d", poller->GetName(), MiscHelper::GetLastSocketError());
+		return nullptr;
+	}
+
+	return poller;
+}
+
+SelectPoller::SelectPoller()
+{
+
+}
+
+SelectPoller::~SelectPoller()
+{
+
+}
+
+bool SelectPoller::Init()
+{
+	return true;
+}
+
+bool SelectPoller::Add(SOCKET Socket, bool bRead, bool bWrite)
+{
+	// fd_set of Linux is a bitmap indexed by the socket, the one of Windows a fixed array of sockets.
+#ifdef __linux__
+	bool bFull = Socket >= FD_SETSIZE;
+#else
+	bool bFull = Interests.size() >= FD_SETSIZE;
+#endif
+
+	if (bFull) {
+		LOG(Error, "Add socket %d to select failed, more than %d sockets.", static_cast<int>(Socket), FD_SETSIZE);
+		return false;
+	}
+
+	SelectInterest& interest = Interests[Socket];
+	interest.bRead = bRead;
+	interest.bWrite = bWrite;
+	return true;
+}
+
+bool SelectPoller::Modify(SOCKET Socket, bool bRead, bool bWrite)
+{
+	auto interest = Interests.find(Socket);
+	if (interest == Interests.end()) {
+		return false;
+	}
+
+	interest->second.bRead = bRead;
+	interest->second.bWrite = bWrite;
+	return true;
+}
+
+void SelectPoller::Remove(SOCKET Socket)
+{
+	Interests.erase(Socket);
+}
+
+int SelectPoller::Wait(int TimeoutMsec, std::vector<PollerEvent>& Events)
+{
+	fd_set readSet;
+	fd_set writeSet;
+	fd_set exceptSet;
+	FD_ZERO(&readSet);
+	FD_ZERO(&writeSet);
+	FD_ZERO(&exceptSet);
+
+	SOCKET maxSocket = 0;
+	for (const auto& interest : Interests)
+	{
+		// Every socket is in the except set, a failed connect of Windows is only reported there.
+		FD_SET(interest.first, &exceptSet);
+
+		if (interest.second.bRead) {
+			FD_SET(interest.first, &readSet);
+		}
+
+		if (interest.second.bWrite) {
+			FD_SET(interest.first, &writeSet);
+		}
+
+		maxSocket = std::max(maxSocket, interest.first);
+	}
+
+	timeval timeout;
+	timeout.tv_sec = TimeoutMsec / 1000;
+	timeout.tv_usec = (TimeoutMsec % 1000) * 1000;
+
+	int readyNum = select(static_cast<int>(maxSocket) + 1, &readSet, &writeSet, &exceptSet, &timeout);
+	if (readyNum == SOCKET_ERROR) {
+		int errorCode = MiscHelper::GetLastSocketError();
+		if (errorCode != POLLER_INTERRUPTED) {
+			LOG(Error, "Wait select events failed, code: %d", errorCode);
+		}
+		return -1;
+	}
+
+	if (readyNum == 0) {
+		return 0;
+	}
+
+	size_t eventNum = Events.size();
+	for (const auto& interest : Interests)
+	{
+		PollerEvent event;
+		event.Socket = interest.first;
+		event.bReadable = FD_ISSET(interest.first, &readSet) != 0;
+		event.bWritable = FD_ISSET(interest.first, &writeSet) != 0;
+		event.bFailed = FD_ISSET(interest.first, &exceptSet) != 0;
+
+		if (event.bReadable || event.bWritable || event.bFailed) {
+			Events.push_back(event);
+		}
+	}
+
+	return static_cast<int>(Events.size() - eventNum);
+}
+
+PollPoller::PollPoller()
+{
+
+}
+
+PollPoller::~PollPoller()
+{
+
+}
+
+// The loop wakeup is an eventfd on Linux, which only reports POLLIN and POLLOUT.
+static inline short GetPollEvents(bool bRead, bool bWrite)
+{
+	return static_cast<short>((bRead ? POLLIN : 0) | (bWrite ? POLLOUT : 0));
+}
+
+bool PollPoller::Init()
+{
+	return true;
+}
+
+bool PollPoller::Add(SOCKET Socket, bool bRead, bool bWrite)
+{
+	if (PollIndex.count(Socket) != 0) {
+		return false;
+	}
+
+	PollIndex[Socket] = PollList.size();
+
+	PollList.emplace_back();
+	PollList.back().fd = Socket;
+	PollList.back().events = GetPollEvents(bRead, bWrite);
+	PollList.back().revents = 0;
+	return true;
+}
+
+bool PollPoller::Modify(SOCKET Socket, bool bRead, bool bWrite)
+{
+	auto index = PollIndex.find(Socket);
+	if (index == PollIndex.end()) {
+		return false;
+	}
+
+	PollList[index->second].events = GetPollEvents(bRead, bWrite);
+	return true;
+}
+
+void PollPoller::Remove(SOCKET Socket)
+{
+	auto index = PollIndex.find(Socket);
+	if (index == PollIndex.end()) {
+		return;
+	}
+
+	size_t position = index->second;
+	PollIndex.erase(index);
+
+	if (position + 1 != PollList.size()) {
+		PollList[position] = PollList.back();
+		PollIndex[PollList[position].fd] = position;
+	}
+
+	PollList.pop_back();
+}
+
+int PollPoller::Wait(int TimeoutMsec, std::vector<PollerEvent>& Events)
+{
+#ifdef __linux__
+	int readyNum = poll(PollList.data(), PollList.size(), TimeoutMsec);
+#else
+	int readyNum = WSAPoll(PollList.data(), static_cast<unsigned long>(PollList.size()), TimeoutMsec);
+#endif
+
+	if (readyNum == SOCKET_ERROR) {
+		int errorCode = MiscHelper::GetLastSocketError();
+		if (errorCode != POLLER_INTERRUPTED) {
+			LOG(Error, "Wait poll events failed, code: %d", errorCode);
+		}
+		return -1;
+	}
+
+	if (readyNum == 0) {
+		return 0;
+	}
+
+	size_t eventNum = Events.size();
+	for (auto& pollFd : PollList)
+	{
+		if (pollFd.revents == 0) {
+			continue;
+		}
+
+		PollerEvent event;
+		event.Socket = pollFd.fd;
+		event.bReadable = (pollFd.revents & (POLLIN | POLLRDNORM)) != 0;
+		event.bWritable = (pollFd.revents & (POLLOUT | POLLWRNORM)) != 0;
+		event.bFailed = (pollFd.revents & (POLLERR | POLLHUP | POLLNVAL)) != 0;
+		Events.push_back(event);
+
+		pollFd.revents = 0;
+	}
+
+	return static_cast<int>(Events.size() - eventNum);
+}
+
+#ifdef __linux__
+EpollPoller::EpollPoller()
+	: EpollHandle(-1)
+{
+
+}
+
+EpollPoller::~EpollPoller()
+{
+	if (EpollHandle >= 0) {
+		close(EpollHandle);
+	}
+}
+
+bool EpollPoller::Init()
+{
+	EpollHandle = epoll_create1(EPOLL_CLOEXEC);
+	return EpollHandle >= 0;
+}
+
+bool EpollPoller::Add(SOCKET Socket, bool bRead, bool bWrite)
+{
+	epoll_event event;
+	std::memset(&event, 0, sizeof(event));
+	event.events = (bRead ? static_cast<uint32_t>(EPOLLIN | EPOLLRDHUP) : 0u) | (bWrite ? static_cast<uint32_t>(EPOLLOUT) : 0u);
+	event.data.fd = Socket;
+
+	if (epoll_ctl(EpollHandle, EPOLL_CTL_ADD, Socket, &event) != 0) {
+		LOG(Error, "Add socket %d to epoll failed, code: %d", Socket, errno);
+		return false;
+	}
+
+	return true;
+}
+
+bool EpollPoller::Modify(SOCKET Socket, bool bRead, bool bWrite)
+{
+	epoll_event event;
+	std::memset(&event, 0, sizeof(event));
+	event.events = (bRead ? static_cast<uint32_t>(EPOLLIN | EPOLLRDHUP) : 0u) | (bWrite ? static_cast<uint32_t>(EPOLLOUT) : 0u);
+	event.data.fd = Socket;
+
+	if (epoll_ctl(EpollHandle, EPOLL_CTL_MOD, Socket, &event) != 0) {
+		LOG(Error, "Modify socket %d in epoll failed, code: %d", Socket, errno);
+		return false;
+	}
+
+	return true;
+}
+
+void EpollPoller::Remove(SOCKET Socket)
+{
+	epoll_ctl(EpollHandle, EPOLL_CTL_DEL, Socket, nullptr);
+}
+
+int EpollPoller::Wait(int TimeoutMsec, std::vector<PollerEvent>& Events)
+{
+	return WaitEpoll(TimeoutMsec, Events);
+}
+
+void EpollPoller::CollectEvent(int Handle, uint32_t Flags, std::vector<PollerEvent>& Events)
+{
+	PollerEvent event;
+	event.Socket = Handle;
+	event.bReadable = (Flags & (EPOLLIN | EPOLLRDHUP)) != 0;
+	event.bWritable = (Flags & EPOLLOUT) != 0;
+	event.bFailed = (Flags & (EPOLLERR | EPOLLHUP)) != 0;
+	Events.push_back(event);
+}
+
+int EpollPoller::WaitEpoll(int TimeoutMsec, std::vector<PollerEvent>& Events)
+{
+	epoll_event events[POLLER_MAX_EVENTS];
+	int eventNum = epoll_wait(EpollHandle, events, POLLER_MAX_EVENTS, TimeoutMsec);
+	if (eventNum < 0) {
+		if (errno != EINTR) {
+			LOG(Error, "Wait epoll events failed, code: %d", errno);
+		}
+		return -1;
+	}
+
+	for (int index = 0; index < eventNum; index++)
+	{
+		CollectEvent(events[index].data.fd, events[index].events, Events);
+	}
+
+	return eventNum;
+}
+
+UringPoller::UringPoller()
+	: bEpollReady(false)
+{
+
+}
+
+UringPoller::~UringPoller()
+{
+	// Closing the ring cancels what's in flight before the epoll set goes away.
+	Uring.reset();
+}
+
+bool UringPoller::Init()
+{
+	if (!EpollPoller::Init()) {
+		return false;
+	}
+
+	std::unique_ptr<IoUring> uring(new IoUring());
+	if (!uring->Init(IO_URING_QUEUE_DEPTH, IO_URING_COMPLETION_DEPTH) || !uring->InitBufferRing(IO_URING_BUFFER_GROUP, IO_URING_BUFFER_NUM, IO_URING_BUFFER_SIZE)) {
+		return false;
+	}
+
+	Uring = std::move(uring);
+
+	return ArmPoll();
+}
+
+int UringPoller::Wait(int TimeoutMsec, std::vector<PollerEvent>& Events)
+{
+	if (Uring->Wait(bEpollReady ? 0 : TimeoutMsec, Completions) < 0) {
+		LOG(Error, "Wait io_uring completions failed, code: %d", errno);
+		return -1;
+	}
+
+	for (const UringCompletion& completion : Completions)
+	{
+		if (static_cast<EUringOperation>(completion.UserData >> 56) != EUringOperation::Poll) {
+			continue;
+		}
+
+		bEpollReady = true;
+
+		if ((completion.Flags & IORING_CQE_F_MORE) == 0) {
+			ArmPoll();
+		}
+	}
+
+	if (!bEpollReady) {
+		return 0;
+	}
+
+	// Level triggered sockets which are still ready don't post another poll, so look again after any event.
+	int eventNum = WaitEpoll(0, Events);
+	bEpollReady = eventNum > 0;
+
+	return std::max(eventNum, 0);
+}
+
+bool UringPoller::ArmPoll()
+{
+	io_uring_sqe* sqe = Uring->GetSqe();
+	if (sqe == nullptr) {
+		LOG(Error, "Poll epoll by io_uring failed, submission queue is full.");
+		return false;
+	}
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = EpollHandle;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = MakeUringData(EUringOperation::Poll, EpollHandle);
+	return true;
+}
+#endif
@@ -0,0 +1,219 @@
+#ifndef POLLER_H
+#define POLLER_H
+
+#include "ProxyStructures.h"
+#include "PlatformSocket.h"
+
+#ifdef __linux__
+#include "IoUring.h"
+#endif
+
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <unordered_map>
+
+#define POLLER_MAX_EVENTS 256
+
+struct PollerEvent
+{
+	SOCKET Socket{INVALID_SOCKET};
+
+	bool bReadable{false};
+
+	bool bWritable{false};
+
+	// Error or hang up, reported whatever the socket is interested in
+	bool bFailed{false};
+};
+
+#ifdef __linux__
+// What a completion of the loop's io_uring belongs to, kept in the top byte of its user data
+enum class EUringOperation : uint8_t
+{
+	Poll = 1,
+	Accept,
+	Recv,
+	Send,
+	Cancel,
+};
+
+// Operation, buffer id, generation and socket of a submission, @see EUringOperation
+static inline uint64_t MakeUringData(EUringOperation Operation, SOCKET Socket, uint8_t Generation = 0, unsigned short BufferId = 0)
+{
+	return (static_cast<uint64_t>(Operation) << 56) | (static_cast<uint64_t>(BufferId) << 40) | (static_cast<uint64_t>(Generation) << 32) | static_cast<uint32_t>(Socket);
+}
+#endif
+
+/**
+* Readiness of the sockets of one event loop, the loop only sees this interface.
+* [Select]		select, limited to FD_SETSIZE sockets
+* [Poll]		poll, WSAPoll on Windows
+* [Epoll]		epoll (Linux only)
+* [IoUring]	io_uring which also polls the epoll set (Linux only)
+*/
+class Poller
+{
+public:
+	Poller();
+
+	virtual ~Poller();
+
+	/**
+	* Create and init the poller of a backend.
+	* Backends which aren't available fall back to epoll on Linux and poll on Windows.
+	* @return nullptr when even the fallback can't be created.
+	*/
+	static std::unique_ptr<Poller> Create(EIOBackend Backend);
+
+	virtual bool Init() = 0;
+
+	virtual bool Add(SOCKET Socket, bool bRead, bool bWrite) = 0;
+
+	virtual bool Modify(SOCKET Socket, bool bRead, bool bWrite) = 0;
+
+	virtual void Remove(SOCKET Socket) = 0;
+
+	/**
+	* Wait up to TimeoutMsec for ready sockets.
+	* @return Number of events appended, -1 on failure.
+	*/
+	virtual int Wait(int TimeoutMsec, std::vector<PollerEvent>& Events) = 0;
+
+	virtual const char* GetName() const = 0;
+
+#ifdef __linux__
+	// Ring of the io_uring backend, nullptr for the others.
+	virtual inline IoUring* GetRing() { return nullptr; }
+
+	// Completions other than polls collected by the last wait, the loop handles and clears them.
+	virtual inline std::vector<UringCompletion>* GetCompletions() { return nullptr; }
+#endif
+};
+
+class SelectPoller : public Poller
+{
+public:
+	SelectPoller();
+
+	virtual ~SelectPoller();
+
+	virtual bool Init() override;
+
+	virtual bool Add(SOCKET Socket, bool bRead, bool bWrite) override;
+
+	virtual bool Modify(SOCKET Socket, bool bRead, bool bWrite) override;
+
+	virtual void Remove(SOCKET Socket) override;
+
+	virtual int Wait(int TimeoutMsec, std::vector<PollerEvent>& Events) override;
+
+	virtual inline const char* GetName() const override { return "select"; }
+
+protected:
+	struct SelectInterest
+	{
+		bool bRead{true};
+
+		bool bWrite{false};
+	};
+
+	std::unordered_map<SOCKET, SelectInterest> Interests;
+};
+
+class PollPoller : public Poller
+{
+public:
+	PollPoller();
+
+	virtual ~PollPoller();
+
+	virtual bool Init() override;
+
+	virtual bool Add(SOCKET Socket, bool bRead, bool bWrite) override;
+
+	virtual bool Modify(SOCKET Socket, bool bRead, bool bWrite) override;
+
+	virtual void Remove(SOCKET Socket) override;
+
+	virtual int Wait(int TimeoutMsec, std::vector<PollerEvent>& Events) override;
+
+	virtual inline const char* GetName() const override { return "poll"; }
+
+protected:
+#ifdef __linux__
+	std::vector<pollfd> PollList;
+#else
+	std::vector<WSAPOLLFD> PollList;
+#endif
+
+	// Position of each socket in PollList, removal moves the last one into the hole.
+	std::unordered_map<SOCKET, size_t> PollIndex;
+};
+
+#ifdef __linux__
+class EpollPoller : public Poller
+{
+public:
+	EpollPoller();
+
+	virtual ~EpollPoller();
+
+	virtual bool Init() override;
+
+	virtual bool Add(SOCKET Socket, bool bRead, bool bWrite) override;
+
+	virtual bool Modify(SOCKET Socket, bool bRead, bool bWrite) override;
+
+	virtual void Remove(SOCKET Socket) override;
+
+	virtual int Wait(int TimeoutMsec, std::vector<PollerEvent>& Events) override;
+
+	virtual inline const char* GetName() const override { return "epoll"; }
+
+protected:
+	// Turn the flags of an epoll event into a ready event.
+	virtual void CollectEvent(int Handle, uint32_t Flags, std::vector<PollerEvent>& Events);
+
+	// Collect what epoll has ready without blocking longer than TimeoutMsec.
+	virtual int WaitEpoll(int TimeoutMsec, std::vector<PollerEvent>& Events);
+
+protected:
+	int EpollHandle;
+};
+
+/**
+* Waits on io_uring completions, the epoll set is polled by the ring,
+* so sockets which aren't relayed through the ring still wait on readiness.
+* Needs Linux 5.19 or newer, @see IoUring
+*/
+class UringPoller : public EpollPoller
+{
+public:
+	UringPoller();
+
+	virtual ~UringPoller();
+
+	virtual bool Init() override;
+
+	virtual int Wait(int TimeoutMsec, std::vector<PollerEvent>& Events) override;
+
+	virtual inline const char* GetName() const override { return "io_uring"; }
+
+	virtual inline IoUring* GetRing() override { return Uring.get(); }
+
+	virtual inline std::vector<UringCompletion>* GetCompletions() override { return &Completions; }
+
+protected:
+	virtual bool ArmPoll();
+
+protected:
+	std::unique_ptr<IoUring> Uring;
+	std::vector<UringCompletion> Completions;
+
+	// The epoll set had events at the last look, it's checked again before waiting on the ring.
+	bool bEpollReady;
+};
+#endif
+
+#endif // !POLLER_H
@@ -1,35 +1,106 @@
 #include "ProxyContext.h"
 #include "EasyLog.h"
-#include "BufferReader.h"
+#include "BufferView.h"
 #include "ProxyServer.h"
+#include "EventLoop.h"
+#include "RelayBufferPool.h"
+#include "MemoryPool.h"
+#include "Metrics.h"
 
 #include <functional>
-#include <sstream>
+#include <algorithm>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/udp.h>
+
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#endif
+
+std::atomic<unsigned long long> ProxyContext::NextConnectionId(1);
 
 ProxyContext::ProxyContext(SOCKET InClient, EConnectionState InState /*= EConnectionState::WaitHandshake*/)
-	: State(InState)
+	: ConnectionId(0)
 	, Client(InClient)
+	, UDPClient(INVALID_SOCKET)
+	, Destination(INVALID_SOCKET)
+	, UDPSocketFamily(AF_INET)
+	, bUDPShared(false)
+	, UDPIdleTimer(0)
+	, UDPReassemblyTimer(0)
+	, UDPPendingBytes(0)
+	, NextCandidate(0)
+	, LastConnectError(0)
+	, ConnectTimeoutTimer(0)
+	, ConnectAttemptTimer(0)
+	, HandshakeTimer(0)
+	, IdleTimer(0)
+	, UDPPort(0)
+	, State(InState)
+	, Loop(nullptr)
+	, AcceptTime(std::chrono::steady_clock::now())
+#ifdef __linux__
+	, SplicePipes{ { -1, -1 }, { -1, -1 } }
+	, bSpliceSupported(true)
+#endif
 {
 
 }
 
 ProxyContext::~ProxyContext()
 {
-	LOG(Log, "[Connection: %s]Connection request close, disconnected.", GetCurrentThreadId().c_str());
+	LOG(Log, "[Connection: %llu]Connection request close, disconnected, client bytes: %llu, destination bytes: %llu.", ConnectionId, RelayDirections[0].RelayedBytes, RelayDirections[1].RelayedBytes);
+
+	Metrics::Add(EMetricCounter::ClosedConnections);
+	Metrics::Observe(EMetricHistogram::SessionDuration, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - AcceptTime).count());
+
 	if (Client != INVALID_SOCKET) {
-		closesocket(Client);
+		MiscHelper::CloseSocket(Client);
 		Client = INVALID_SOCKET;
 	}
 
 	if (UDPClient != INVALID_SOCKET) {
-		closesocket(UDPClient);
+		MiscHelper::CloseSocket(UDPClient);
 		UDPClient = INVALID_SOCKET;
 	}
 
 	if (Destination != INVALID_SOCKET) {
-		closesocket(Destination);
+		MiscHelper::CloseSocket(Destination);
 		Destination = INVALID_SOCKET;
 	}
+
+	for (SOCKET attempt : ConnectAttempts)
+	{
+		MiscHelper::CloseSocket(attempt);
+	}
+
+#ifdef __linux__
+	for (int* splicePipe : SplicePipes)
+	{
+		if (splicePipe[0] >= 0) {
+			close(splicePipe[0]);
+			close(splicePipe[1]);
+		}
+	}
+#endif
+}
+
+std::shared_ptr<ProxyContext> ProxyContext::Create(SOCKET InClient, unsigned long long InConnectionId)
+{
+	std::shared_ptr<ProxyContext> context = std::allocate_shared<ProxyContext>(PoolAllocator<ProxyContext>(), InClient);
+	context->ConnectionId = InConnectionId;
+
+	Metrics::Add(EMetricCounter::AcceptedConnections);
+
+	return context;
+}
+
+unsigned long long ProxyContext::NewConnectionId()
+{
+	return NextConnectionId.fetch_add(1, std::memory_order_relaxed);
 }
 
 bool ProxyContext::operator==(const ProxyContext& Other) const
@@ -42,37 +113,286 @@ EConnectionState ProxyContext::GetConnectionState() const
 	return State;
 }
 
-void ProxyContext::ProcessWaitHandshake()
+bool ProxyContext::IsClosing() const
+{
+	switch (State)
+	{
+	case EConnectionState::WaitHandShake:
+	case EConnectionState::WaitLicense:
+	case EConnectionState::Resolving:
+	case EConnectionState::Connecting:
+	case EConnectionState::Connected:
+	case EConnectionState::UDPAssociate:
+		return false;
+
+	default:
+		return true;
+	}
+}
+
+bool ProxyContext::AttachLoop(EventLoop* InLoop)
+{
+	Loop = InLoop;
+
+	if (!Loop->Watch(Client, shared_from_this())) {
+		return false;
+	}
+
+	int handshakeTimeout = ProxyServer::Get()->GetHandshakeTimeout();
+	if (handshakeTimeout > 0) {
+		HandshakeTimer = Loop->AddTimer(handshakeTimeout, shared_from_this(), ETimerType::HandshakeTimeout);
+	}
+
+	// Runs until it waits for the greeting.
+	Lifecycle = RunConnection();
+	Lifecycle.Resume();
+	return true;
+}
+
+void ProxyContext::DetachLoop()
+{
+	if (Loop == nullptr) {
+		return;
+	}
+
+	Loop->Unwatch(Client);
+	Loop->Unwatch(UDPClient);
+	Loop->Unwatch(Destination);
+
+	for (SOCKET attempt : ConnectAttempts)
+	{
+		Loop->Unwatch(attempt);
+	}
+
+	Loop->CancelTimer(ConnectTimeoutTimer);
+	Loop->CancelTimer(ConnectAttemptTimer);
+	Loop->CancelTimer(UDPIdleTimer);
+	Loop->CancelTimer(UDPReassemblyTimer);
+	Loop->CancelTimer(HandshakeTimer);
+	Loop->CancelTimer(IdleTimer);
+	ConnectTimeoutTimer = ConnectAttemptTimer = UDPIdleTimer = UDPReassemblyTimer = HandshakeTimer = IdleTimer = 0;
+	UDPFragments.Release();
+	UDPPendingDatagrams.clear();
+	UDPPendingBytes = 0;
+
+	if (bUDPShared) {
+		SharedUDPRelay* relay = Loop->GetUDPRelay();
+		if (relay != nullptr) {
+			relay->Dissociate(this);
+		}
+	}
+
+	Loop = nullptr;
+}
+
+void ProxyContext::HandleEvent(SOCKET Socket, EOperationType Operation)
+{
+	// The lifecycle waits for the resolver, only a hang up of the client can arrive.
+	if (State == EConnectionState::Resolving) {
+		LOG(Warning, "[Connection: %llu]Client closed while resolving destination server.", ConnectionId);
+		State = EConnectionState::ReuqestClose;
+		return;
+	}
+
+	WakeEvent.Socket = Socket;
+	WakeEvent.Operation = Operation;
+	Lifecycle.Resume();
+
+	if (Lifecycle.IsDone() && !IsClosing()) {
+		State = EConnectionState::ReuqestClose;
+	}
+}
+
+void ProxyContext::HandleTimer(ETimerType Type)
+{
+	switch (Type)
+	{
+	case ETimerType::HandshakeTimeout:
+	{
+		HandshakeTimer = 0;
+		if (State == EConnectionState::WaitHandShake || State == EConnectionState::WaitLicense) {
+			LOG(Warning, "[Connection: %llu]Client didn't finish handshake in time.", ConnectionId);
+			State = EConnectionState::ReuqestClose;
+		}
+		break;
+	}
+	case ETimerType::ConnectTimeout:
+	{
+		ConnectTimeoutTimer = 0;
+		if (State == EConnectionState::Resolving || State == EConnectionState::Connecting) {
+			LOG(Warning, "[Connection: %llu]Connect to destination server timeout.", ConnectionId);
+			// Same reply as a connect the kernel timed out, @see GetConnectFailureResponse
+			FailConnect(ETravelResponse::TTL_Expired);
+		}
+		break;
+	}
+	case ETimerType::ConnectAttempt:
+	{
+		ConnectAttemptTimer = 0;
+		if (State == EConnectionState::Connecting) {
+			StartConnectAttempt();
+		}
+		break;
+	}
+	case ETimerType::Idle:
+	{
+		IdleTimer = 0;
+		if (State != EConnectionState::Connected) {
+			break;
+		}
+
+		auto timeout = std::chrono::milliseconds(ProxyServer::Get()->GetIdleTimeout());
+		auto idle = std::chrono::steady_clock::now() - LastActive;
+		if (idle >= timeout) {
+			LOG(Log, "[Connection: %llu]Connection idle timeout.", ConnectionId);
+			State = EConnectionState::ReuqestClose;
+			break;
+		}
+
+		// Traffic only stamps the time, the timer is moved once per timeout at most.
+		auto remain = std::chrono::duration_cast<std::chrono::milliseconds>(timeout - idle);
+		IdleTimer = Loop->AddTimer(static_cast<int>(remain.count()) + 1, shared_from_this(), ETimerType::Idle);
+		break;
+	}
+	case ETimerType::UDPIdle:
+	{
+		UDPIdleTimer = 0;
+		if (State != EConnectionState::UDPAssociate) {
+			break;
+		}
+
+		auto timeout = std::chrono::milliseconds(ProxyServer::Get()->GetUDPIdleTimeout());
+		auto idle = std::chrono::steady_clock::now() - UDPLastActive;
+		if (idle >= timeout) {
+			LOG(Log, "[Connection: %llu]Udp association idle timeout.", ConnectionId);
+			State = EConnectionState::ReuqestClose;
+			break;
+		}
+
+		// Remotes of the association which went quiet free their shared socket for other associations.
+		if (bUDPShared) {
+			SharedUDPRelay* relay = Loop->GetUDPRelay();
+			if (relay != nullptr) {
+				relay->ExpireRemotes(this, std::chrono::steady_clock::now() - timeout);
+			}
+		}
+
+		auto remain = std::chrono::duration_cast<std::chrono::milliseconds>(timeout - idle);
+		UDPIdleTimer = Loop->AddTimer(static_cast<int>(remain.count()) + 1, shared_from_this(), ETimerType::UDPIdle);
+		break;
+	}
+	case ETimerType::UDPReassembly:
+	{
+		UDPReassemblyTimer = 0;
+		if (UDPFragments.IsPending()) {
+			LOG(Warning, "[Connection: %llu]Udp fragment sequence timeout at position %d.", ConnectionId, UDPFragments.GetPosition());
+		}
+
+		UDPFragments.Release();
+		break;
+	}
+	}
+}
+
+ConnectionTask ProxyContext::RunConnection()
+{
+	// A pipelining client may send the greeting and the request in one read.
+	while (State == EConnectionState::WaitHandShake || State == EConnectionState::WaitLicense)
+	{
+		co_await NextEvent();
+		ProcessHandshakeData();
+	}
+
+	Loop->CancelTimer(HandshakeTimer);
+	HandshakeTimer = 0;
+
+	// Cached names are resolved already, the others resume it from the resolver.
+	if (State == EConnectionState::Resolving) {
+		ResolveResult result = co_await ResumeAwaiter<ResolveResult>(WakeResolved);
+		OnDestinationResolved(result);
+	}
+
+	while (State == EConnectionState::Connecting)
+	{
+		SocketEvent event = co_await NextEvent();
+
+		// An attempt timer may have connected meanwhile, the poller reports the event again to the relay.
+		if (State == EConnectionState::Connecting) {
+			ProcessConnecting(event.Socket);
+		}
+	}
+
+	// Relayed by the loop itself on io_uring, then it's never resumed again.
+	while (State == EConnectionState::Connected || State == EConnectionState::UDPAssociate)
+	{
+		SocketEvent event = co_await NextEvent();
+		ProcessForwardData(event.Socket, event.Operation);
+	}
+}
+
+ResumeAwaiter<SocketEvent> ProxyContext::NextEvent()
+{
+	return ResumeAwaiter<SocketEvent>(WakeEvent);
+}
+
+void ProxyContext::ResumeResolved(const ResolveResult& Result)
 {
-	LOG(Log, "[Connection: %s]Processing handshake.", GetCurrentThreadId().c_str());
+	if (State != EConnectionState::Resolving) {
+		return;
+	}
+
+	WakeResolved = Result;
+	Lifecycle.Resume();
+}
 
-	char handshakeData[TRAFFIC_BUFFER_SIZE];
-	int recvResult = recv(Client, handshakeData, TRAFFIC_BUFFER_SIZE, 0);
+void ProxyContext::ProcessHandshakeData()
+{
+	// Received straight into the parser, bytes beyond its space wait in the socket until the request is handled.
+	char* handshakeData = HandshakeParser.GetWriteBuffer();
+	int recvResult = recv(Client, handshakeData, HandshakeParser.GetWriteSpace(), 0);
 	if (recvResult == SOCKET_ERROR) {
-		LOG(Error, "[Connection: %s]Recv handshake occured some errors, code: %d", GetCurrentThreadId().c_str(), WSAGetLastError());
+		LOG(Error, "[Connection: %llu]Recv handshake occured some errors, code: %d", ConnectionId, MiscHelper::GetLastSocketError());
 		State = EConnectionState::HandshakeError;
 		SendHandshakeResponse(EConnectionProtocol::Error);
 		return;
 	}
 
-	BufferReader reader(handshakeData, static_cast<int>(TRAFFIC_BUFFER_SIZE));
+	if (recvResult == 0) {
+		LOG(Log, "[Connection: %llu]Client closed before handshake finished.", ConnectionId);
+		State = EConnectionState::ReuqestClose;
+		return;
+	}
+
+	HandshakeParser.Commit(recvResult);
+
+	// A pipelining client may have sent the greeting and the request in the same read.
+	if (State == EConnectionState::WaitHandShake) {
+		ProcessWaitHandshake();
+	}
+
+	if (State == EConnectionState::WaitLicense) {
+		ProcessWaitLicense();
+	}
+}
 
+void ProxyContext::ProcessWaitHandshake()
+{
 	HandshakePacket packet;
-	reader.Serialize(&packet.Version, 1);
-	reader.Serialize(&packet.MethodNum, 1);
+	if (HandshakeParser.ParseGreeting(packet) != EParseResult::Done) {
+		return;
+	}
 
-	packet.MethodList.resize(packet.MethodNum);
-	reader.Serialize(packet.MethodList.data(), packet.MethodNum);
+	LOG(Log, "[Connection: %llu]Processing handshake.", ConnectionId);
 
 	if (packet.Version != ESocksVersion::Socks5) {
-		LOG(Warning, "[Connection: %s]Wrong protocol version.", GetCurrentThreadId().c_str());
+		LOG(Warning, "[Connection: %llu]Wrong protocol version.", ConnectionId);
 		State = EConnectionState::HandshakeError;
 		SendHandshakeResponse(EConnectionProtocol::Error);
 		return;
 	}
 
 	if (packet.MethodNum < 1) {
-		LOG(Warning, "[Connection: %s]Wrong method length.", GetCurrentThreadId().c_str());
+		LOG(Warning, "[Connection: %llu]Wrong method length.", ConnectionId);
 		State = EConnectionState::HandshakeError;
 		SendHandshakeResponse(EConnectionProtocol::Error);
 		return;
@@ -80,15 +400,15 @@ void ProxyContext::ProcessWaitHandshake()
 
 	bool bFoundProtocol = false;
 
-	for (const EConnectionProtocol& protocol : packet.MethodList)
+	for (int index = 0; index < packet.MethodNum; index++)
 	{
-		if (protocol == EConnectionProtocol::Non_auth) {
+		if (packet.MethodList[index] == EConnectionProtocol::Non_auth) {
 			bFoundProtocol = true;
 		}
 	}
 
 	if (!bFoundProtocol) {
-		LOG(Warning, "[Connection: %s]Only support non-auth protocol now.", GetCurrentThreadId().c_str());
+		LOG(Warning, "[Connection: %llu]Only support non-auth protocol now.", ConnectionId);
 		State = EConnectionState::HandshakeError;
 		SendHandshakeResponse(EConnectionProtocol::Error);
 		return;
@@ -100,73 +420,36 @@ void ProxyContext::ProcessWaitHandshake()
 
 void ProxyContext::ProcessWaitLicense()
 {
-	LOG(Log, "[Connection: %s]Processing wait license.", GetCurrentThreadId().c_str());
-
-	char licenseData[TRAFFIC_BUFFER_SIZE];
-	int recvResult = recv(Client, licenseData, TRAFFIC_BUFFER_SIZE, 0);
-	if (recvResult == SOCKET_ERROR) {
-		LOG(Error, "[Connection: %s]Recv license occured some errors, code: %d", GetCurrentThreadId().c_str(), WSAGetLastError());
-		State = EConnectionState::HandshakeError;
-		SendHandshakeResponse(EConnectionProtocol::Error);
+	EParseResult parseResult = HandshakeParser.ParseRequest(LicensePayload);
+	if (parseResult == EParseResult::NeedMore) {
 		return;
 	}
 
-	BufferReader reader(licenseData, recvResult);
-
-	reader.Serialize(&LicensePayload.Version, 1);
+	LOG(Log, "[Connection: %llu]Processing wait license.", ConnectionId);
 
 	if (LicensePayload.Version != ESocksVersion::Socks5) {
-		LOG(Warning, "[Connection: %s]Wrong protocol version.", GetCurrentThreadId().c_str());
+		LOG(Warning, "[Connection: %llu]Wrong protocol version.", ConnectionId);
 		State = EConnectionState::LicenseError;
 		SendLicenseResponse(ETravelResponse::GeneralFailure);
 		return;
 	}
 
-	reader.Serialize(&LicensePayload.Cmd, 1);
-	reader.Serialize(&LicensePayload.Reserved, 1);
+	if (parseResult == EParseResult::Malformed) {
+		LOG(Warning, "[Connection: %llu]Wrong address type.", ConnectionId);
+		State = EConnectionState::LicenseError;
+		SendLicenseResponse(ETravelResponse::AddrNotSupported);
+		return;
+	}
 
 	if (LicensePayload.Reserved != 0x00) {
-		LOG(Warning, "[Connection: %s]Wrong reserved field value.", GetCurrentThreadId().c_str());
+		LOG(Warning, "[Connection: %llu]Wrong reserved field value.", ConnectionId);
 		State = EConnectionState::LicenseError;
 		SendLicenseResponse(ETravelResponse::GeneralFailure);
 		return;
 	}
 
-	LicensePayload.DestPort.resize(2);
-
-	reader.Serialize(&LicensePayload.AddressType, 1);
-	switch (LicensePayload.AddressType)
-	{
-	case EAddressType::IPv4:
-	{
-		LicensePayload.DestAddr.resize(4);
-		reader.Serialize(LicensePayload.DestAddr.data(), 4);
-		reader.Serialize(LicensePayload.DestPort.data(), 2);
-		break;
-	}
-	case EAddressType::IPv6:
-	{
-		LicensePayload.DestAddr.resize(16);
-		reader.Serialize(LicensePayload.DestAddr.data(), 16);
-		reader.Serialize(LicensePayload.DestPort.data(), 2);
-		break;
-	}
-	case EAddressType::DomainName:
-	{
-		int nameLen(0);
-		reader.Serialize(&nameLen, 1);
-		LicensePayload.DestAddr.resize(nameLen);
-
-		reader.Serialize(LicensePayload.DestAddr.data(), nameLen);
-		reader.Serialize(LicensePayload.DestPort.data(), 2);
-
-		LicensePayload.DestAddr.push_back(0x00);
-		break;
-	}
-	default:
-		LOG(Warning, "[Connection: %s]Wrong address type.", GetCurrentThreadId().c_str());
-		return;
-	}
+	// Optimistic data sent right after the request, it goes to the destination once connected.
+	HandshakeParser.TakeRemaining(PendingPayload);
 
 	switch (LicensePayload.Cmd)
 	{
@@ -177,7 +460,6 @@ void ProxyContext::ProcessWaitLicense()
 			return;
 		}
 
-		State = EConnectionState::Connected;
 		break;
 	}
 	
@@ -187,12 +469,12 @@ void ProxyContext::ProcessWaitLicense()
 			State = EConnectionState::LicenseError;
 			return;
 		}
-		State = EConnectionState::UDPAssociate;
+
 		break;
 	}
 	case ECommandType::Bind:
 	default:
-		LOG(Warning, "[Connection: %s]Not supported command.", GetCurrentThreadId().c_str());
+		LOG(Warning, "[Connection: %llu]Not supported command.", ConnectionId);
 		State = EConnectionState::LicenseError;
 		SendLicenseResponse(ETravelResponse::CmdNotSupported);
 		return;
@@ -201,19 +483,124 @@ void ProxyContext::ProcessWaitLicense()
 
 bool ProxyContext::ProcessConnectCmd()
 {
+	// The client must wait for the reply, so its socket is only watched for hang up while resolving and connecting.
+	Loop->Modify(Client, false, false);
+
+	// The timeout covers the name resolution too, it's only started on the first pass.
+	int connectTimeout = ProxyServer::Get()->GetConnectTimeout();
+	if (ConnectTimeoutTimer == 0 && connectTimeout > 0) {
+		ConnectTimeoutTimer = Loop->AddTimer(connectTimeout, shared_from_this(), ETimerType::ConnectTimeout);
+	}
+
+	if (LicensePayload.AddressType == EAddressType::DomainName && ResolvedAddrs.empty()) {
+		ResolveDestination();
+		return true;
+	}
+
 	if (!ParseTCPPayloadAddress()) {
 		return false;
 	}
 
-	int connectResult = connect(Destination, (SOCKADDR*)&DestAddr, sizeof(DestAddr));
-	if (connectResult == SOCKET_ERROR) {
-		LOG(Error, "[Connection: %s]Connect to destination server failure, code: %d.", GetCurrentThreadId().c_str(), WSAGetLastError());
-		SendLicenseResponse(ETravelResponse::NetworkUnreachable);
-		return false;
+	State = EConnectionState::Connecting;
+	ConnectStartTime = std::chrono::steady_clock::now();
+
+	StartConnectAttempt();
+
+	return true;
+}
+
+void ProxyContext::ResolveDestination()
+{
+	std::string hostName(LicensePayload.DestAddr, LicensePayload.DestAddrLen);
+	std::shared_ptr<DnsResolver> resolver = DnsResolver::Get();
+
+	ResolveResult cached;
+	if (resolver->Lookup(hostName, cached)) {
+		OnDestinationResolved(cached);
+		return;
+	}
+
+	Loop->Modify(Client, false, false);
+	State = EConnectionState::Resolving;
+	ResolveStartTime = std::chrono::steady_clock::now();
+
+	EventLoop* loop = Loop;
+	std::weak_ptr<ProxyContext> weakThis = shared_from_this();
+	resolver->ResolveAsync(hostName,
+	[loop, weakThis](const ResolveResult& Result)
+	{
+		loop->PostContextTask(weakThis,
+		[Result](const std::shared_ptr<ProxyContext>& Context)
+		{
+			Context->ResumeResolved(Result);
+		});
+	});
+}
+
+void ProxyContext::OnDestinationResolved(const ResolveResult& Result)
+{
+	if (State != EConnectionState::Resolving && State != EConnectionState::WaitLicense) {
+		return;
+	}
+
+	// Cached answers arrive while still waiting for the license and took no time.
+	if (State == EConnectionState::Resolving) {
+		Metrics::Observe(EMetricHistogram::DnsTime, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - ResolveStartTime).count());
+	}
+
+	if (Result.Error != 0 || Result.Addresses.empty()) {
+		Metrics::Add(EMetricCounter::DnsFailures);
+		LOG(Warning, "[Connection: %llu]Resolve destination server %s failed, err: %d.", ConnectionId, LicensePayload.DestAddr, Result.Error);
+		Loop->CancelTimer(ConnectTimeoutTimer);
+		ConnectTimeoutTimer = 0;
+		State = EConnectionState::LicenseError;
+		SendLicenseResponse(ETravelResponse::HostUnreachable);
+		return;
+	}
+
+	ResolvedAddrs = Result.Addresses;
+
+	if (!ProcessConnectCmd()) {
+		State = EConnectionState::LicenseError;
+	}
+}
+
+void ProxyContext::ProcessConnecting(SOCKET Socket)
+{
+	if (Socket == Client) {
+		LOG(Warning, "[Connection: %llu]Client closed while connecting to destination server.", ConnectionId);
+		CloseConnectAttempts();
+		State = EConnectionState::ReuqestClose;
+		return;
+	}
+
+	auto attempt = std::find(ConnectAttempts.begin(), ConnectAttempts.end(), Socket);
+	if (attempt == ConnectAttempts.end()) {
+		return;
+	}
+
+	int errorCode(0);
+	socklen_t errorLen = static_cast<socklen_t>(sizeof(errorCode));
+	if (getsockopt(Socket, SOL_SOCKET, SO_ERROR, (char*)&errorCode, &errorLen) == SOCKET_ERROR) {
+		errorCode = MiscHelper::GetLastSocketError();
+	}
+
+	if (errorCode == 0) {
+		FinishConnect(Socket);
+		return;
 	}
 
-	LOG(Log, "[Connection: %s]Connect to destination server succeeded.", GetCurrentThreadId().c_str());
-	return SendLicenseResponse(ETravelResponse::Succeeded);
+	LOG(Log, "[Connection: %llu]Connect attempt to destination server failed, code: %d.", ConnectionId, errorCode);
+
+	LastConnectError = errorCode;
+	Loop->Unwatch(Socket);
+	MiscHelper::CloseSocket(Socket);
+	ConnectAttempts.erase(attempt);
+
+	// A failed attempt doesn't wait for the attempt delay, the next address starts right away.
+	Loop->CancelTimer(ConnectAttemptTimer);
+	ConnectAttemptTimer = 0;
+	StartConnectAttempt();
 }
 
 bool ProxyContext::ProcessUDPCmd()
@@ -222,32 +609,48 @@ bool ProxyContext::ProcessUDPCmd()
 		return false;
 	}
 
-	TIMEVAL timeout = { 0, SOCK_TIMEOUT_MSEC };
-	setsockopt(UDPClient, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+	if ((!bUDPShared && !Loop->Watch(UDPClient, shared_from_this())) || !Loop->Modify(Client, true, false)) {
+		SendLicenseResponse(ETravelResponse::GeneralFailure, false);
+		return false;
+	}
+
+	UDPLastActive = std::chrono::steady_clock::now();
+
+	int idleTimeout = ProxyServer::Get()->GetUDPIdleTimeout();
+	if (idleTimeout > 0) {
+		UDPIdleTimer = Loop->AddTimer(idleTimeout, shared_from_this(), ETimerType::UDPIdle);
+	}
+
+	LOG(Log, "[Connection: %llu]Udp relay is ready at %s.", ConnectionId, MiscHelper::AddressToString(UDPBoundAddr).c_str());
 
-	LOG(Log, "[Connection: %s]Connect to destination server with udp connection succeeded.", GetCurrentThreadId().c_str());
+	if (!SendLicenseResponse(ETravelResponse::Succeeded, false)) {
+		return false;
+	}
 
-	return SendLicenseResponse(ETravelResponse::Succeeded, false);
+	State = EConnectionState::UDPAssociate;
+	return true;
 }
 
 bool ProxyContext::SendHandshakeResponse(EConnectionProtocol Response)
 {
+	if (Response == EConnectionProtocol::Error) {
+		Metrics::Add(EMetricCounter::HandshakeErrors);
+	}
+
 	HandshakeResponse response;
 	response.Version = ESocksVersion::Socks5;
 	response.Method = Response;
 
-	std::vector<char> responseData;
-	responseData.push_back(static_cast<char>(response.Version));
-	responseData.push_back(static_cast<char>(response.Method));
-
-	
+	char responseData[2];
+	responseData[0] = static_cast<char>(response.Version);
+	responseData[1] = static_cast<char>(response.Method);
 
-	int sendResult = send(Client, responseData.data(), static_cast<int>(responseData.size()), 0);
+	int sendResult = send(Client, responseData, static_cast<int>(sizeof(responseData)), 0);
 	if (sendResult == SOCKET_ERROR) {
-		LOG(Error, "[Connection: %s]Send handshake response failed, code: %d", GetCurrentThreadId().c_str(), WSAGetLastError());
+		LOG(Error, "[Connection: %llu]Send handshake response failed, code: %d", ConnectionId, MiscHelper::GetLastSocketError());
 	}
 	else {
-		LOG(Log, "[Connection: %s]Handshake response data send succeeded.", GetCurrentThreadId().c_str());
+		LOG(Log, "[Connection: %llu]Handshake response data send succeeded.", ConnectionId);
 	}
 
 	return sendResult != SOCKET_ERROR;
@@ -255,61 +658,88 @@ bool ProxyContext::SendHandshakeResponse(EConnectionProtocol Response)
 
 bool ProxyContext::SendLicenseResponse(ETravelResponse Response, bool bTCP /*= true*/)
 {
-	TravelReply reply;
-	reply.Version = LicensePayload.Version;
-	reply.Reply = Response;
-	reply.Reserved = 0x00;
-	if (bTCP) {
-		reply.AddressType = LicensePayload.AddressType;
-		reply.BindAddress = LicensePayload.DestAddr;
-		reply.BindAddress.reserve(reply.BindAddress.size() - 1);
-		reply.BindPort = LicensePayload.DestPort;
-	}
-	else {
-		reply.AddressType = EAddressType::IPv4;
-		reply.BindAddress.resize(4);
-		unsigned long localIP(0);
-		if (!MiscHelper::GetLocalHostS(localIP)) {
-			LOG(Error, "[Connection: %s]Try get server localhost ip failed, code: %d", GetCurrentThreadId().c_str(), WSAGetLastError());
-			return false;
-		}
+	Metrics::AddReply(static_cast<int>(Response));
 
-		std::memcpy(reply.BindAddress.data(), &localIP, 4);
+	char replyData[TRAVEL_REPLY_MAX_SIZE];
+	int replyLen(0);
 
-		reply.BindPort.resize(2);
-		unsigned short nport = htons(UDPPort);
-		std::memcpy(reply.BindPort.data(), &nport, 2);
+	replyData[replyLen++] = static_cast<char>(LicensePayload.Version);
+	replyData[replyLen++] = static_cast<char>(Response);
+	replyData[replyLen++] = 0x00;
+
+	SOCKADDR_STORAGE boundAddr;
+	std::memset(&boundAddr, 0, sizeof(boundAddr));
+	socklen_t boundLen = static_cast<socklen_t>(sizeof(boundAddr));
+
+	if (bTCP && Response == ETravelResponse::Succeeded && Destination != INVALID_SOCKET &&
+		getsockname(Destination, (SOCKADDR*)&boundAddr, &boundLen) == 0) {
+		// The address the server uses to connect the destination.
+		MiscHelper::UnmapAddress(boundAddr);
+		replyLen += WriteReplyAddress(replyData + replyLen, boundAddr);
 	}
+	else if (bTCP) {
+		EAddressType addressType = LicensePayload.AddressType;
+		int addrLen = LicensePayload.DestAddrLen;
+
+		bool bValidAddress =
+			((addressType == EAddressType::IPv4 && addrLen == 4) ||
+			 (addressType == EAddressType::IPv6 && addrLen == 16) ||
+			 (addressType == EAddressType::DomainName && addrLen > 0 && addrLen <= 255));
+
+		if (bValidAddress) {
+			replyData[replyLen++] = static_cast<char>(addressType);
+			if (addressType == EAddressType::DomainName) {
+				replyData[replyLen++] = static_cast<char>(addrLen);
+			}
+
+			std::memcpy(replyData + replyLen, LicensePayload.DestAddr, addrLen);
+			replyLen += addrLen;
 
-	std::vector<char> replyData;
-	replyData.push_back(static_cast<char>(reply.Version));
-	replyData.push_back(static_cast<char>(reply.Reply));
-	replyData.push_back(static_cast<char>(reply.Reserved));
-	replyData.push_back(static_cast<char>(reply.AddressType));
-	if (LicensePayload.AddressType == EAddressType::DomainName) {
-		replyData.push_back(static_cast<char>(reply.BindAddress.size()));
+			std::memcpy(replyData + replyLen, LicensePayload.DestPort, 2);
+			replyLen += 2;
+		}
+		else {
+			// The request failed before its address was parsed, reply with an empty IPv4 address.
+			replyData[replyLen++] = static_cast<char>(EAddressType::IPv4);
+			std::memset(replyData + replyLen, 0, 6);
+			replyLen += 6;
+		}
+	}
+	else {
+		replyLen += WriteReplyAddress(replyData + replyLen, UDPBoundAddr);
 	}
-	replyData.insert(replyData.end(), reply.BindAddress.begin(), reply.BindAddress.end());
-	replyData.insert(replyData.end(), reply.BindPort.begin(), reply.BindPort.end());
 
-	int sendResult = send(Client, replyData.data(), static_cast<int>(replyData.size()), 0);
+	int sendResult = send(Client, replyData, replyLen, 0);
 	if (sendResult == SOCKET_ERROR) {
-		LOG(Error, "[Connection: %s]Send license response failed, code: %d", GetCurrentThreadId().c_str(), WSAGetLastError());
+		LOG(Error, "[Connection: %llu]Send license response failed, code: %d", ConnectionId, MiscHelper::GetLastSocketError());
 	}
 	else {
-		LOG(Log, "[Connection: %s]Send license response '%s' succeeded.", GetCurrentThreadId().c_str(), GetTravelResponseName(Response).c_str());
+		LOG(Log, "[Connection: %llu]Send license response '%s' succeeded.", ConnectionId, GetTravelResponseName(Response).c_str());
 	}
 
 	return sendResult != SOCKET_ERROR;
 }
 
-void ProxyContext::ProcessForwardData()
+void ProxyContext::OnRelayStopped(SOCKET Source, int ErrorCode)
+{
+	if (ErrorCode != 0) {
+		LOG(Error, "[Connection: %llu]Relay traffic from %s error, code: %d", ConnectionId, Source == Client ? "client" : "destination", ErrorCode);
+	}
+
+	State = EConnectionState::ReuqestClose;
+}
+
+void ProxyContext::ProcessForwardData(SOCKET Socket, EOperationType Operation)
 {
 	switch (State)
 	{
 	case EConnectionState::Connected:
 	{
-		if (!TransportTraffic()) {
+		MarkActive();
+
+		// A writable side takes the bytes queued for it, a readable one is relayed to the other side.
+		bool bResult = Operation == EOperationType::Write ? FlushTraffic(Socket == Client ? 1 : 0) : TransportTraffic(Socket, Socket == Client ? Destination : Client);
+		if (!bResult) {
 			State = EConnectionState::ReuqestClose;
 			return;
 		}
@@ -318,118 +748,916 @@ void ProxyContext::ProcessForwardData()
 	}
 	case EConnectionState::UDPAssociate:
 	{
+		// The association lives as long as the control connection, any data or hang up on it ends the association.
+		if (Socket == Client) {
+			State = EConnectionState::ReuqestClose;
+			return;
+		}
+
 		if (!TransportUDPTraffic()) {
 			State = EConnectionState::ReuqestClose;
 			return;
 		}
 		break;
 	}
+	default:
+		break;
 	}
 	
 }
 
-bool ProxyContext::TransportTraffic()
+void ProxyContext::StartConnectAttempt()
 {
-	FD_SET readSet;
-	FD_ZERO(&readSet);
-	FD_SET(Client, &readSet);
-	FD_SET(Destination, &readSet);
+	while (NextCandidate < ConnectCandidates.size())
+	{
+		const SOCKADDR_STORAGE& addr = ConnectCandidates[NextCandidate++];
+		int addrLen = static_cast<int>(addr.ss_family == AF_INET6 ? sizeof(SOCKADDR_IN6) : sizeof(SOCKADDR_IN));
+
+		SOCKET attempt = socket(addr.ss_family, SOCK_STREAM, 0);
+		if (attempt == INVALID_SOCKET) {
+			LastConnectError = MiscHelper::GetLastSocketError();
+			LOG(Error, "[Connection: %llu]Create a new socket to connect destination server failed, code: %d.", ConnectionId, LastConnectError);
+			continue;
+		}
+
+		if (!MiscHelper::SetNonBlocking(attempt)) {
+			LastConnectError = MiscHelper::GetLastSocketError();
+			MiscHelper::CloseSocket(attempt);
+			continue;
+		}
+
+		if (connect(attempt, (const SOCKADDR*)&addr, addrLen) == 0) {
+			FinishConnect(attempt);
+			return;
+		}
+
+		int errorCode = MiscHelper::GetLastSocketError();
+		if (!MiscHelper::IsConnectInProgress(errorCode)) {
+			LOG(Log, "[Connection: %llu]Connect attempt to destination server failed, code: %d.", ConnectionId, errorCode);
+			LastConnectError = errorCode;
+			MiscHelper::CloseSocket(attempt);
+			continue;
+		}
+
+		if (!Loop->Watch(attempt, shared_from_this(), false, true)) {
+			MiscHelper::CloseSocket(attempt);
+			continue;
+		}
+
+		ConnectAttempts.push_back(attempt);
+
+		// Without a delay the next address is only tried once this attempt fails.
+		int attemptDelay = ProxyServer::Get()->GetConnectAttemptDelay();
+		if (NextCandidate < ConnectCandidates.size() && attemptDelay > 0) {
+			ConnectAttemptTimer = Loop->AddTimer(attemptDelay, shared_from_this(), ETimerType::ConnectAttempt);
+		}
+
+		return;
+	}
+
+	if (ConnectAttempts.empty()) {
+		LOG(Error, "[Connection: %llu]Connect to destination server failure, code: %d.", ConnectionId, LastConnectError);
+		FailConnect(GetConnectFailureResponse(LastConnectError));
+	}
+}
+
+void ProxyContext::FinishConnect(SOCKET Connected)
+{
+	auto attempt = std::find(ConnectAttempts.begin(), ConnectAttempts.end(), Connected);
+	if (attempt != ConnectAttempts.end()) {
+		Loop->Unwatch(Connected);
+		ConnectAttempts.erase(attempt);
+	}
+
+	CloseConnectAttempts();
+
+	Destination = Connected;
+
+	// A slow side gets its bytes queued instead of blocking the loop, @see TransportTraffic
+	if (!MiscHelper::SetNonBlocking(Client) || !Loop->Watch(Destination, shared_from_this()) || !Loop->Modify(Client, true, false)) {
+		State = EConnectionState::LicenseError;
+		SendLicenseResponse(ETravelResponse::GeneralFailure);
+		return;
+	}
+
+	LOG(Log, "[Connection: %llu]Connect to destination server succeeded.", ConnectionId);
+	Metrics::Observe(EMetricHistogram::ConnectTime, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - ConnectStartTime).count());
+
+	if (!SendLicenseResponse(ETravelResponse::Succeeded)) {
+		State = EConnectionState::LicenseError;
+		return;
+	}
+
+	State = EConnectionState::Connected;
 
-	TIMEVAL timeout = { 1, 0 };
+	LastActive = std::chrono::steady_clock::now();
+
+	int idleTimeout = ProxyServer::Get()->GetIdleTimeout();
+	if (idleTimeout > 0) {
+		IdleTimer = Loop->AddTimer(idleTimeout, shared_from_this(), ETimerType::Idle);
+	}
+
+	if (!FlushPendingPayload()) {
+		State = EConnectionState::ReuqestClose;
+		return;
+	}
 
-	int selectResult = select(0, &readSet, nullptr, nullptr, &timeout);
-	if (selectResult < 0 || selectResult > 2) {
-		LOG(Error, "[Connection: %s]Select result out of range %d, code: %d", GetCurrentThreadId().c_str(), selectResult, WSAGetLastError());
+	// A loop on io_uring relays both directions by itself, otherwise they're relayed on readiness events.
+	// Bytes already queued for a slow destination keep the connection on readiness events.
+	if (GetQueuedBytes(0) == 0) {
+		Loop->StartRelay(Client, Destination);
+	}
+}
+
+bool ProxyContext::FlushPendingPayload()
+{
+	if (PendingPayload.empty()) {
+		return true;
+	}
+
+	int payloadSize = static_cast<int>(PendingPayload.size());
+	int bufferSize = std::max(RelayDirections[0].BufferSize, payloadSize);
+	RelayQueues[0].Reserve(bufferSize);
+
+	if (RelayQueues[0].Write(PendingPayload.data(), payloadSize) < payloadSize) {
+		LOG(Error, "[Connection: %llu]Pipelined payload of %d bytes doesn't fit the relay buffer.", ConnectionId, payloadSize);
 		return false;
 	}
 
+	std::vector<char>().swap(PendingPayload);
+
+	return FlushTraffic(0);
+}
+
+void ProxyContext::FailConnect(ETravelResponse Response)
+{
+	CloseConnectAttempts();
+
+	State = EConnectionState::LicenseError;
+	SendLicenseResponse(Response);
+}
+
+void ProxyContext::CloseConnectAttempts()
+{
+	for (SOCKET attempt : ConnectAttempts)
+	{
+		Loop->Unwatch(attempt);
+		MiscHelper::CloseSocket(attempt);
+	}
+
+	ConnectAttempts.clear();
+
+	Loop->CancelTimer(ConnectTimeoutTimer);
+	Loop->CancelTimer(ConnectAttemptTimer);
+	ConnectTimeoutTimer = ConnectAttemptTimer = 0;
+}
+
+ETravelResponse ProxyContext::GetConnectFailureResponse(int ErrorCode)
+{
+	switch (ErrorCode)
+	{
+#ifdef __linux__
+	case ECONNREFUSED:
+		return ETravelResponse::ConnectionRefused;
+	case ENETUNREACH:
+		return ETravelResponse::NetworkUnreachable;
+	case EHOSTUNREACH:
+		return ETravelResponse::HostUnreachable;
+	case ETIMEDOUT:
+		return ETravelResponse::TTL_Expired;
+#else
+	case WSAECONNREFUSED:
+		return ETravelResponse::ConnectionRefused;
+	case WSAENETUNREACH:
+		return ETravelResponse::NetworkUnreachable;
+	case WSAEHOSTUNREACH:
+		return ETravelResponse::HostUnreachable;
+	case WSAETIMEDOUT:
+		return ETravelResponse::TTL_Expired;
+#endif
+	default:
+		return ETravelResponse::GeneralFailure;
+	}
+}
 
-	if (FD_ISSET(Client, &readSet)) {
-		if (!TransportTraffic(Client, Destination)) {
+bool ProxyContext::TransportTraffic(SOCKET Source, SOCKET Target)
+{
+#ifdef __linux__
+	if (bSpliceSupported) {
+		return SpliceTraffic(Source, Target);
+	}
+#endif
+
+	int directionIndex = Source == Client ? 0 : 1;
+	RelayDirectionState& direction = RelayDirections[directionIndex];
+	RelayRingBuffer& queue = RelayQueues[directionIndex];
+
+	if (direction.bSourceClosed) {
+		return FlushTraffic(directionIndex);
+	}
+
+	if (!queue.HasBuffer()) {
+		int bufferSize = direction.BufferSize;
+		queue.Reserve(bufferSize);
+		direction.BufferSize = bufferSize;
+	}
+
+	if (queue.GetFreeSpace() == 0) {
+		return CheckPausedSource(Source) && FlushTraffic(directionIndex);
+	}
+
+	// Only a read into an empty ring can fill the whole buffer, filling the rest behind queued bytes mustn't grow it.
+	int requested = queue.IsEmpty() ? queue.GetFreeSpace() : direction.BufferSize;
+	int recvState = queue.RecvFrom(Source);
+	if (recvState == SOCKET_ERROR) {
+		int errorCode = MiscHelper::GetLastSocketError();
+		if (!MiscHelper::IsWouldBlock(errorCode)) {
+			LOG(Error, "[Connection: %llu]Recv buffer error: %d , code: %d", ConnectionId, recvState, errorCode);
 			return false;
 		}
 	}
-	
-	if (FD_ISSET(Destination, &readSet)) {
-		if (!TransportTraffic(Destination, Client)) {
+	else if (recvState == 0) {
+		direction.bSourceClosed = true;
+	}
+	else {
+		RelayBufferPool::Get()->AdaptSize(direction, recvState, requested);
+	}
+
+	return FlushTraffic(directionIndex);
+}
+
+bool ProxyContext::FlushTraffic(int DirectionIndex)
+{
+	RelayDirectionState& direction = RelayDirections[DirectionIndex];
+	RelayRingBuffer& queue = RelayQueues[DirectionIndex];
+	SOCKET target = DirectionIndex == 0 ? Destination : Client;
+
+	while (!queue.IsEmpty())
+	{
+		int sendState = queue.SendTo(target);
+		if (sendState == SOCKET_ERROR) {
+			int errorCode = MiscHelper::GetLastSocketError();
+			if (MiscHelper::IsWouldBlock(errorCode)) {
+				break;
+			}
+
+			LOG(Error, "[Connection: %llu]Send traffic error: %d, code: %d", ConnectionId, sendState, errorCode);
 			return false;
 		}
+
+		direction.RelayedBytes += static_cast<unsigned long long>(sendState);
+		Metrics::Add(DirectionIndex == 0 ? EMetricCounter::ClientBytes : EMetricCounter::DestinationBytes, static_cast<uint64_t>(sendState));
+	}
+
+	if (queue.IsEmpty()) {
+		// Only a direction with a slow target holds its buffer, the next read takes one from the pool again.
+		queue.Release();
+
+#ifdef __linux__
+		// Spliced bytes were read after the queued ones.
+		if (direction.PipeBytes > 0 && !FlushPipe(DirectionIndex)) {
+			return false;
+		}
+#endif
+	}
+
+	// Everything the source sent before it closed is forwarded.
+	if (direction.bSourceClosed && GetQueuedBytes(DirectionIndex) == 0) {
+		return false;
+	}
+
+	return UpdateRelayInterest();
+}
+
+int ProxyContext::GetQueuedBytes(int DirectionIndex) const
+{
+	return RelayQueues[DirectionIndex].GetSize() + RelayDirections[DirectionIndex].PipeBytes;
+}
+
+bool ProxyContext::UpdateRelayInterest()
+{
+	std::shared_ptr<ProxyServer> server = ProxyServer::Get();
+
+	for (int directionIndex = 0; directionIndex < 2; directionIndex++)
+	{
+		RelayDirectionState& direction = RelayDirections[directionIndex];
+
+		// A full queue can't take more whatever the watermark is.
+		int highWatermark = server->GetRelayHighWatermark();
+		if (RelayQueues[directionIndex].HasBuffer()) {
+			highWatermark = std::min(highWatermark, RelayQueues[directionIndex].GetCapacity());
+		}
+		// A pipe can run out of slots before its bytes reach a watermark, so it's drained completely first.
+		int lowWatermark = direction.PipeBytes > 0 ? 0 : std::min(server->GetRelayLowWatermark(), highWatermark / 2);
+
+		int queuedBytes = GetQueuedBytes(directionIndex);
+		if (queuedBytes >= highWatermark) {
+			direction.bPaused = true;
+		}
+		else if (queuedBytes <= lowWatermark) {
+			direction.bPaused = false;
+		}
+	}
+
+	bool bReadClient = !RelayDirections[0].bPaused && !RelayDirections[0].bSourceClosed;
+	bool bReadDestination = !RelayDirections[1].bPaused && !RelayDirections[1].bSourceClosed;
+
+	return Loop->Modify(Client, bReadClient, GetQueuedBytes(1) > 0) && Loop->Modify(Destination, bReadDestination, GetQueuedBytes(0) > 0);
+}
+
+bool ProxyContext::CheckPausedSource(SOCKET Source)
+{
+	// Readability isn't watched while paused, the event is left from before the pause or the source failed.
+	int errorCode(0);
+	socklen_t errorLen = static_cast<socklen_t>(sizeof(errorCode));
+	if (getsockopt(Source, SOL_SOCKET, SO_ERROR, (char*)&errorCode, &errorLen) == 0 && errorCode != 0) {
+		LOG(Error, "[Connection: %llu]Paused %s failed, code: %d", ConnectionId, Source == Client ? "client" : "destination", errorCode);
+		return false;
 	}
 
 	return true;
 }
 
-bool ProxyContext::TransportTraffic(SOCKET Source, SOCKET Target)
+#ifdef __linux__
+bool ProxyContext::SpliceTraffic(SOCKET Source, SOCKET Target)
 {
-	int recvState(0), sendState(0), sentBytes(0);
-	char buffer[TRAFFIC_BUFFER_SIZE];
+	int directionIndex = Source == Client ? 0 : 1;
+	int* splicePipe = SplicePipes[directionIndex];
+	RelayDirectionState& direction = RelayDirections[directionIndex];
+	if (direction.BufferSize == 0) {
+		direction.BufferSize = RelayBufferPool::Get()->GetMinSize();
+	}
 
-	std::memset(buffer, 0, TRAFFIC_BUFFER_SIZE);
-	recvState = recv(Source, buffer, TRAFFIC_BUFFER_SIZE, 0);
+	if (direction.bSourceClosed) {
+		return FlushTraffic(directionIndex);
+	}
+
+	if (splicePipe[0] < 0) {
+		if (pipe2(splicePipe, O_NONBLOCK | O_CLOEXEC) != 0) {
+			LOG(Warning, "[Connection: %llu]Create splice pipe failed, code: %d, fall back to copy relay.", ConnectionId, errno);
+			splicePipe[0] = splicePipe[1] = -1;
+			bSpliceSupported = false;
+			return TransportTraffic(Source, Target);
+		}
+	}
+
+	ssize_t recvState = splice(static_cast<int>(Source), nullptr, splicePipe[1], nullptr, direction.BufferSize, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
 	if (recvState < 0) {
-		LOG(Error, "[Connection: %s]Recv buffer error: %d , code: %d", GetCurrentThreadId().c_str(), recvState, WSAGetLastError());
+		if (errno == EAGAIN || errno == EINTR) {
+			// Nothing to read, or the pipe is full because the target doesn't keep up.
+			if (errno == EAGAIN && direction.PipeBytes > 0) {
+				direction.bPaused = true;
+			}
+
+			return FlushTraffic(directionIndex);
+		}
+
+		if ((errno == EINVAL || errno == ENOSYS) && GetQueuedBytes(directionIndex) == 0) {
+			LOG(Warning, "[Connection: %llu]Splice not supported, fall back to copy relay.", ConnectionId);
+			bSpliceSupported = false;
+			return TransportTraffic(Source, Target);
+		}
+
+		LOG(Error, "[Connection: %llu]Splice from source error, code: %d", ConnectionId, errno);
 		return false;
 	}
 	else if (recvState == 0) {
-		return false;
+		direction.bSourceClosed = true;
+		return FlushTraffic(directionIndex);
 	}
-	else {
-		sentBytes = 0;
-		while (sentBytes < recvState)
+
+	int previousSize = direction.BufferSize;
+	RelayBufferPool::Get()->AdaptSize(direction, static_cast<int>(recvState), previousSize);
+	if (direction.BufferSize > previousSize && direction.BufferSize > SPLICE_PIPE_SIZE) {
+		// Best effort, the pipe keeps its old capacity when the system limit is lower.
+		fcntl(splicePipe[1], F_SETPIPE_SZ, direction.BufferSize);
+	}
+
+	direction.PipeBytes += static_cast<int>(recvState);
+
+	return FlushTraffic(directionIndex);
+}
+
+bool ProxyContext::FlushPipe(int DirectionIndex)
+{
+	RelayDirectionState& direction = RelayDirections[DirectionIndex];
+	SOCKET target = DirectionIndex == 0 ? Destination : Client;
+
+	while (direction.PipeBytes > 0)
+	{
+		ssize_t sendState = splice(SplicePipes[DirectionIndex][0], nullptr, static_cast<int>(target), nullptr, static_cast<size_t>(direction.PipeBytes), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (sendState < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			if (errno == EAGAIN) {
+				break;
+			}
+
+			LOG(Error, "[Connection: %llu]Splice to target error, code: %d", ConnectionId, errno);
+			return false;
+		}
+		else if (sendState == 0) {
+			return false;
+		}
+
+		direction.PipeBytes -= static_cast<int>(sendState);
+		direction.RelayedBytes += static_cast<unsigned long long>(sendState);
+		Metrics::Add(DirectionIndex == 0 ? EMetricCounter::ClientBytes : EMetricCounter::DestinationBytes, static_cast<uint64_t>(sendState));
+	}
+
+	return true;
+}
+#endif
+
+bool ProxyContext::TransportUDPTraffic()
+{
+#ifdef __linux__
+	if (ProxyServer::Get()->GetUDPBatchSize() > 1) {
+		return TransportUDPBatch();
+	}
+#endif
+
+	char buffer[UDP_DATAGRAM_MAX_SIZE];
+	UDPRelayDatagram datagram;
+
+	for (int index = 0; index < UDP_RELAY_MAX_BATCH; index++)
+	{
+		SOCKADDR_STORAGE sourceAddr;
+		std::memset(&sourceAddr, 0, sizeof(sourceAddr));
+		socklen_t addrLen = static_cast<socklen_t>(sizeof(sourceAddr));
+
+		int recvState = recvfrom(UDPClient, buffer, UDP_DATAGRAM_MAX_SIZE, 0, (SOCKADDR*)&sourceAddr, &addrLen);
+		if (recvState == SOCKET_ERROR) {
+			int errorCode = MiscHelper::GetLastSocketError();
+			if (MiscHelper::IsWouldBlock(errorCode)) {
+				return true;
+			}
+
+			// An oversized datagram or an ICMP error of an earlier send only loses that datagram.
+			if (MiscHelper::IsDatagramError(errorCode)) {
+				continue;
+			}
+
+			LOG(Error, "[Connection: %llu]Recv from udp relay failed, code: %d", ConnectionId, errorCode);
+			return false;
+		}
+
+		if (PrepareDatagram(buffer, recvState, sourceAddr, datagram) && !SendDatagram(datagram)) {
+			LOG(Warning, "[Connection: %llu]Send udp datagram to %s failed, code: %d", ConnectionId, MiscHelper::AddressToString(datagram.Addr).c_str(), MiscHelper::GetLastSocketError());
+		}
+	}
+
+	return true;
+}
+
+#ifdef __linux__
+bool ProxyContext::TransportUDPBatch()
+{
+	UDPBatchBuffers& buffers = GetUDPBatchBuffers(ProxyServer::Get()->GetUDPBatchSize());
+	int batchSize = buffers.BatchSize;
+	int sendNum(0);
+
+	for (int received = 0; received < UDP_RELAY_MAX_BATCH;)
+	{
+		for (int index = 0; index < batchSize; index++)
 		{
-			sendState = send(Target, buffer + sentBytes, recvState - sentBytes, 0);
-			if (sendState == SOCKET_ERROR) {
-				if (WSAGetLastError() == 10035) {
-					continue;
+			// The kernel overwrites the lengths of every received message.
+			msghdr& message = buffers.RecvMessages[index].msg_hdr;
+			message.msg_namelen = sizeof(SOCKADDR_STORAGE);
+			message.msg_controllen = UDP_BATCH_CONTROL_SIZE;
+			message.msg_flags = 0;
+		}
+
+		int recvNum = recvmmsg(static_cast<int>(UDPClient), buffers.RecvMessages.data(), batchSize, MSG_DONTWAIT, nullptr);
+		if (recvNum < 0) {
+			if (MiscHelper::IsWouldBlock(errno) || MiscHelper::IsDatagramError(errno)) {
+				break;
+			}
+
+			LOG(Error, "[Connection: %llu]Recv from udp relay failed, code: %d", ConnectionId, errno);
+			return false;
+		}
+
+		for (int index = 0; index < recvNum; index++)
+		{
+			msghdr& message = buffers.RecvMessages[index].msg_hdr;
+			char* data = (char*)message.msg_iov[0].iov_base;
+			int dataLen = static_cast<int>(buffers.RecvMessages[index].msg_len);
+			if ((message.msg_flags & MSG_TRUNC) != 0) {
+				continue;
+			}
+
+			// With GRO one message may carry several datagrams of the same flow, all but the last one are segment size long.
+			int segmentSize = dataLen;
+			for (cmsghdr* control = CMSG_FIRSTHDR(&message); control != nullptr; control = CMSG_NXTHDR(&message, control))
+			{
+				if (control->cmsg_level == SOL_UDP && control->cmsg_type == UDP_GRO) {
+					int groSize(0);
+					std::memcpy(&groSize, CMSG_DATA(control), sizeof(groSize));
+					segmentSize = groSize > 0 ? groSize : dataLen;
+				}
+			}
+
+			const SOCKADDR_STORAGE& sourceAddr = buffers.RecvAddrs[index];
+			for (int offset = 0; offset < dataLen; offset += segmentSize)
+			{
+				bool bReassembled(false);
+				if (PrepareDatagram(data + offset, std::min(segmentSize, dataLen - offset), sourceAddr, buffers.SendDatagrams[sendNum])) {
+					bReassembled = UDPFragments.IsReassembled(buffers.SendDatagrams[sendNum].Data);
+					sendNum++;
 				}
 
-				LOG(Error, "[Connection: %s]Send traffic error: %d, code: %d", GetCurrentThreadId().c_str(), sendState, WSAGetLastError());
-				return false;
+				// A reassembled datagram must leave before the next fragment reuses its buffer.
+				if (sendNum == batchSize || bReassembled) {
+					FlushUDPBatch(buffers, sendNum);
+					sendNum = 0;
+				}
 			}
+		}
+
+		// Queued datagrams point into the receive storage, they must leave before it's reused.
+		FlushUDPBatch(buffers, sendNum);
+		sendNum = 0;
 
-			sentBytes += sendState;
+		received += recvNum;
+		if (recvNum < batchSize) {
+			break;
 		}
 	}
 
 	return true;
 }
 
-bool ProxyContext::TransportUDPTraffic()
+UDPBatchBuffers& ProxyContext::GetUDPBatchBuffers(int BatchSize)
 {
-	int recvState(0), sendState(0);
-	
-	char buffer[TRAFFIC_BUFFER_SIZE];
-	SOCKADDR_IN recvAddr;
-	std::memset(&recvAddr, 0, sizeof(recvAddr));
-	recvAddr.sin_family = AF_INET;
-
-	unsigned long localIP;
-	MiscHelper::GetLocalHostS(localIP);
-	recvAddr.sin_addr.s_addr = htonl(localIP);
-	recvAddr.sin_port = htons(UDPPort);
-	int addrLen = static_cast<int>(sizeof(recvAddr));
-	recvState = recvfrom(UDPClient, buffer, TRAFFIC_BUFFER_SIZE, 0, (SOCKADDR*)&recvAddr, &addrLen);
-	if (recvState == SOCKET_ERROR) {
-		LOG(Log, "[Connection: %s]Recv from client failed, code: %d", GetCurrentThreadId().c_str(), WSAGetLastError());
+	static thread_local UDPBatchBuffers buffers;
+	if (buffers.BatchSize == BatchSize) {
+		return buffers;
+	}
+
+	const size_t slotSize = UDP_DATAGRAM_MAX_SIZE;
+
+	buffers.BatchSize = BatchSize;
+	buffers.Storage.assign(slotSize * BatchSize, 0);
+	buffers.Controls.assign(static_cast<size_t>(UDP_BATCH_CONTROL_SIZE) * BatchSize, 0);
+	buffers.RecvMessages.assign(BatchSize, mmsghdr());
+	buffers.RecvVectors.assign(BatchSize, iovec());
+	buffers.RecvAddrs.assign(BatchSize, SOCKADDR_STORAGE());
+	buffers.SendDatagrams.assign(BatchSize, UDPRelayDatagram());
+	buffers.SendMessages.assign(BatchSize, mmsghdr());
+	buffers.SendVectors.assign(static_cast<size_t>(BatchSize) * 2, iovec());
+
+	for (int index = 0; index < BatchSize; index++)
+	{
+		buffers.RecvVectors[index].iov_base = buffers.Storage.data() + slotSize * index;
+		buffers.RecvVectors[index].iov_len = slotSize;
+
+		msghdr& message = buffers.RecvMessages[index].msg_hdr;
+		message.msg_name = &buffers.RecvAddrs[index];
+		message.msg_iov = &buffers.RecvVectors[index];
+		message.msg_iovlen = 1;
+		message.msg_control = buffers.Controls.data() + UDP_BATCH_CONTROL_SIZE * index;
+	}
+
+	return buffers;
+}
+
+void ProxyContext::FlushUDPBatch(UDPBatchBuffers& Buffers, int SendNum)
+{
+	for (int index = 0; index < SendNum; index++)
+	{
+		UDPRelayDatagram& datagram = Buffers.SendDatagrams[index];
+
+		iovec* vectors = &Buffers.SendVectors[index * 2];
+		vectors[0].iov_base = datagram.Header;
+		vectors[0].iov_len = static_cast<size_t>(datagram.HeaderLen);
+		vectors[1].iov_base = (void*)datagram.Data;
+		vectors[1].iov_len = static_cast<size_t>(datagram.DataLen);
+
+		msghdr& message = Buffers.SendMessages[index].msg_hdr;
+		std::memset(&message, 0, sizeof(message));
+		message.msg_name = &datagram.Addr;
+		message.msg_namelen = static_cast<socklen_t>(MiscHelper::GetAddressLength(datagram.Addr));
+		message.msg_iov = vectors;
+		message.msg_iovlen = 2;
+	}
+
+	int sentNum(0);
+	while (sentNum < SendNum)
+	{
+		int sendState = sendmmsg(static_cast<int>(UDPClient), Buffers.SendMessages.data() + sentNum, SendNum - sentNum, 0);
+		if (sendState < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			// UDP is best effort, a full socket buffer drops the rest and any other error only the failed datagram.
+			LOG(Warning, "[Connection: %llu]Send udp datagram to %s failed, code: %d", ConnectionId, MiscHelper::AddressToString(Buffers.SendDatagrams[sentNum].Addr).c_str(), errno);
+			if (MiscHelper::IsWouldBlock(errno)) {
+				return;
+			}
+
+			sentNum++;
+			continue;
+		}
+
+		sentNum += sendState;
+	}
+}
+#endif
+
+bool ProxyContext::PrepareDatagram(const char* Data, int Len, const SOCKADDR_STORAGE& Source, UDPRelayDatagram& Datagram)
+{
+	SOCKADDR_STORAGE sourceAddr = Source;
+	MiscHelper::UnmapAddress(sourceAddr);
+
+	UDPLastActive = std::chrono::steady_clock::now();
+
+	if (IsUDPClientAddress(sourceAddr)) {
+		return PrepareClientDatagram(Data, Len, Datagram);
+	}
+
+	return PrepareRemoteDatagram(Data, Len, sourceAddr, Datagram);
+}
+
+bool ProxyContext::HandleRelayDatagram(const char* Data, int Len, const SOCKADDR_STORAGE& Source, bool bFromClient, UDPRelayDatagram& Datagram)
+{
+	UDPLastActive = std::chrono::steady_clock::now();
+
+	if (bFromClient) {
+		// The relay already matched the client, this only learns its port.
+		IsUDPClientAddress(Source);
+		return PrepareClientDatagram(Data, Len, Datagram);
+	}
+
+	return PrepareRemoteDatagram(Data, Len, Source, Datagram);
+}
+
+bool ProxyContext::IsUDPClientAddress(const SOCKADDR_STORAGE& Source)
+{
+	if (!MiscHelper::IsSameAddress(Source, UDPClientAddr, false)) {
+		return false;
+	}
+
+	unsigned short expectedPort = UDPClientAddr.ss_family == AF_INET6 ? ((SOCKADDR_IN6*)&UDPClientAddr)->sin6_port : ((SOCKADDR_IN*)&UDPClientAddr)->sin_port;
+	if (expectedPort == 0) {
+		// The first datagram of the client host fixes its port.
+		UDPClientAddr = Source;
+		return true;
+	}
+
+	return MiscHelper::IsSameAddress(Source, UDPClientAddr, true);
+}
+
+bool ProxyContext::PrepareClientDatagram(const char* Data, int Len, UDPRelayDatagram& Datagram)
+{
+	UDPTravelReply packet;
+	if (!ParseUDPPacket(Data, Len, packet)) {
+		LOG(Warning, "[Connection: %llu]Drop a malformed udp datagram from client.", ConnectionId);
+		return false;
+	}
+
+	if (packet.Fragment != 0 && !ReassembleUDPPacket(packet)) {
+		return false;
+	}
+
+	if (!ParseUDPDestination(packet, Datagram.Addr) || !MiscHelper::MapAddress(Datagram.Addr, UDPSocketFamily)) {
+		return false;
+	}
+
+	Datagram.HeaderLen = 0;
+	Datagram.Data = packet.Data;
+	Datagram.DataLen = packet.DataLen;
+
+	Metrics::Add(EMetricCounter::UDPClientDatagrams);
+	Metrics::Add(EMetricCounter::UDPClientBytes, static_cast<uint64_t>(Datagram.DataLen));
+	return true;
+}
+
+bool ProxyContext::ReassembleUDPPacket(UDPTravelReply& Packet)
+{
+	UDPTravelReply fragment = Packet;
+
+	EReassemblyResult result = UDPFragments.Add(fragment, Packet);
+	switch (result)
+	{
+	case EReassemblyResult::Queued:
+	{
+		// Every sequence gets the whole timeout from its first fragment on.
+		if (UDPFragments.GetPosition() == 1) {
+			Loop->CancelTimer(UDPReassemblyTimer);
+			UDPReassemblyTimer = Loop->AddTimer(UDP_REASSEMBLY_TIMEOUT_MSEC, shared_from_this(), ETimerType::UDPReassembly);
+		}
+		return false;
+	}
+	case EReassemblyResult::Completed:
+	{
+		// The buffer is kept for the next sequence until the timer releases it.
+		Loop->CancelTimer(UDPReassemblyTimer);
+		UDPReassemblyTimer = Loop->AddTimer(UDP_REASSEMBLY_TIMEOUT_MSEC, shared_from_this(), ETimerType::UDPReassembly);
+		return true;
+	}
+	default:
+		LOG(Warning, "[Connection: %llu]Drop a udp fragment, fragment: %d.", ConnectionId, static_cast<int>(static_cast<uint8_t>(fragment.Fragment)));
 		return false;
 	}
+}
 
-	if (recvState != 0) {
-		UDPTravelReply reply = ParseUDPPacket(buffer, recvState);
-		addrLen = static_cast<int>(sizeof(DestAddr));
-		sendState = sendto(Destination, reply.Data.data(), static_cast<int>(reply.Data.size()), 0, (SOCKADDR*)&DestAddr, addrLen);
+bool ProxyContext::PrepareRemoteDatagram(const char* Data, int Len, const SOCKADDR_STORAGE& Source, UDPRelayDatagram& Datagram)
+{
+	Datagram.Addr = UDPClientAddr;
+	unsigned short clientPort = Datagram.Addr.ss_family == AF_INET6 ? ((SOCKADDR_IN6*)&Datagram.Addr)->sin6_port : ((SOCKADDR_IN*)&Datagram.Addr)->sin_port;
+	if (clientPort == 0 || !MiscHelper::MapAddress(Datagram.Addr, UDPSocketFamily)) {
+		// Nowhere to relay before the client sent its first datagram.
 		return false;
 	}
 
+	Datagram.HeaderLen = 0;
+	Datagram.Header[Datagram.HeaderLen++] = 0x00;
+	Datagram.Header[Datagram.HeaderLen++] = 0x00;
+	Datagram.Header[Datagram.HeaderLen++] = 0x00;
+	Datagram.HeaderLen += WriteReplyAddress(Datagram.Header + Datagram.HeaderLen, Source);
+
+	Datagram.Data = Data;
+	Datagram.DataLen = Len;
+
+	Metrics::Add(EMetricCounter::UDPRemoteDatagrams);
+	Metrics::Add(EMetricCounter::UDPRemoteBytes, static_cast<uint64_t>(Len));
+	return true;
+}
+
+bool ProxyContext::SendDatagram(const UDPRelayDatagram& Datagram)
+{
+	return MiscHelper::SendDatagram(UDPClient, Datagram.Header, Datagram.HeaderLen, Datagram.Data, Datagram.DataLen, Datagram.Addr);
+}
+
+bool ProxyContext::ParseUDPDestination(const UDPTravelReply& Packet, SOCKADDR_STORAGE& Addr)
+{
+	std::memset(&Addr, 0, sizeof(Addr));
+
+	if (Packet.AddressType == EAddressType::IPv4 && Packet.BindAddressLen == 4) {
+		SOCKADDR_IN* addr = (SOCKADDR_IN*)&Addr;
+		addr->sin_family = AF_INET;
+		std::memcpy(&addr->sin_addr, Packet.BindAddress, 4);
+		std::memcpy(&addr->sin_port, Packet.BindPort, 2);
+		return true;
+	}
+
+	if (Packet.AddressType == EAddressType::IPv6 && Packet.BindAddressLen == 16) {
+		SOCKADDR_IN6* addr = (SOCKADDR_IN6*)&Addr;
+		addr->sin6_family = AF_INET6;
+		std::memcpy(&addr->sin6_addr, Packet.BindAddress, 16);
+		std::memcpy(&addr->sin6_port, Packet.BindPort, 2);
+		return true;
+	}
+
+	// Cached names are sent right away, others wait in the queue for their lookup.
+	if (Packet.AddressType == EAddressType::DomainName && Packet.BindAddressLen > 0) {
+		ResolveResult result;
+		std::string hostName(Packet.BindAddress, Packet.BindAddressLen);
+		if (!DnsResolver::Get()->Lookup(hostName, result)) {
+			QueueUDPDatagram(Packet);
+			return false;
+		}
+
+		if (!SelectUDPAddress(result, Packet.BindPort, Addr)) {
+			Metrics::Add(EMetricCounter::UDPDroppedDatagrams);
+			return false;
+		}
+		return true;
+	}
+
 	return false;
 }
 
-std::string ProxyContext::GetCurrentThreadId()
+void ProxyContext::QueueUDPDatagram(const UDPTravelReply& Packet)
+{
+	if (static_cast<int>(UDPPendingDatagrams.size()) >= UDP_PENDING_MAX_NUM || UDPPendingBytes + Packet.DataLen > UDP_PENDING_MAX_SIZE) {
+		// Counted only, a client flooding unresolved names would flood the log too.
+		Metrics::Add(EMetricCounter::UDPDroppedDatagrams);
+		return;
+	}
+
+	std::string hostName(Packet.BindAddress, Packet.BindAddressLen);
+	bool bResolving = std::any_of(UDPPendingDatagrams.begin(), UDPPendingDatagrams.end(),
+	[&hostName](const PendingUDPDatagram& Pending)
+	{
+		return Pending.HostName == hostName;
+	});
+
+	UDPPendingDatagrams.emplace_back();
+	PendingUDPDatagram& pending = UDPPendingDatagrams.back();
+	pending.HostName = hostName;
+	std::memcpy(pending.Port, Packet.BindPort, 2);
+	pending.Data.assign(Packet.Data, Packet.Data + Packet.DataLen);
+	UDPPendingBytes += Packet.DataLen;
+
+	if (bResolving) {
+		return;
+	}
+
+	EventLoop* loop = Loop;
+	std::weak_ptr<ProxyContext> weakThis = shared_from_this();
+	DnsResolver::Get()->ResolveAsync(hostName,
+	[loop, weakThis, hostName](const ResolveResult& Result)
+	{
+		loop->PostContextTask(weakThis,
+		[hostName, Result](const std::shared_ptr<ProxyContext>& Context)
+		{
+			Context->FlushUDPDatagrams(hostName, Result);
+		});
+	});
+}
+
+void ProxyContext::FlushUDPDatagrams(const std::string& HostName, const ResolveResult& Result)
 {
-	std::stringstream stream;
-	stream << std::this_thread::get_id();
+	SharedUDPRelay* relay = bUDPShared ? Loop->GetUDPRelay() : nullptr;
+
+	for (auto pending = UDPPendingDatagrams.begin(); pending != UDPPendingDatagrams.end();)
+	{
+		if (pending->HostName != HostName) {
+			++pending;
+			continue;
+		}
+
+		UDPRelayDatagram datagram;
+		datagram.HeaderLen = 0;
+		datagram.Data = pending->Data.data();
+		datagram.DataLen = static_cast<int>(pending->Data.size());
 
-	return stream.str();
+		bool bSent(false);
+		if (SelectUDPAddress(Result, pending->Port, datagram.Addr)) {
+			bSent = relay != nullptr ? relay->SendToRemote(this, datagram) : (!bUDPShared && SendDatagram(datagram));
+		}
+
+		if (bSent) {
+			Metrics::Add(EMetricCounter::UDPClientDatagrams);
+			Metrics::Add(EMetricCounter::UDPClientBytes, static_cast<uint64_t>(datagram.DataLen));
+		}
+		else {
+			Metrics::Add(EMetricCounter::UDPDroppedDatagrams);
+		}
+
+		UDPPendingBytes -= datagram.DataLen;
+		pending = UDPPendingDatagrams.erase(pending);
+	}
+
+	if (Result.Error != 0 || Result.Addresses.empty()) {
+		Metrics::Add(EMetricCounter::DnsFailures);
+		LOG(Warning, "[Connection: %llu]Resolve udp destination %s failed, err: %d.", ConnectionId, HostName.c_str(), Result.Error);
+	}
+}
+
+bool ProxyContext::SelectUDPAddress(const ResolveResult& Result, const char Port[2], SOCKADDR_STORAGE& Addr)
+{
+	if (Result.Error != 0) {
+		return false;
+	}
+
+	// AAAA answers come first, an IPv4 relay socket has to skip them.
+	for (const SOCKADDR_STORAGE& address : Result.Addresses)
+	{
+		Addr = address;
+		if (!MiscHelper::MapAddress(Addr, UDPSocketFamily)) {
+			continue;
+		}
+
+		if (Addr.ss_family == AF_INET6) {
+			std::memcpy(&((SOCKADDR_IN6*)&Addr)->sin6_port, Port, 2);
+		}
+		else {
+			std::memcpy(&((SOCKADDR_IN*)&Addr)->sin_port, Port, 2);
+		}
+		return true;
+	}
+
+	return false;
+}
+
+int ProxyContext::WriteReplyAddress(char* Buffer, const SOCKADDR_STORAGE& Addr)
+{
+	int writeLen(0);
+
+	if (Addr.ss_family == AF_INET6) {
+		const SOCKADDR_IN6* addrIn6 = (const SOCKADDR_IN6*)&Addr;
+		Buffer[writeLen++] = static_cast<char>(EAddressType::IPv6);
+		std::memcpy(Buffer + writeLen, &addrIn6->sin6_addr, 16);
+		writeLen += 16;
+		std::memcpy(Buffer + writeLen, &addrIn6->sin6_port, 2);
+		writeLen += 2;
+	}
+	else {
+		const SOCKADDR_IN* addrIn = (const SOCKADDR_IN*)&Addr;
+		Buffer[writeLen++] = static_cast<char>(EAddressType::IPv4);
+		std::memcpy(Buffer + writeLen, &addrIn->sin_addr, 4);
+		writeLen += 4;
+		std::memcpy(Buffer + writeLen, &addrIn->sin_port, 2);
+		writeLen += 2;
+	}
+
+	return writeLen;
 }
 
 std::string ProxyContext::GetTravelResponseName(ETravelResponse Response)
@@ -463,56 +1691,74 @@ std::string ProxyContext::GetTravelResponseName(ETravelResponse Response)
 
 bool ProxyContext::ParseTCPPayloadAddress()
 {
-	std::memset(&DestAddr, 0, sizeof(DestAddr));
-	std::memcpy(&DestAddr.sin_port, LicensePayload.DestPort.data(), 2);
+	ConnectCandidates.clear();
+	NextCandidate = 0;
+
+	unsigned short nport(0);
+	std::memcpy(&nport, LicensePayload.DestPort, 2);
+
 	switch (LicensePayload.AddressType)
 	{
 	case EAddressType::IPv4:
 	{
-		DestAddr.sin_family = AF_INET;
+		SOCKADDR_STORAGE candidate;
+		std::memset(&candidate, 0, sizeof(candidate));
 
-		std::memcpy(&DestAddr.sin_addr, LicensePayload.DestAddr.data(), 4);
-
-		Destination = socket(AF_INET, SOCK_STREAM, 0);
+		SOCKADDR_IN* addr = (SOCKADDR_IN*)&candidate;
+		addr->sin_family = AF_INET;
+		addr->sin_port = nport;
+		std::memcpy(&addr->sin_addr, LicensePayload.DestAddr, 4);
 
+		ConnectCandidates.push_back(candidate);
 		break;
 	}
 	case EAddressType::DomainName:
 	{
-		DestAddr.sin_family = AF_INET;
-
-		ADDRINFO info, * result;
-		std::memset(&info, 0, sizeof(ADDRINFO));
-		info.ai_socktype = SOCK_STREAM;
-		info.ai_family = AF_INET;
-
-		int error = getaddrinfo(LicensePayload.DestAddr.data(), nullptr, &info, &result);
-		if (error != 0) {
-			LOG(Warning, "[Connection: %s]Convert hostname to ip address failed, err: %s.", GetCurrentThreadId().c_str(), gai_strerrorA(error));
-			State = EConnectionState::LicenseError;
-			SendLicenseResponse(ETravelResponse::HostUnreachable);
-			return false;
+		std::vector<SOCKADDR_STORAGE> ipv6Addrs, ipv4Addrs;
+		for (SOCKADDR_STORAGE candidate : ResolvedAddrs)
+		{
+			if (candidate.ss_family == AF_INET6) {
+				((SOCKADDR_IN6*)&candidate)->sin6_port = nport;
+				ipv6Addrs.push_back(candidate);
+			}
+			else if (candidate.ss_family == AF_INET) {
+				((SOCKADDR_IN*)&candidate)->sin_port = nport;
+				ipv4Addrs.push_back(candidate);
+			}
 		}
 
-		DestAddr.sin_addr = ((SOCKADDR_IN*)(result->ai_addr))->sin_addr;
-
-		freeaddrinfo(result);
+		// RFC 8305 section 4, interleave the families starting with IPv6.
+		for (size_t index = 0; index < std::max(ipv6Addrs.size(), ipv4Addrs.size()); index++)
+		{
+			if (index < ipv6Addrs.size()) {
+				ConnectCandidates.push_back(ipv6Addrs[index]);
+			}
 
-		Destination = socket(AF_INET, SOCK_STREAM, 0);
+			if (index < ipv4Addrs.size()) {
+				ConnectCandidates.push_back(ipv4Addrs[index]);
+			}
+		}
 
 		break;
 	}
 	case EAddressType::IPv6:
 	{
-		State = EConnectionState::LicenseError;
-		SendLicenseResponse(ETravelResponse::AddrNotSupported);
-		return false;
+		SOCKADDR_STORAGE candidate;
+		std::memset(&candidate, 0, sizeof(candidate));
+
+		SOCKADDR_IN6* addr = (SOCKADDR_IN6*)&candidate;
+		addr->sin6_family = AF_INET6;
+		addr->sin6_port = nport;
+		std::memcpy(&addr->sin6_addr, LicensePayload.DestAddr, 16);
+
+		ConnectCandidates.push_back(candidate);
+		break;
 	}
 	}
 
-	if (Destination == INVALID_SOCKET) {
-		LOG(Error, "[Connection: %s]Create a new socket to connect destination server failed, code: %d.", GetCurrentThreadId().c_str(), WSAGetLastError());
-		SendLicenseResponse(ETravelResponse::GeneralFailure);
+	if (ConnectCandidates.empty()) {
+		LOG(Warning, "[Connection: %llu]No address to connect destination server.", ConnectionId);
+		SendLicenseResponse(ETravelResponse::HostUnreachable);
 		return false;
 	}
 
@@ -521,98 +1767,145 @@ bool ProxyContext::ParseTCPPayloadAddress()
 
 bool ProxyContext::ParseUDPPayloadAddress()
 {
-	std::memset(&UDPClientAddr, 0, sizeof(UDPClientAddr));
-	std::memcpy(&UDPClientAddr.sin_port, LicensePayload.DestPort.data(), 2);
-	switch (LicensePayload.AddressType)
-	{
-	case EAddressType::IPv4:
-	{
-		if (!MiscHelper::GetAvaliablePort(UDPPort, false)) {
-			LOG(Warning, "[Connection: %s]Get avaliable port failed, err: %d.", GetCurrentThreadId().c_str(), WSAGetLastError());
-			State = EConnectionState::LicenseError;
-			SendLicenseResponse(ETravelResponse::GeneralFailure);
-			return false;
-		}
-
-		UDPClientAddr.sin_family = AF_INET;
-
-		std::memcpy(&DestAddr.sin_addr, LicensePayload.DestAddr.data(), 4);
-
-		UDPClient = socket(AF_INET, SOCK_DGRAM, 0);
+	unsigned short nport(0);
+	std::memcpy(&nport, LicensePayload.DestPort, 2);
+
+	SOCKADDR_STORAGE localAddr, peerAddr;
+	std::memset(&localAddr, 0, sizeof(localAddr));
+	std::memset(&peerAddr, 0, sizeof(peerAddr));
+	socklen_t localLen = static_cast<socklen_t>(sizeof(localAddr));
+	socklen_t peerLen = static_cast<socklen_t>(sizeof(peerAddr));
+	if (getsockname(Client, (SOCKADDR*)&localAddr, &localLen) != 0 || getpeername(Client, (SOCKADDR*)&peerAddr, &peerLen) != 0) {
+		LOG(Error, "[Connection: %llu]Get control connection address failed, code: %d.", ConnectionId, MiscHelper::GetLastSocketError());
+		SendLicenseResponse(ETravelResponse::GeneralFailure);
+		return false;
+	}
 
-		break;
+	// Datagrams are only accepted from the host of the control connection, clients behind NAT can't know their public address.
+	// The requested port is kept, 0 means the first datagram decides it.
+	UDPClientAddr = peerAddr;
+	MiscHelper::UnmapAddress(UDPClientAddr);
+	if (UDPClientAddr.ss_family == AF_INET6) {
+		((SOCKADDR_IN6*)&UDPClientAddr)->sin6_port = nport;
 	}
-	case EAddressType::DomainName:
-	{
-		if (!MiscHelper::GetAvaliablePort(UDPPort, false)) {
-			LOG(Warning, "[Connection: %s]Get avaliable port failed, err: %d.", GetCurrentThreadId().c_str(), WSAGetLastError());
-			State = EConnectionState::LicenseError;
+	else {
+		((SOCKADDR_IN*)&UDPClientAddr)->sin_port = nport;
+	}
+
+	if (ProxyServer::Get()->IsUDPSharedRelay()) {
+		SharedUDPRelay* relay = Loop->GetUDPRelay();
+		if (relay == nullptr || (relay->GetFamily() == AF_INET && UDPClientAddr.ss_family == AF_INET6)) {
+			LOG(Error, "[Connection: %llu]No shared udp relay for the association.", ConnectionId);
 			SendLicenseResponse(ETravelResponse::GeneralFailure);
 			return false;
 		}
 
-		UDPClientAddr.sin_family = AF_INET;
+		bUDPShared = true;
+		UDPSocketFamily = relay->GetFamily();
+		UDPPort = relay->GetPort();
+		relay->Associate(UDPClientAddr, shared_from_this());
+	}
+	// The relay socket follows the family the client reached the server with, a dual-stack one still reaches IPv4 destinations.
+	else if (!OpenUDPRelaySocket(localAddr.ss_family)) {
+		SendLicenseResponse(ETravelResponse::GeneralFailure);
+		return false;
+	}
 
-		ADDRINFO info, * result;
-		std::memset(&info, 0, sizeof(ADDRINFO));
-		info.ai_socktype = SOCK_DGRAM;
-		info.ai_family = AF_INET;
+	// Clients reach the relay through the local address of the control connection, cached for the reply.
+	UDPBoundAddr = localAddr;
+	MiscHelper::UnmapAddress(UDPBoundAddr);
+	if (UDPBoundAddr.ss_family == AF_INET6) {
+		((SOCKADDR_IN6*)&UDPBoundAddr)->sin6_port = htons(UDPPort);
+	}
+	else {
+		((SOCKADDR_IN*)&UDPBoundAddr)->sin_port = htons(UDPPort);
+	}
 
-		int error = getaddrinfo(LicensePayload.DestAddr.data(), nullptr, &info, &result);
-		if (error != 0) {
-			LOG(Warning, "[Connection: %s]Convert hostname to ip address failed, err: %s.", GetCurrentThreadId().c_str(), gai_strerrorA(error));
-			State = EConnectionState::LicenseError;
-			SendLicenseResponse(ETravelResponse::HostUnreachable);
-			return false;
-		}
+	return true;
+}
 
-		UDPClientAddr.sin_addr = ((SOCKADDR_IN*)(result->ai_addr))->sin_addr;
+bool ProxyContext::OpenUDPRelaySocket(int Family)
+{
+	UDPSocketFamily = Family;
+	UDPClient = socket(UDPSocketFamily, SOCK_DGRAM, 0);
+	if (UDPClient == INVALID_SOCKET) {
+		LOG(Error, "[Connection: %llu]Create udp relay socket failed, code: %d.", ConnectionId, MiscHelper::GetLastSocketError());
+		return false;
+	}
 
-		freeaddrinfo(result);
+	SOCKADDR_STORAGE bindAddr;
+	std::memset(&bindAddr, 0, sizeof(bindAddr));
+	bindAddr.ss_family = static_cast<decltype(bindAddr.ss_family)>(UDPSocketFamily);
 
-		UDPClient = socket(AF_INET, SOCK_DGRAM, 0);
+	if (UDPSocketFamily == AF_INET6) {
+		int v6Only = 0;
+		setsockopt(UDPClient, IPPROTO_IPV6, IPV6_V6ONLY, (const char*)&v6Only, sizeof(v6Only));
+	}
 
-		break;
+#ifdef __linux__
+	std::shared_ptr<ProxyServer> server = ProxyServer::Get();
+	if (server->GetUDPBatchSize() > 1 && server->IsUDPGroEnabled()) {
+		// Best effort, older kernels keep receiving one datagram per message.
+		int enable = 1;
+		setsockopt(static_cast<int>(UDPClient), SOL_UDP, UDP_GRO, &enable, sizeof(enable));
 	}
-	case EAddressType::IPv6:
-	{
-		State = EConnectionState::LicenseError;
-		SendLicenseResponse(ETravelResponse::AddrNotSupported);
+#endif
+
+	SOCKADDR_STORAGE boundAddr;
+	std::memset(&boundAddr, 0, sizeof(boundAddr));
+	socklen_t boundLen = static_cast<socklen_t>(sizeof(boundAddr));
+	if (bind(UDPClient, (SOCKADDR*)&bindAddr, MiscHelper::GetAddressLength(bindAddr)) == SOCKET_ERROR ||
+		getsockname(UDPClient, (SOCKADDR*)&boundAddr, &boundLen) != 0 ||
+		!MiscHelper::SetNonBlocking(UDPClient)) {
+		LOG(Error, "[Connection: %llu]Bind udp relay socket failed, code: %d.", ConnectionId, MiscHelper::GetLastSocketError());
 		return false;
 	}
-	}
 
-	if (UDPClient == INVALID_SOCKET) {
-		LOG(Error, "[Connection: %s]Create a new socket to connect destination server failed, code: %d.", GetCurrentThreadId().c_str(), WSAGetLastError());
-		SendLicenseResponse(ETravelResponse::GeneralFailure);
-		return false;
-	}
+	UDPPort = ntohs(boundAddr.ss_family == AF_INET6 ? ((SOCKADDR_IN6*)&boundAddr)->sin6_port : ((SOCKADDR_IN*)&boundAddr)->sin_port);
 
 	return true;
 }
 
-UDPTravelReply ProxyContext::ParseUDPPacket(const char* buffer, int Len)
+bool ProxyContext::ParseUDPPacket(const char* Buffer, int Len, UDPTravelReply& Packet)
 {
-	UDPTravelReply reply;
-
-	BufferReader reader(buffer, Len);
+	BufferView view(Buffer, Len);
 
-	reply.Reserved.resize(2);
-	reader.Serialize(reply.Reserved.data(), 2);
+	uint8_t fragment(0), addressType(0);
+	if (!view.Read(Packet.Reserved, 2) || !view.ReadUInt8(fragment) || !view.ReadUInt8(addressType)) {
+		return false;
+	}
 
-	reader.Serialize(&reply.Fragment, 1);
+	Packet.Fragment = static_cast<char>(fragment);
+	Packet.AddressType = static_cast<EAddressType>(addressType);
 
-	reader.Serialize(&reply.AddressType, 1);
+	switch (Packet.AddressType)
+	{
+	case EAddressType::IPv4:
+		Packet.BindAddressLen = 4;
+		break;
+	case EAddressType::IPv6:
+		Packet.BindAddressLen = 16;
+		break;
+	case EAddressType::DomainName:
+	{
+		uint8_t nameLen(0);
+		if (!view.ReadUInt8(nameLen)) {
+			return false;
+		}
 
-	reply.BindAddress.resize(4);
-	reader.Serialize(reply.BindAddress.data(), 4);
+		Packet.BindAddressLen = nameLen;
+		break;
+	}
+	default:
+		return false;
+	}
 
-	reply.BindPort.resize(2);
-	reader.Serialize(reply.BindPort.data(), 2);
+	if (!view.Read(Packet.BindAddress, Packet.BindAddressLen) || !view.Read(Packet.BindPort, 2)) {
+		return false;
+	}
 
-	int dataLen = Len - 2 - 1 - 4 - 2;
-	reply.Data.resize(dataLen);
-	reader.Serialize(reply.Data.data(), dataLen);
+	Packet.Data = view.GetData();
+	Packet.DataLen = view.GetRemaining();
 
-	return reply;
-}
\ No newline at end of file
+	return true;
+}
@@ -2,67 +2,360 @@
 #define CLIENT_SOCKET_H
 
 #include "ProxyStructures.h"
+#include "DnsResolver.h"
+#include "Socks5Parser.h"
+#include "UDPReassembly.h"
+#include "ConnectionTask.h"
+#include "EventLoop.h"
+#include "RelayRingBuffer.h"
+#include "PlatformSocket.h"
 
-#include <WinSock2.h>
-#include <WS2tcpip.h>
 #include <vector>
+#include <deque>
 #include <string>
+#include <memory>
+#include <chrono>
+#include <cstdint>
+#include <atomic>
 
-class ProxyContext
+#ifdef __linux__
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+class EventLoop;
+
+// A datagram ready to leave the relay socket, header and payload are sent with one gather write.
+struct UDPRelayDatagram
+{
+	char Header[UDP_HEADER_MAX_SIZE];
+	int HeaderLen{0};
+
+	// Points into the received datagram
+	const char* Data{nullptr};
+	int DataLen{0};
+
+	SOCKADDR_STORAGE Addr;
+};
+
+// A client datagram addressed by a domain name which isn't resolved yet
+struct PendingUDPDatagram
+{
+	std::string HostName;
+	char Port[2];
+
+	std::vector<char> Data;
+};
+
+#ifdef __linux__
+// Per thread storage of one recvmmsg and sendmmsg round, @see ProxyContext::TransportUDPBatch
+struct UDPBatchBuffers
+{
+	int BatchSize{0};
+
+	std::vector<char> Storage;
+	std::vector<char> Controls;
+	std::vector<mmsghdr> RecvMessages;
+	std::vector<iovec> RecvVectors;
+	std::vector<SOCKADDR_STORAGE> RecvAddrs;
+
+	std::vector<UDPRelayDatagram> SendDatagrams;
+	std::vector<mmsghdr> SendMessages;
+	std::vector<iovec> SendVectors;
+};
+#endif
+
+class ProxyContext : public std::enable_shared_from_this<ProxyContext>
 {
 public:
 	ProxyContext(SOCKET InClient, EConnectionState InState = EConnectionState::WaitHandShake);
 	virtual ~ProxyContext();
 
+	/**
+	* Contexts come from the per thread pool of the calling loop, @see PoolAllocator
+	* @param InConnectionId	Taken at accept by NewConnectionId, every log line of the connection carries it.
+	*/
+	static std::shared_ptr<ProxyContext> Create(SOCKET InClient, unsigned long long InConnectionId);
+
+	// Unique in the process, the accepting thread takes it so the accept log line carries it too.
+	static unsigned long long NewConnectionId();
+
+	virtual inline unsigned long long GetConnectionId() const { return ConnectionId; }
+
 	bool operator==(const ProxyContext& Other) const;
 
 	virtual inline EConnectionState GetConnectionState() const;
 
+	virtual bool IsClosing() const;
+
+	virtual bool AttachLoop(EventLoop* InLoop);
+
+	virtual void DetachLoop();
+
+	virtual inline bool IsAttached() const { return Loop != nullptr; }
+
+	// Resume the lifecycle with an event of one of the sockets, @see RunConnection
+	virtual void HandleEvent(SOCKET Socket, EOperationType Operation);
+
+	virtual void HandleTimer(ETimerType Type);
+
+	// Read the client until its greeting and request are complete, @see Socks5Parser
+	virtual void ProcessHandshakeData();
+
 	virtual void ProcessWaitHandshake();
 
 	virtual void ProcessWaitLicense();
 
 	virtual bool ProcessConnectCmd();
 
+	/**
+	* Resolve the requested domain name without blocking the loop.
+	* The command is processed again once the addresses are known, @see OnDestinationResolved
+	*/
+	virtual void ResolveDestination();
+
+	virtual void OnDestinationResolved(const ResolveResult& Result);
+
+	virtual void ProcessConnecting(SOCKET Socket);
+
 	virtual bool ProcessUDPCmd();
 
 	virtual bool SendHandshakeResponse(EConnectionProtocol Response);
 
 	virtual bool SendLicenseResponse(ETravelResponse Response, bool bTCP = true);
 
-	virtual void ProcessForwardData();
+	virtual void ProcessForwardData(SOCKET Socket, EOperationType Operation);
+
+	/**
+	* The loop stopped relaying from a socket on its own, @see EventLoop::StartRelay
+	* @param ErrorCode	0 when the source closed.
+	*/
+	virtual void OnRelayStopped(SOCKET Source, int ErrorCode);
+
+	// Traffic was relayed, pushes back the idle timeout.
+	virtual inline void MarkActive() { LastActive = std::chrono::steady_clock::now(); }
+
+	// Count bytes relayed by the loop, @see EventLoop::StartRelay
+	virtual inline void AddRelayedBytes(bool bFromClient, unsigned long long Bytes) { RelayDirections[bFromClient ? 0 : 1].RelayedBytes += Bytes; }
+
+	/**
+	* A datagram of this association received by the shared relay of the loop, @see SharedUDPRelay
+	* @return false to drop it, otherwise the datagram to send.
+	*/
+	virtual bool HandleRelayDatagram(const char* Data, int Len, const SOCKADDR_STORAGE& Source, bool bFromClient, UDPRelayDatagram& Datagram);
 
 protected:
 
-	virtual bool TransportTraffic();
+	/**
+	* Handshake, request, resolve, connect and relay of the connection as one coroutine.
+	* It suspends on every event of its sockets and on name resolution, so waiting costs no thread.
+	* Timers still run on their own, @see HandleTimer
+	*/
+	virtual ConnectionTask RunConnection();
+
+	virtual ResumeAwaiter<SocketEvent> NextEvent();
+
+	virtual void ResumeResolved(const ResolveResult& Result);
+
+	/**
+	* Start a non-blocking connect to the next destination address.
+	* Addresses are raced RFC 8305 style, a new attempt starts when the previous one fails
+	* or hasn't finished after the attempt delay, the first connected one wins.
+	*/
+	virtual void StartConnectAttempt();
+
+	virtual void FinishConnect(SOCKET Connected);
 
+	virtual void FailConnect(ETravelResponse Response);
+
+	// Queue the payload a client pipelined behind its request for the destination.
+	virtual bool FlushPendingPayload();
+
+	virtual void CloseConnectAttempts();
+
+	virtual ETravelResponse GetConnectFailureResponse(int ErrorCode);
+
+	/**
+	* Receive what the source has into the queue of its direction and flush it to the target.
+	* What the target doesn't take stays queued until it's writable again, @see FlushTraffic
+	* @return false when the connection has to close.
+	*/
 	virtual bool TransportTraffic(SOCKET Source, SOCKET Target);
 
+	// Send the queue of a direction until it's empty or the target would block.
+	virtual bool FlushTraffic(int DirectionIndex);
+
+	virtual int GetQueuedBytes(int DirectionIndex) const;
+
+	/**
+	* Pause reading a source whose queue reached the high watermark, resume it below the low one,
+	* and watch a target for writability while its queue isn't empty.
+	*/
+	virtual bool UpdateRelayInterest();
+
+	// Reading a paused source was reported, only an error of it is of interest.
+	virtual bool CheckPausedSource(SOCKET Source);
+
+#ifdef __linux__
+	/**
+	* Move bytes from source to target inside the kernel through a pipe,
+	* without copying them into user space, the pipe is the queue of the direction.
+	* Falls back to copy relay when splice isn't supported by the sockets.
+	*/
+	virtual bool SpliceTraffic(SOCKET Source, SOCKET Target);
+
+	virtual bool FlushPipe(int DirectionIndex);
+#endif
+
+	/**
+	* Relay a batch of datagrams of the association, both directions share the relay socket.
+	* Client datagrams are unwrapped and sent to their destination,
+	* any other datagram is wrapped with a header of its source and sent to the client.
+	*/
 	virtual bool TransportUDPTraffic();
 
-	virtual std::string GetCurrentThreadId();
+#ifdef __linux__
+	/**
+	* Receive a batch of datagrams with one recvmmsg and send the relayed ones with one sendmmsg.
+	* Datagrams coalesced by UDP GRO are split by their segment size.
+	*/
+	virtual bool TransportUDPBatch();
+
+	virtual void FlushUDPBatch(UDPBatchBuffers& Buffers, int SendNum);
+
+	static UDPBatchBuffers& GetUDPBatchBuffers(int BatchSize);
+#endif
+
+	// Decide where a received datagram goes and what it's wrapped with, false to drop it.
+	virtual bool PrepareDatagram(const char* Data, int Len, const SOCKADDR_STORAGE& Source, UDPRelayDatagram& Datagram);
+
+	virtual bool IsUDPClientAddress(const SOCKADDR_STORAGE& Source);
+
+	virtual bool PrepareClientDatagram(const char* Data, int Len, UDPRelayDatagram& Datagram);
+
+	// Queue a fragment, true when it completed its sequence and the packet is now the whole datagram.
+	virtual bool ReassembleUDPPacket(UDPTravelReply& Packet);
+
+	virtual bool PrepareRemoteDatagram(const char* Data, int Len, const SOCKADDR_STORAGE& Source, UDPRelayDatagram& Datagram);
+
+	virtual bool SendDatagram(const UDPRelayDatagram& Datagram);
 
 	virtual std::string GetTravelResponseName(ETravelResponse Response);
 
+	/**
+	* Write an address in SOCKS5 form, address type, address and port.
+	* @return Written bytes, at most 19.
+	*/
+	virtual int WriteReplyAddress(char* Buffer, const SOCKADDR_STORAGE& Addr);
+
 	virtual bool ParseTCPPayloadAddress();
 
 	virtual bool ParseUDPPayloadAddress();
 
-	virtual UDPTravelReply ParseUDPPacket(const char* buffer, int Len);
+	// Create the socket of an association which doesn't use the shared relay.
+	virtual bool OpenUDPRelaySocket(int Family);
+
+	// The packet views the datagram in place, it's only valid as long as the buffer.
+	virtual bool ParseUDPPacket(const char* Buffer, int Len, UDPTravelReply& Packet);
+
+	// Destination of a client datagram, IPv4, IPv6 or a cached domain name.
+	virtual bool ParseUDPDestination(const UDPTravelReply& Packet, SOCKADDR_STORAGE& Addr);
+
+	// Keep a datagram until its domain name resolves, the lookup starts with the first one of a name.
+	virtual void QueueUDPDatagram(const UDPTravelReply& Packet);
+
+	// Send or drop the queued datagrams of a resolved domain name.
+	virtual void FlushUDPDatagrams(const std::string& HostName, const ResolveResult& Result);
+
+	/**
+	* First resolved address the udp relay socket can send to, with the port of the datagram.
+	* @return false when no address fits UDPSocketFamily.
+	*/
+	virtual bool SelectUDPAddress(const ResolveResult& Result, const char Port[2], SOCKADDR_STORAGE& Addr);
 
 protected:
+	static std::atomic<unsigned long long> NextConnectionId;
+
+	unsigned long long ConnectionId;
+
 	SOCKET	Client;
 	SOCKET	UDPClient;
 	SOCKET	Destination;
 
-	SOCKADDR_IN UDPClientAddr;
-	SOCKADDR_IN DestAddr;
+	// Client side of the association, port 0 until its first datagram
+	SOCKADDR_STORAGE UDPClientAddr;
+
+	// Relay address sent to the client
+	SOCKADDR_STORAGE UDPBoundAddr;
+
+	int UDPSocketFamily;
+
+	// The association is served by the shared relay of the loop, UDPClient stays invalid.
+	bool bUDPShared;
+
+	uint64_t UDPIdleTimer;
+	std::chrono::steady_clock::time_point UDPLastActive;
+
+	UDPReassembly UDPFragments;
+	uint64_t UDPReassemblyTimer;
+
+	std::deque<PendingUDPDatagram> UDPPendingDatagrams;
+	int UDPPendingBytes;
+
+	// Addresses of the requested domain name, without port
+	std::vector<SOCKADDR_STORAGE> ResolvedAddrs;
+
+	// Resolved destination addresses in connect order
+	std::vector<SOCKADDR_STORAGE> ConnectCandidates;
+	size_t NextCandidate;
+
+	// Connects in flight, the first finished one becomes Destination
+	std::vector<SOCKET> ConnectAttempts;
+	int LastConnectError;
+
+	uint64_t ConnectTimeoutTimer;
+	uint64_t ConnectAttemptTimer;
+
+	uint64_t HandshakeTimer;
+
+	uint64_t IdleTimer;
+	std::chrono::steady_clock::time_point LastActive;
 
 	unsigned short UDPPort;
 
 	TravelPayload LicensePayload;
 
+	Socks5Parser HandshakeParser;
+
+	// Bytes after the request which arrived before the destination was connected
+	std::vector<char> PendingPayload;
+
 	EConnectionState State;
+
+	EventLoop* Loop;
+
+	ConnectionTask Lifecycle;
+
+	// What the lifecycle is resumed with
+	SocketEvent WakeEvent;
+	ResolveResult WakeResolved;
+
+	// Start times of the phases measured by Metrics
+	std::chrono::steady_clock::time_point AcceptTime;
+	std::chrono::steady_clock::time_point ResolveStartTime;
+	std::chrono::steady_clock::time_point ConnectStartTime;
+
+	// [0] client to destination, [1] destination to client.
+	RelayDirectionState RelayDirections[2];
+
+	// Bytes of each direction waiting for a slow target, same order as RelayDirections.
+	RelayRingBuffer RelayQueues[2];
+
+#ifdef __linux__
+	// One pipe per direction, same order as RelayDirections.
+	int SplicePipes[2][2];
+	bool bSpliceSupported;
+#endif
 };
 
 #endif // !CLIENT_SOCKET_H
@@ -1,35 +1,71 @@
 #include "ProxyServer.h"
 #include "EasyLog.h"
+#include "RelayBufferPool.h"
+#include "MemoryPool.h"
+#include "DnsResolver.h"
+#include "Metrics.h"
 
-#include <WinSock2.h>
-#include <WS2tcpip.h>
+#include <algorithm>
+#include <future>
 
 std::once_flag ProxyServer::InstanceOnceFlag;
 std::shared_ptr<ProxyServer> ProxyServer::Instance;
-std::mutex ProxyServer::ContextListLock;
 bool ProxyServer::bStopService = false;
 
 ProxyServer::ProxyServer()
 	: ServerIP("localhost")
 	, ServerPort(1080)
+	, WorkerNum(0)
+	, bReusePort(false)
 	, Listener(INVALID_SOCKET)
+#ifdef __linux__
+	, IOBackend(EIOBackend::Epoll)
+#else
+	, IOBackend(EIOBackend::Poll)
+#endif
+	, HandshakeTimeoutMsec(HANDSHAKE_TIMEOUT_MSEC)
+	, ConnectTimeoutMsec(CONNECT_TIMEOUT_MSEC)
+	, ConnectAttemptDelayMsec(CONNECT_ATTEMPT_DELAY_MSEC)
+	, IdleTimeoutMsec(IDLE_TIMEOUT_MSEC)
+	, RelayHighWatermark(RELAY_HIGH_WATERMARK)
+	, RelayLowWatermark(RELAY_LOW_WATERMARK)
+	, UDPBatchSize(UDP_BATCH_SIZE)
+	, bUDPGro(false)
+	, bUDPSharedRelay(false)
+	, UDPRelaySocketNum(UDP_RELAY_SOCKET_NUM)
+	, UDPIdleTimeoutMsec(UDP_IDLE_TIMEOUT_MSEC)
+	, MetricsIP("127.0.0.1")
+	, MetricsPort(0)
 	, SSLContext(nullptr)
+	, NextLoopIndex(0)
 {
-	InitSSLContext();
+	LoadConfig();
 
-	InitWorkerThread();
+	InitSSLContext();
 }
 
 ProxyServer::~ProxyServer()
 {
 	bStopService = true;
+
+	for (const std::shared_ptr<EventLoop>& loop : EventLoops)
+	{
+		loop->Stop();
+	}
 	
 	if (Listener != INVALID_SOCKET) {
-		closesocket(Listener);
+		MiscHelper::CloseSocket(Listener);
+	}
+
+	for (SOCKET listener : ShardListeners)
+	{
+		MiscHelper::CloseSocket(listener);
 	}
 
+	LOG(Log, "%s", MemoryPool::GetStatsString().c_str());
+
 	SSL_CTX_free(SSLContext);
-	WSACleanup();
+	MiscHelper::CleanupSockets();
 }
 
 std::shared_ptr<ProxyServer> ProxyServer::Get()
@@ -70,75 +106,346 @@ SSL_CTX* ProxyServer::GetSSLContext()
 
 bool ProxyServer::RunServer()
 {	
-	if (Listener != INVALID_SOCKET) {
+	if (Listener != INVALID_SOCKET || !ShardListeners.empty()) {
 		LOG(Error, "Don't init a server twice.");
 		return false;
 	}
 
 	LOG(Log, "Initing server...");
 
-	WSADATA wsaData;
-	if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
-		LOG(Error, "Startup WSA failed.");
-		return false;
-	}
-
-	if (LOBYTE(wsaData.wVersion) != 2 || HIBYTE(wsaData.wVersion) != 2) {
-		LOG(Error, "Incorrect socket library version.");
+	if (!MiscHelper::StartupSockets()) {
 		return false;
 	}
 
-	SOCKADDR_IN addr;
-	std::memset(&addr, 0, sizeof(addr));
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(ServerPort);
-	InetPtonA(AF_INET, ServerIP.c_str(), &addr.sin_addr);
+	// Event loops own sockets, so they can only be created after the socket library is ready.
+	InitWorkerThread();
 
-	Listener = socket(AF_INET, SOCK_STREAM, 0);
-	if (Listener == INVALID_SOCKET) {
-		LOG(Error, "Create a new listener socket failed, code: %d", WSAGetLastError());
-		return false;
+	if (MetricsPort > 0) {
+		MetricsServer::Get()->Start(MetricsIP, MetricsPort);
 	}
 
-	if (bind(Listener, (SOCKADDR*)&addr, sizeof(addr)) == SOCKET_ERROR) {
-		LOG(Error, "Bind listener to %s:%d failed, code: %d", ServerIP.c_str(), ServerPort, WSAGetLastError());
-		return false;
+	if (bReusePort) {
+#ifdef SO_REUSEPORT
+		return RunShardedListeners();
+#else
+		LOG(Warning, "SO_REUSEPORT is not supported on this platform, fall back to single listener.");
+#endif
 	}
 
-	if (listen(Listener, 0) == SOCKET_ERROR) {
-		LOG(Error, "Make listener start listen failed, code: %d", WSAGetLastError());
+	Listener = CreateListener(false);
+	if (Listener == INVALID_SOCKET) {
 		return false;
 	}
 
 	LOG(Log, "Server start listen at [%s:%d]", ServerIP.c_str(), ServerPort);
 
-	while (true)
+	AcceptConnections();
+
+	MiscHelper::CloseSocket(Listener);
+	Listener = INVALID_SOCKET;
+	return true;
+}
+
+void ProxyServer::AcceptConnections()
+{
+	int retryDelay(0);
+
+	// The wait wakes up regularly, so a stop is noticed without a connection coming in.
+	while (WaitAcceptRetry(0))
 	{
-		SOCKADDR_IN acceptedAddr;
+		int readyState = MiscHelper::WaitReadable(Listener, ACCEPT_WAIT_MSEC);
+		if (readyState == 0) {
+			continue;
+		}
+
+		SOCKET acceptedSock = INVALID_SOCKET;
+		SOCKADDR_STORAGE acceptedAddr;
 		std::memset(&acceptedAddr, 0, sizeof(acceptedAddr));
-		int addrLen = sizeof(acceptedAddr);
-	
-		SOCKET acceptedSock = accept(Listener, (SOCKADDR*)&acceptedAddr, &addrLen);
+		if (readyState > 0) {
+			socklen_t addrLen = static_cast<socklen_t>(sizeof(acceptedAddr));
+			acceptedSock = accept(Listener, (SOCKADDR*)&acceptedAddr, &addrLen);
+		}
 
 		if (acceptedSock == INVALID_SOCKET) {
-			LOG(Error, "Incoming a new connection, but can't accept, code: %d", WSAGetLastError());
+			int errorCode = MiscHelper::GetLastSocketError();
+			if (MiscHelper::IsWouldBlock(errorCode)) {
+				continue;
+			}
+
+			// Running out of descriptors doesn't clear up at once, retrying right away would spin the thread.
+			retryDelay = std::min(retryDelay > 0 ? retryDelay * 2 : ACCEPT_RETRY_MSEC, ACCEPT_RETRY_MAX_MSEC);
+			LOG(Error, "Incoming a new connection, but can't accept, code: %d, retry in %d ms.", errorCode, retryDelay);
+			if (!WaitAcceptRetry(retryDelay)) {
+				break;
+			}
 			continue;
 		}
-		
-		char addrBuffer[16] = { 0 };
-		InetNtopA(AF_INET, (SOCKADDR*)&acceptedAddr.sin_addr, addrBuffer, 16);
-		LOG(Log, "Accept a new connection from %s:%d.", addrBuffer, acceptedAddr.sin_port);
 
-		std::shared_ptr<ProxyContext> context(std::make_shared<ProxyContext>(acceptedSock));
+		retryDelay = 0;
+
+		unsigned long long connectionId = ProxyContext::NewConnectionId();
+		LOG(Log, "[Connection: %llu]Accept a new connection from %s.", connectionId, MiscHelper::AddressToString(acceptedAddr).c_str());
+
+		EventLoops[NextLoopIndex]->PostConnection(acceptedSock, connectionId);
+		NextLoopIndex = (NextLoopIndex + 1) % EventLoops.size();
+	}
+}
 
-		std::lock_guard<std::mutex> contextListScope(ContextListLock);
-		ContextList.push(context);
+bool ProxyServer::WaitAcceptRetry(int DelayMsec)
+{
+	std::unique_lock<std::mutex> stopScope(StopLock);
+	return !StopCondition.wait_for(stopScope, std::chrono::milliseconds(DelayMsec),
+	[]()
+	{
+		return bStopService;
+	});
+}
 
+void ProxyServer::StopServer()
+{
+	{
+		std::lock_guard<std::mutex> stopScope(StopLock);
+		bStopService = true;
 	}
 
+	StopCondition.notify_all();
+}
+
+void ProxyServer::LoadConfig()
+{
+	Json config = MiscHelper::LoadConfig();
+	if (!config.is_object()) {
+		return;
+	}
+
+	ELogLevel logLevel(ELogLevel::Display);
+	std::string logLevelName = config.value("LogLevel", std::string("Display"));
+	if (IEasyLog::ParseLevel(logLevelName, logLevel)) {
+		IEasyLog::SetMinLevel(logLevel);
+	}
+	else {
+		LOG(Warning, "Unknown log level %s, every level is logged.", logLevelName.c_str());
+	}
+
+	if (config.value("LogFormat", std::string("Text")) == "Binary") {
+		IEasyLog::Get()->SetBinaryMode(true, config.value("LogSegmentSize", static_cast<size_t>(BINARY_LOG_SEGMENT_SIZE)));
+	}
+
+	EasyLog::LogFileSettings fileSettings;
+	fileSettings.MaxFileSize = config.value("LogMaxFileSize", fileSettings.MaxFileSize);
+	fileSettings.RotateIntervalSec = config.value("LogRotateInterval", fileSettings.RotateIntervalSec);
+	fileSettings.MaxFiles = config.value("LogMaxFiles", fileSettings.MaxFiles);
+	fileSettings.WriteBufferSize = config.value("LogWriteBuffer", fileSettings.WriteBufferSize);
+	fileSettings.FlushIntervalMsec = config.value("LogFlushInterval", fileSettings.FlushIntervalMsec);
+	fileSettings.CompressCommand = config.value("LogCompressCommand", fileSettings.CompressCommand);
+	IEasyLog::Get()->SetFileSettings(fileSettings);
+
+	ServerIP = config.value("ServerIP", ServerIP);
+	ServerPort = config.value("ServerPort", ServerPort);
+	WorkerNum = config.value("WorkerNum", WorkerNum);
+	bReusePort = config.value("ReusePort", bReusePort);
+
+	std::string ioBackendName = config.value("IOBackend", std::string(""));
+	if (ioBackendName == "Select") {
+		IOBackend = EIOBackend::Select;
+	}
+	else if (ioBackendName == "Poll") {
+		IOBackend = EIOBackend::Poll;
+	}
+	else if (ioBackendName == "Epoll") {
+		IOBackend = EIOBackend::Epoll;
+	}
+	else if (ioBackendName == "IoUring") {
+		IOBackend = EIOBackend::IoUring;
+	}
+	else if (!ioBackendName.empty()) {
+		LOG(Warning, "Unknown IO backend %s, use the default one.", ioBackendName.c_str());
+	}
+
+	HandshakeTimeoutMsec = std::max(config.value("HandshakeTimeout", HandshakeTimeoutMsec), 0);
+	ConnectTimeoutMsec = std::max(config.value("ConnectTimeout", ConnectTimeoutMsec), 0);
+	ConnectAttemptDelayMsec = std::max(config.value("ConnectAttemptDelay", ConnectAttemptDelayMsec), 0);
+	IdleTimeoutMsec = std::max(config.value("IdleTimeout", IdleTimeoutMsec), 0);
+	UDPBatchSize = std::min(std::max(config.value("UDPBatchSize", UDPBatchSize), 1), UDP_RELAY_MAX_BATCH);
+	bUDPGro = config.value("UDPGro", bUDPGro);
+	bUDPSharedRelay = config.value("UDPSharedRelay", bUDPSharedRelay);
+	UDPRelaySocketNum = std::min(std::max(config.value("UDPRelaySocketNum", UDPRelaySocketNum), 1), 255);
+	UDPIdleTimeoutMsec = std::max(config.value("UDPIdleTimeout", UDPIdleTimeoutMsec), 0);
+	MetricsIP = config.value("MetricsIP", MetricsIP);
+	MetricsPort = config.value("MetricsPort", MetricsPort);
+
+	std::shared_ptr<RelayBufferPool> pool = RelayBufferPool::Get();
+	pool->Configure(
+		config.value("RelayBufferMinSize", pool->GetMinSize()),
+		config.value("RelayBufferMaxSize", pool->GetMaxSize()),
+		config.value("RelayBufferCacheNum", RELAY_BUFFER_MAX_CACHED));
+
+	RelayHighWatermark = std::max(config.value("RelayHighWatermark", RelayHighWatermark), 1);
+	RelayLowWatermark = std::min(std::max(config.value("RelayLowWatermark", RelayLowWatermark), 0), RelayHighWatermark);
+
+	DnsResolver::Get()->Configure(
+		config.value("DnsThreadNum", DNS_THREAD_NUM),
+		config.value("DnsServer", std::string()),
+		config.value("DnsTimeout", DNS_TIMEOUT_MSEC),
+		config.value("DnsCacheTTL", DNS_DEFAULT_TTL_SEC),
+		config.value("DnsNegativeTTL", DNS_NEGATIVE_TTL_SEC),
+		config.value("DnsCacheSize", DNS_CACHE_MAX_ENTRIES));
+}
+
+SOCKET ProxyServer::CreateListener(bool bShared)
+{
+	SOCKADDR_STORAGE addr;
+	bool bWildcard = !MiscHelper::ParseAddress(ServerIP, static_cast<unsigned short>(ServerPort), addr);
+	if (bWildcard) {
+		// Not an address literal, listen on every address of both families.
+		SOCKADDR_IN6* addrIn6 = (SOCKADDR_IN6*)&addr;
+		addrIn6->sin6_family = AF_INET6;
+		addrIn6->sin6_port = htons(static_cast<unsigned short>(ServerPort));
+	}
+
+	SOCKET listener = socket(addr.ss_family, SOCK_STREAM, 0);
+	if (listener == INVALID_SOCKET && bWildcard) {
+		LOG(Warning, "IPv6 is not available, listen on IPv4 addresses only.");
+
+		std::memset(&addr, 0, sizeof(addr));
+		SOCKADDR_IN* addrIn = (SOCKADDR_IN*)&addr;
+		addrIn->sin_family = AF_INET;
+		addrIn->sin_port = htons(static_cast<unsigned short>(ServerPort));
+
+		listener = socket(AF_INET, SOCK_STREAM, 0);
+	}
+
+	if (listener == INVALID_SOCKET) {
+		LOG(Error, "Create a new listener socket failed, code: %d", MiscHelper::GetLastSocketError());
+		return INVALID_SOCKET;
+	}
+
+	if (addr.ss_family == AF_INET6) {
+		// Dual-stack, IPv4 clients arrive as ::ffff:a.b.c.d
+		int v6Only = 0;
+		if (setsockopt(listener, IPPROTO_IPV6, IPV6_V6ONLY, (const char*)&v6Only, sizeof(v6Only)) == SOCKET_ERROR) {
+			LOG(Warning, "Disable IPV6_V6ONLY on listener failed, code: %d, only IPv6 clients can connect.", MiscHelper::GetLastSocketError());
+		}
+	}
+
+#ifdef SO_REUSEPORT
+	if (bShared) {
+		int enable = 1;
+		if (setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, (const char*)&enable, sizeof(enable)) == SOCKET_ERROR) {
+			LOG(Error, "Enable SO_REUSEPORT on listener failed, code: %d", MiscHelper::GetLastSocketError());
+			MiscHelper::CloseSocket(listener);
+			return INVALID_SOCKET;
+		}
+	}
+#endif
+
+	if (bind(listener, (SOCKADDR*)&addr, MiscHelper::GetAddressLength(addr)) == SOCKET_ERROR) {
+		LOG(Error, "Bind listener to %s:%d failed, code: %d", ServerIP.c_str(), ServerPort, MiscHelper::GetLastSocketError());
+		MiscHelper::CloseSocket(listener);
+		return INVALID_SOCKET;
+	}
+
+	if (listen(listener, bShared ? SOMAXCONN : 0) == SOCKET_ERROR) {
+		LOG(Error, "Make listener start listen failed, code: %d", MiscHelper::GetLastSocketError());
+		MiscHelper::CloseSocket(listener);
+		return INVALID_SOCKET;
+	}
+
+	return listener;
+}
+
+bool ProxyServer::RunShardedListeners()
+{
+	for (size_t index = 0; index < EventLoops.size(); index++)
+	{
+		SOCKET listener = CreateListener(true);
+		if (listener == INVALID_SOCKET) {
+			CloseShardListeners();
+			return false;
+		}
+
+		ShardListeners.push_back(listener);
+
+		if (!MiscHelper::SetNonBlocking(listener)) {
+			LOG(Error, "Make listener non-blocking failed, code: %d", MiscHelper::GetLastSocketError());
+			CloseShardListeners();
+			return false;
+		}
+	}
+
+	// A listener left in the group without a loop accepting on it would hang its share of connections.
+	std::vector<std::future<bool>> watchResults;
+	for (size_t index = 0; index < ShardListeners.size(); index++)
+	{
+		std::shared_ptr<std::promise<bool>> watched = std::make_shared<std::promise<bool>>();
+		watchResults.push_back(watched->get_future());
+
+		std::shared_ptr<EventLoop> loop = EventLoops[index];
+		SOCKET listener = ShardListeners[index];
+		loop->PostTask(
+		[loop, listener, watched]()
+		{
+			watched->set_value(loop->WatchListener(listener));
+		});
+	}
+
+	bool bWatched(true);
+	for (std::future<bool>& result : watchResults)
+	{
+		bWatched = result.get() && bWatched;
+	}
+
+	if (!bWatched) {
+		LOG(Error, "Event loop can't watch listener socket.");
+		CloseShardListeners();
+		return false;
+	}
+
+	LOG(Log, "Server start listen at [%s:%d] with %d sharded listeners.", ServerIP.c_str(), ServerPort, static_cast<int>(ShardListeners.size()));
+
+	// The loops accept on their own, this thread only waits to be stopped.
+	std::unique_lock<std::mutex> stopScope(StopLock);
+	StopCondition.wait(stopScope,
+	[]()
+	{
+		return bStopService;
+	});
+
+	CloseShardListeners();
 	return true;
 }
 
+void ProxyServer::CloseShardListeners()
+{
+	std::vector<std::future<void>> unwatchResults;
+	for (size_t index = 0; index < ShardListeners.size(); index++)
+	{
+		std::shared_ptr<std::promise<void>> unwatched = std::make_shared<std::promise<void>>();
+		unwatchResults.push_back(unwatched->get_future());
+
+		std::shared_ptr<EventLoop> loop = EventLoops[index];
+		SOCKET listener = ShardListeners[index];
+		loop->PostTask(
+		[loop, listener, unwatched]()
+		{
+			loop->UnwatchListener(listener);
+			unwatched->set_value();
+		});
+	}
+
+	for (std::future<void>& result : unwatchResults)
+	{
+		result.wait();
+	}
+
+	for (SOCKET listener : ShardListeners)
+	{
+		MiscHelper::CloseSocket(listener);
+	}
+
+	ShardListeners.clear();
+}
+
 void ProxyServer::InitSSLContext()
 {
 	SSL_library_init();
@@ -154,64 +461,20 @@ void ProxyServer::InitSSLContext()
 
 void ProxyServer::InitWorkerThread()
 {
-	int workerNum = std::thread::hardware_concurrency() * 2;
-	LOG(Log, "Will create %d threads for this machine.", workerNum);
+	int workerNum = WorkerNum > 0 ? WorkerNum : std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+	LOG(Log, "Will create %d event loops for this machine.", workerNum);
 
 	for (int index = 0; index < workerNum; index++)
+	{
+		EventLoops.push_back(std::make_shared<EventLoop>());
+	}
+
+	for (const std::shared_ptr<EventLoop>& loop : EventLoops)
 	{
 		WorkerThreads.push_back(std::thread(
-		[&]()
+		[loop]()
 		{
-			while (!bStopService)
-			{
-				bool bEmptyQueue = false;
-				std::shared_ptr<ProxyContext> context;
-				{
-					std::lock_guard<std::mutex> contextListScope(ContextListLock);
-					bEmptyQueue = ContextList.empty();
-					if (!bEmptyQueue) {
-						context = ContextList.front();
-						ContextList.pop();
-					}
-				}
-
-				if (bEmptyQueue) {
-					std::this_thread::sleep_for(std::chrono::milliseconds(20));
-					continue;
-				}
-
-				bool bRequestClose = false;
-
-				EConnectionState state = context->GetConnectionState();
-				switch (state)
-				{
-				case EConnectionState::WaitHandShake:
-					context->ProcessWaitHandshake();
-					break;
-
-				case EConnectionState::WaitLicense:
-					context->ProcessWaitLicense();
-					break;
-
-				case EConnectionState::Connected:
-				case EConnectionState::UDPAssociate:
-					context->ProcessForwardData();
-					break;
-
-				default:
-					bRequestClose = true;
-					break;
-				}
-
-				if (bRequestClose) {
-					continue;
-				}
-
-				std::this_thread::sleep_for(std::chrono::milliseconds(1));
-
-				std::lock_guard<std::mutex> contextListScope(ContextListLock);
-				ContextList.push(context);
-			}
+			loop->Run();
 		}));
 
 		WorkerThreads.back().detach();
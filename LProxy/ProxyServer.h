@@ -1,15 +1,16 @@
 #ifndef PROXY_SERVER_H
 #define PROXY_SERVER_H
 #include "ProxyContext.h"
+#include "EventLoop.h"
 
 #include "openssl/ssl.h"
 #include "openssl/err.h"
 
 #include <mutex>
+#include <condition_variable>
 #include <string>
 #include <vector>
 #include <thread>
-#include <queue>
 
 class ProxyServer
 {
@@ -28,28 +29,114 @@ public:
 
 	virtual inline SSL_CTX* GetSSLContext();
 
+	virtual inline int GetHandshakeTimeout() const { return HandshakeTimeoutMsec; }
+
+	virtual inline int GetConnectTimeout() const { return ConnectTimeoutMsec; }
+
+	// 0 keeps idle connections until one side closes.
+	virtual inline int GetIdleTimeout() const { return IdleTimeoutMsec; }
+
+	virtual inline int GetConnectAttemptDelay() const { return ConnectAttemptDelayMsec; }
+
+	virtual inline int GetRelayHighWatermark() const { return RelayHighWatermark; }
+
+	virtual inline int GetRelayLowWatermark() const { return RelayLowWatermark; }
+
+	// Datagrams per recvmmsg and sendmmsg of a UDP association, 1 receives them one by one.
+	virtual inline int GetUDPBatchSize() const { return UDPBatchSize; }
+
+	virtual inline bool IsUDPGroEnabled() const { return bUDPGro; }
+
+	// Serve UDP associations from the relay sockets of their loop instead of one socket each, @see SharedUDPRelay
+	virtual inline bool IsUDPSharedRelay() const { return bUDPSharedRelay; }
+
+	virtual inline int GetUDPRelaySocketNum() const { return UDPRelaySocketNum; }
+
+	// 0 keeps idle associations until their control connection closes.
+	virtual inline int GetUDPIdleTimeout() const { return UDPIdleTimeoutMsec; }
+
+	virtual inline EIOBackend GetIOBackend() const { return IOBackend; }
+
+	/**
+	* Listen and serve until StopServer is called.
+	* @return false when the server can't start.
+	*/
 	virtual bool RunServer();
 
+	// Let RunServer return, can be called from any thread.
+	virtual void StopServer();
+
 protected:
 	virtual void InitSSLContext();
 
+	virtual void LoadConfig();
+
 	virtual void InitWorkerThread();
 
+	virtual SOCKET CreateListener(bool bReusePort);
+
+	virtual bool RunShardedListeners();
+
+	// Make each loop stop accepting on its shard listener, then close them all.
+	virtual void CloseShardListeners();
+
+	// Accept on the single listener in this thread and hand connections to the loops in turn.
+	virtual void AcceptConnections();
+
+	/**
+	* Sleep after a failed accept, returns early when the server is stopped.
+	* @return false when the server is stopped.
+	*/
+	virtual bool WaitAcceptRetry(int DelayMsec);
+
 protected:
 	static std::once_flag InstanceOnceFlag;
 	static std::shared_ptr<ProxyServer> Instance;
 
 	std::string ServerIP;
 	int ServerPort;
+	int WorkerNum;
+
+	/**
+	* Bind one SO_REUSEPORT listener per event loop,
+	* the kernel spreads connections over them and each loop accepts its own.
+	* Only supported on Linux, falls back to the single accept thread elsewhere.
+	*/
+	bool bReusePort;
 
 	SOCKET Listener;
+	std::vector<SOCKET> ShardListeners;
+
+	EIOBackend IOBackend;
+
+	int HandshakeTimeoutMsec;
+	int ConnectTimeoutMsec;
+	int ConnectAttemptDelayMsec;
+	int IdleTimeoutMsec;
+
+	int RelayHighWatermark;
+	int RelayLowWatermark;
+
+	int UDPBatchSize;
+	bool bUDPGro;
+
+	bool bUDPSharedRelay;
+	int UDPRelaySocketNum;
+	int UDPIdleTimeoutMsec;
+
+	// Address of the metrics endpoint, port 0 leaves it off, @see MetricsServer
+	std::string MetricsIP;
+	int MetricsPort;
 
 	SSL_CTX* SSLContext;
 
 	std::vector<std::thread> WorkerThreads;
-	std::queue<std::shared_ptr<ProxyContext>> ContextList;
-	static std::mutex ContextListLock;
+	std::vector<std::shared_ptr<EventLoop>> EventLoops;
+	size_t NextLoopIndex;
 	static bool bStopService;
+
+	std::mutex StopLock;
+	std::condition_variable StopCondition;
 };
 
 #endif // !PROXY_SERVER_H
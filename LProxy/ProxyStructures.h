@@ -4,8 +4,46 @@
 #include <vector>
 
 #define TRAFFIC_BUFFER_SIZE 4096
+#define SPLICE_PIPE_SIZE 65536
+#define RELAY_BUFFER_MIN_SIZE 4096
+#define RELAY_BUFFER_MAX_SIZE 262144
+#define RELAY_BUFFER_MAX_CACHED 1024
+#define RELAY_BUFFER_GROW_READS 2
+#define RELAY_BUFFER_SHRINK_READS 4
+// Queued bytes of a direction which pause reading its source, and resume it once drained below the low one
+#define RELAY_HIGH_WATERMARK 262144
+#define RELAY_LOW_WATERMARK 65536
+
+// Version, reply, reserved, address type, 1 + 255 octets domain name and the port
+#define TRAVEL_REPLY_MAX_SIZE 262
+#define SOCKS_MAX_METHODS 255
+#define SOCKS_MAX_ADDR_SIZE 255
+#define SOCKS_PARSER_BUFFER_SIZE 1024
+#define UDP_HEADER_MAX_SIZE 22
+#define UDP_DATAGRAM_MAX_SIZE 65535
+#define UDP_RELAY_MAX_BATCH 64
+#define UDP_BATCH_SIZE 16
+#define UDP_BATCH_CONTROL_SIZE 64
+#define UDP_RELAY_SOCKET_NUM 4
+#define UDP_IDLE_TIMEOUT_MSEC 120000
+#define UDP_RELAY_DROP_LOG_MSEC 1000
+// Datagrams of an association waiting for their domain name to resolve
+#define UDP_PENDING_MAX_NUM 16
+#define UDP_PENDING_MAX_SIZE 65536
+// Largest UDP payload of IPv4, 65535 minus IP and UDP headers
+#define UDP_REASSEMBLY_MAX_SIZE 65507
+#define UDP_REASSEMBLY_MIN_ALLOC 4096
+#define UDP_REASSEMBLY_MAX_TOTAL (16 * 1024 * 1024)
+#define UDP_REASSEMBLY_TIMEOUT_MSEC 5000
 #define SOCK_TIMEOUT_SEC 3
 #define SOCK_TIMEOUT_MSEC 20
+#define ACCEPT_WAIT_MSEC 1000
+#define ACCEPT_RETRY_MSEC 10
+#define ACCEPT_RETRY_MAX_MSEC 1000
+#define CONNECT_TIMEOUT_MSEC 10000
+#define HANDSHAKE_TIMEOUT_MSEC 10000
+#define IDLE_TIMEOUT_MSEC 300000
+#define CONNECT_ATTEMPT_DELAY_MSEC 250
 
 enum class EOperationType
 {
@@ -14,6 +52,41 @@ enum class EOperationType
 	Exception,
 };
 
+// How the event loops wait for their sockets, @see Poller
+enum class EIOBackend
+{
+	Select,
+
+	Poll,
+
+	// Linux only
+	Epoll,
+
+	// Completions of io_uring, falls back to epoll when the kernel doesn't support it (Linux only)
+	IoUring,
+};
+
+enum class ETimerType
+{
+	// Greeting and request of the client, closes half-open and slow clients
+	HandshakeTimeout,
+
+	// Whole connect to destination, all attempts included
+	ConnectTimeout,
+
+	// Delay before racing the next destination address
+	ConnectAttempt,
+
+	// Check whether a connected relay went idle
+	Idle,
+
+	// Check whether a UDP association went idle
+	UDPIdle,
+
+	// Abandon an incomplete UDP fragment sequence
+	UDPReassembly,
+};
+
 enum class EConnectionState
 {
 	None = 0,
@@ -21,6 +94,8 @@ enum class EConnectionState
 	HandshakeError,
 	WaitLicense,
 	LicenseError,
+	Resolving,
+	Connecting,
 	Connected,
 	UDPAssociate,
 	ReuqestClose,
@@ -52,8 +127,8 @@ struct HandshakePacket
 	// Number of method
 	int MethodNum{0};
 
-	// Methods
-	std::vector<EConnectionProtocol> MethodList;
+	// Methods, the first MethodNum are valid
+	EConnectionProtocol MethodList[SOCKS_MAX_METHODS];
 };
 
 struct HandshakeResponse
@@ -109,13 +184,15 @@ struct TravelPayload
 					the address field contains the number of octets of name that follow,
 					there is no terminating NUL octet.
 	* [IPv6]		A version-6 IP address, with a length of 16 octets.
+	* Domain names are followed by a NUL octet, which isn't counted by DestAddrLen.
 	*/
-	std::vector<char> DestAddr;
+	char DestAddr[SOCKS_MAX_ADDR_SIZE + 1];
+	int DestAddrLen{0};
 
 	/**
 	* Desired destination port in network octet order
 	*/
-	std::vector<char> DestPort;
+	char DestPort[2];
 };
 
 enum class ETravelResponse
@@ -177,7 +254,7 @@ struct UDPTravelReply
 	* Reserved field
 	* 0x0000 default value
 	*/
-	std::vector<char> Reserved;
+	char Reserved[2];
 
 	/**
 	* Current fragment number
@@ -200,17 +277,43 @@ struct UDPTravelReply
 					there is no terminating NUL octet.
 	* [IPv6]		A version-6 IP address, with a length of 16 octets.
 	*/
-	std::vector<char> BindAddress;
+	char BindAddress[SOCKS_MAX_ADDR_SIZE];
+	int BindAddressLen{0};
 
 	/**
 	* Server bound port in network octet order
 	*/
-	std::vector<char> BindPort;
+	char BindPort[2];
 
 	/**
-	* UDP datagram
+	* UDP datagram, points into the received packet
 	*/
-	std::vector<char> Data;
+	const char* Data{nullptr};
+	int DataLen{0};
+};
+
+struct RelayDirectionState
+{
+	// Buffer size used by the next read of this direction
+	int BufferSize{0};
+
+	// Continuous reads which filled the whole buffer
+	int FullReads{0};
+
+	// Continuous reads which used less than a quarter of the buffer
+	int ShortReads{0};
+
+	// Bytes spliced into the pipe which the target didn't take yet
+	int PipeBytes{0};
+
+	// Bytes the target took, logged when the connection closes.
+	unsigned long long RelayedBytes{0};
+
+	// Reading the source waits until the target drained the queue, @see RELAY_HIGH_WATERMARK
+	bool bPaused{false};
+
+	// The source closed, the connection closes once the queue is flushed.
+	bool bSourceClosed{false};
 };
 
 #endif // !PROXY_STRUCTURES_H
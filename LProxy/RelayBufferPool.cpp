@@ -0,0 +1,147 @@
+#include "RelayBufferPool.h"
+#include "MemoryPool.h"
+
+#include <algorithm>
+
+std::once_flag RelayBufferPool::InstanceOnceFlag;
+std::shared_ptr<RelayBufferPool> RelayBufferPool::Instance;
+
+namespace
+{
+	struct ThreadFreeLists
+	{
+		std::vector<std::vector<char*>> Lists;
+
+		~ThreadFreeLists()
+		{
+			for (std::vector<char*>& freeList : Lists)
+			{
+				for (char* buffer : freeList)
+				{
+					delete[] buffer;
+				}
+			}
+		}
+	};
+}
+
+RelayBufferPool::RelayBufferPool()
+	: MinSize(0)
+	, MaxSize(0)
+	, MaxCachedNum(0)
+{
+	Configure(RELAY_BUFFER_MIN_SIZE, RELAY_BUFFER_MAX_SIZE, RELAY_BUFFER_MAX_CACHED);
+}
+
+RelayBufferPool::~RelayBufferPool()
+{
+
+}
+
+std::shared_ptr<RelayBufferPool> RelayBufferPool::Get()
+{
+	std::call_once(InstanceOnceFlag,
+	[&]()
+	{
+		Instance = std::make_shared<RelayBufferPool>();
+	});
+
+	return Instance;
+}
+
+void RelayBufferPool::Configure(int InMinSize, int InMaxSize, int InMaxCachedNum)
+{
+	MinSize = 1;
+	while (MinSize < std::max(InMinSize, 1))
+	{
+		MinSize <<= 1;
+	}
+
+	MaxSize = MinSize;
+	while (MaxSize < InMaxSize)
+	{
+		MaxSize <<= 1;
+	}
+
+	MaxCachedNum = std::max(InMaxCachedNum, 0);
+}
+
+char* RelayBufferPool::Acquire(int& Size)
+{
+	int classIndex = GetClassIndex(std::min(std::max(Size, MinSize), MaxSize));
+	Size = MinSize << classIndex;
+
+	std::vector<char*>& freeList = GetThreadFreeLists()[classIndex];
+	if (!freeList.empty()) {
+		char* buffer = freeList.back();
+		freeList.pop_back();
+		MemoryPool::BufferCounters.Hits.fetch_add(1, std::memory_order_relaxed);
+		return buffer;
+	}
+
+	MemoryPool::BufferCounters.Misses.fetch_add(1, std::memory_order_relaxed);
+	return new char[Size];
+}
+
+void RelayBufferPool::Release(char* Buffer, int Size)
+{
+	if (Buffer == nullptr) {
+		return;
+	}
+
+	if (Size >= MinSize && Size <= MaxSize) {
+		std::vector<char*>& freeList = GetThreadFreeLists()[GetClassIndex(Size)];
+		if (static_cast<int>(freeList.size()) < MaxCachedNum) {
+			freeList.push_back(Buffer);
+			MemoryPool::BufferCounters.Recycled.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+	}
+
+	delete[] Buffer;
+}
+
+void RelayBufferPool::AdaptSize(RelayDirectionState& Direction, int Received, int Requested)
+{
+	if (Received >= Requested) {
+		Direction.ShortReads = 0;
+		if (++Direction.FullReads >= RELAY_BUFFER_GROW_READS && Direction.BufferSize < MaxSize) {
+			Direction.BufferSize <<= 1;
+			Direction.FullReads = 0;
+		}
+	}
+	else if (Received < Requested / 4) {
+		Direction.FullReads = 0;
+		if (++Direction.ShortReads >= RELAY_BUFFER_SHRINK_READS && Direction.BufferSize > MinSize) {
+			Direction.BufferSize >>= 1;
+			Direction.ShortReads = 0;
+		}
+	}
+	else {
+		Direction.FullReads = 0;
+		Direction.ShortReads = 0;
+	}
+}
+
+int RelayBufferPool::GetClassIndex(int Size) const
+{
+	int classIndex = 0;
+	while ((MinSize << classIndex) < Size)
+	{
+		classIndex++;
+	}
+
+	return classIndex;
+}
+
+std::vector<std::vector<char*>>& RelayBufferPool::GetThreadFreeLists()
+{
+	static thread_local ThreadFreeLists freeLists;
+
+	size_t classNum = static_cast<size_t>(GetClassIndex(MaxSize) + 1);
+	if (freeLists.Lists.size() < classNum) {
+		freeLists.Lists.resize(classNum);
+	}
+
+	return freeLists.Lists;
+}
@@ -0,0 +1,62 @@
+#ifndef RELAY_BUFFER_POOL_H
+#define RELAY_BUFFER_POOL_H
+
+#include "ProxyStructures.h"
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/**
+* Pool of relay buffers, sizes are powers of two between MinSize and MaxSize.
+* A context only holds a buffer while it relays a chunk, so idle connections cost no buffer memory.
+* Free buffers are cached per thread, a context always takes and returns them in its loop thread.
+*/
+class RelayBufferPool
+{
+public:
+	RelayBufferPool();
+
+	virtual ~RelayBufferPool();
+
+	static std::shared_ptr<RelayBufferPool> Get();
+
+	/**
+	* Reset the size limits.
+	* Must be called before any event loop starts.
+	*/
+	virtual void Configure(int InMinSize, int InMaxSize, int InMaxCachedNum);
+
+	virtual inline int GetMinSize() const { return MinSize; }
+
+	virtual inline int GetMaxSize() const { return MaxSize; }
+
+	// Size is rounded up to the nearest size class.
+	virtual char* Acquire(int& Size);
+
+	virtual void Release(char* Buffer, int Size);
+
+	/**
+	* Grow the buffer of a direction when it keeps filling it up,
+	* shrink it back when reads keep using only a small part of it.
+	* Requested is the space the read could fill, reads behind queued bytes pass the whole buffer size.
+	*/
+	virtual void AdaptSize(RelayDirectionState& Direction, int Received, int Requested);
+
+protected:
+	virtual int GetClassIndex(int Size) const;
+
+	virtual std::vector<std::vector<char*>>& GetThreadFreeLists();
+
+protected:
+	static std::once_flag InstanceOnceFlag;
+	static std::shared_ptr<RelayBufferPool> Instance;
+
+	int MinSize;
+	int MaxSize;
+
+	// Max cached buffers of each size class in one thread
+	int MaxCachedNum;
+};
+
+#endif // !RELAY_BUFFER_POOL_H
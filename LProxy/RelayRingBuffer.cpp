@@ -0,0 +1,193 @@
+#include "RelayRingBuffer.h"
+#include "RelayBufferPool.h"
+
+#include <algorithm>
+#include <cstring>
+
+#ifdef __linux__
+#include <sys/uio.h>
+#endif
+
+RelayRingBuffer::RelayRingBuffer()
+	: Buffer(nullptr)
+	, Capacity(0)
+	, Head(0)
+	, Tail(0)
+{
+
+}
+
+RelayRingBuffer::~RelayRingBuffer()
+{
+	Release();
+}
+
+void RelayRingBuffer::Reserve(int& Size)
+{
+	if (Buffer != nullptr) {
+		Size = Capacity;
+		return;
+	}
+
+	Buffer = RelayBufferPool::Get()->Acquire(Size);
+	Capacity = Size;
+	Head = Tail = 0;
+}
+
+void RelayRingBuffer::Release()
+{
+	if (Buffer == nullptr) {
+		return;
+	}
+
+	RelayBufferPool::Get()->Release(Buffer, Capacity);
+	Buffer = nullptr;
+	Capacity = 0;
+	Head = Tail = 0;
+}
+
+int RelayRingBuffer::Write(const char* Data, int Len)
+{
+	char* spans[2];
+	int lens[2];
+	int spanNum = GetFreeSpans(spans, lens);
+
+	int written(0);
+	for (int index = 0; index < spanNum && written < Len; index++)
+	{
+		int copyLen = std::min(lens[index], Len - written);
+		std::memcpy(spans[index], Data + written, copyLen);
+		written += copyLen;
+	}
+
+	Commit(written);
+	return written;
+}
+
+int RelayRingBuffer::RecvFrom(SOCKET Source)
+{
+	char* spans[2];
+	int lens[2];
+	int spanNum = GetFreeSpans(spans, lens);
+	if (spanNum == 0) {
+		return 0;
+	}
+
+#ifdef __linux__
+	iovec vectors[2];
+	for (int index = 0; index < spanNum; index++)
+	{
+		vectors[index].iov_base = spans[index];
+		vectors[index].iov_len = static_cast<size_t>(lens[index]);
+	}
+
+	int recvState = static_cast<int>(readv(Source, vectors, spanNum));
+#else
+	WSABUF buffers[2];
+	for (int index = 0; index < spanNum; index++)
+	{
+		buffers[index].buf = spans[index];
+		buffers[index].len = static_cast<ULONG>(lens[index]);
+	}
+
+	DWORD received(0);
+	DWORD flags(0);
+	int recvState = WSARecv(Source, buffers, static_cast<DWORD>(spanNum), &received, &flags, nullptr, nullptr) == SOCKET_ERROR ? SOCKET_ERROR : static_cast<int>(received);
+#endif
+
+	if (recvState > 0) {
+		Commit(recvState);
+	}
+
+	return recvState;
+}
+
+int RelayRingBuffer::SendTo(SOCKET Target)
+{
+	char* spans[2];
+	int lens[2];
+	int spanNum = GetQueuedSpans(spans, lens);
+	if (spanNum == 0) {
+		return 0;
+	}
+
+#ifdef __linux__
+	iovec vectors[2];
+	for (int index = 0; index < spanNum; index++)
+	{
+		vectors[index].iov_base = spans[index];
+		vectors[index].iov_len = static_cast<size_t>(lens[index]);
+	}
+
+	int sendState = static_cast<int>(writev(Target, vectors, spanNum));
+#else
+	WSABUF buffers[2];
+	for (int index = 0; index < spanNum; index++)
+	{
+		buffers[index].buf = spans[index];
+		buffers[index].len = static_cast<ULONG>(lens[index]);
+	}
+
+	DWORD sent(0);
+	int sendState = WSASend(Target, buffers, static_cast<DWORD>(spanNum), &sent, 0, nullptr, nullptr) == SOCKET_ERROR ? SOCKET_ERROR : static_cast<int>(sent);
+#endif
+
+	if (sendState > 0) {
+		Consume(sendState);
+	}
+
+	return sendState;
+}
+
+int RelayRingBuffer::GetFreeSpans(char* Spans[2], int Lens[2]) const
+{
+	int freeSpace = GetFreeSpace();
+	if (freeSpace == 0) {
+		return 0;
+	}
+
+	int tailIndex = static_cast<int>(Tail & static_cast<unsigned int>(Capacity - 1));
+	Spans[0] = Buffer + tailIndex;
+	Lens[0] = std::min(freeSpace, Capacity - tailIndex);
+	if (Lens[0] == freeSpace) {
+		return 1;
+	}
+
+	Spans[1] = Buffer;
+	Lens[1] = freeSpace - Lens[0];
+	return 2;
+}
+
+int RelayRingBuffer::GetQueuedSpans(char* Spans[2], int Lens[2]) const
+{
+	int size = GetSize();
+	if (size == 0) {
+		return 0;
+	}
+
+	int headIndex = static_cast<int>(Head & static_cast<unsigned int>(Capacity - 1));
+	Spans[0] = Buffer + headIndex;
+	Lens[0] = std::min(size, Capacity - headIndex);
+	if (Lens[0] == size) {
+		return 1;
+	}
+
+	Spans[1] = Buffer;
+	Lens[1] = size - Lens[0];
+	return 2;
+}
+
+void RelayRingBuffer::Commit(int Len)
+{
+	Tail += static_cast<unsigned int>(Len);
+}
+
+void RelayRingBuffer::Consume(int Len)
+{
+	Head += static_cast<unsigned int>(Len);
+
+	// The next receive gets the whole buffer in one span.
+	if (Head == Tail) {
+		Head = Tail = 0;
+	}
+}
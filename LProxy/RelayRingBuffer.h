@@ -0,0 +1,73 @@
+#ifndef RELAY_RING_BUFFER_H
+#define RELAY_RING_BUFFER_H
+
+#include "PlatformSocket.h"
+
+/**
+* Bytes of one relay direction which the target didn't take yet.
+* The storage comes from RelayBufferPool and goes back as soon as the queue is empty,
+* so only a direction with a slow target holds a buffer between events.
+*/
+class RelayRingBuffer
+{
+public:
+	RelayRingBuffer();
+
+	virtual ~RelayRingBuffer();
+
+	/**
+	* Take a buffer from the pool unless one is held already.
+	* Size is rounded up to the size class of the pool.
+	*/
+	virtual void Reserve(int& Size);
+
+	// Give the buffer back, queued bytes are dropped.
+	virtual void Release();
+
+	virtual inline bool HasBuffer() const { return Buffer != nullptr; }
+
+	virtual inline int GetCapacity() const { return Capacity; }
+
+	virtual inline int GetSize() const { return static_cast<int>(Tail - Head); }
+
+	virtual inline int GetFreeSpace() const { return Capacity - GetSize(); }
+
+	virtual inline bool IsEmpty() const { return Tail == Head; }
+
+	// Copy bytes behind the queued ones, @return Bytes copied, less than Len when it's full.
+	virtual int Write(const char* Data, int Len);
+
+	/**
+	* Receive into the free space with one readv, WSARecv on Windows.
+	* @return Bytes received, 0 when the source closed, SOCKET_ERROR on failure.
+	*/
+	virtual int RecvFrom(SOCKET Source);
+
+	/**
+	* Send the queued bytes with one writev, WSASend on Windows.
+	* @return Bytes sent, SOCKET_ERROR on failure.
+	*/
+	virtual int SendTo(SOCKET Target);
+
+protected:
+	// Free or queued space as at most two spans, the second one wraps to the start.
+	virtual int GetFreeSpans(char* Spans[2], int Lens[2]) const;
+
+	virtual int GetQueuedSpans(char* Spans[2], int Lens[2]) const;
+
+	virtual void Commit(int Len);
+
+	virtual void Consume(int Len);
+
+protected:
+	char* Buffer;
+
+	// Power of 2, positions are masked by it
+	int Capacity;
+
+	// Positions only grow, both go back to 0 when the queue runs empty.
+	unsigned int Head;
+	unsigned int Tail;
+};
+
+#endif // !RELAY_RING_BUFFER_H
@@ -0,0 +1,450 @@
+#include "SharedUDPRelay.h"
+#include "ProxyContext.h"
+#include "MiscHelper.h"
+#include "EasyLog.h"
+#include "EventLoop.h"
+#include "Metrics.h"
+
+#include <algorithm>
+
+bool UDPAddressKey::operator==(const UDPAddressKey& Other) const
+{
+	return std::memcmp(Bytes, Other.Bytes, sizeof(Bytes)) == 0;
+}
+
+size_t UDPAddressKeyHash::operator()(const UDPAddressKey& Key) const
+{
+	// FNV-1a
+	uint64_t hash = 14695981039346656037ULL;
+	for (uint8_t byte : Key.Bytes)
+	{
+		hash ^= byte;
+		hash *= 1099511628211ULL;
+	}
+
+	return static_cast<size_t>(hash);
+}
+
+SharedUDPRelay::SharedUDPRelay(EventLoop* InLoop)
+	: Loop(InLoop)
+	, Port(0)
+	, Family(AF_INET)
+	, DroppedNum(0)
+{
+	Buffer.resize(UDP_DATAGRAM_MAX_SIZE);
+}
+
+SharedUDPRelay::~SharedUDPRelay()
+{
+	for (SOCKET socket : Sockets)
+	{
+		MiscHelper::CloseSocket(socket);
+	}
+
+	// The loop is going away with its poller, nothing to unwatch.
+	for (const auto& dedicated : DedicatedSockets)
+	{
+		MiscHelper::CloseSocket(dedicated.first);
+	}
+}
+
+bool SharedUDPRelay::Init(int SocketNum)
+{
+	// Dual-stack when the host supports IPv6, so one set of sockets serves clients and destinations of both families.
+	SOCKET probe = socket(AF_INET6, SOCK_DGRAM, 0);
+	if (probe != INVALID_SOCKET) {
+		Family = AF_INET6;
+		MiscHelper::CloseSocket(probe);
+	}
+
+	for (int index = 0; index < SocketNum; index++)
+	{
+		SOCKET relaySocket = socket(Family, SOCK_DGRAM, 0);
+		if (relaySocket == INVALID_SOCKET) {
+			LOG(Error, "Create shared udp relay socket failed, code: %d.", MiscHelper::GetLastSocketError());
+			return false;
+		}
+
+		Sockets.push_back(relaySocket);
+
+		if (Family == AF_INET6) {
+			int v6Only = 0;
+			setsockopt(relaySocket, IPPROTO_IPV6, IPV6_V6ONLY, (const char*)&v6Only, sizeof(v6Only));
+		}
+
+		SOCKADDR_STORAGE bindAddr;
+		std::memset(&bindAddr, 0, sizeof(bindAddr));
+		bindAddr.ss_family = static_cast<decltype(bindAddr.ss_family)>(Family);
+
+		SOCKADDR_STORAGE boundAddr;
+		std::memset(&boundAddr, 0, sizeof(boundAddr));
+		socklen_t boundLen = static_cast<socklen_t>(sizeof(boundAddr));
+		if (bind(relaySocket, (SOCKADDR*)&bindAddr, MiscHelper::GetAddressLength(bindAddr)) == SOCKET_ERROR ||
+			getsockname(relaySocket, (SOCKADDR*)&boundAddr, &boundLen) != 0 ||
+			!MiscHelper::SetNonBlocking(relaySocket)) {
+			LOG(Error, "Bind shared udp relay socket failed, code: %d.", MiscHelper::GetLastSocketError());
+			return false;
+		}
+
+		if (index == 0) {
+			Port = ntohs(boundAddr.ss_family == AF_INET6 ? ((SOCKADDR_IN6*)&boundAddr)->sin6_port : ((SOCKADDR_IN*)&boundAddr)->sin_port);
+		}
+	}
+
+	LOG(Log, "Shared udp relay is ready on port %d with %d sockets.", static_cast<int>(Port), SocketNum);
+	return !Sockets.empty();
+}
+
+bool SharedUDPRelay::IsRelaySocket(SOCKET Socket) const
+{
+	return GetSocketIndex(Socket) >= 0 || DedicatedSockets.count(Socket) != 0;
+}
+
+void SharedUDPRelay::Associate(const SOCKADDR_STORAGE& ClientAddr, const std::shared_ptr<ProxyContext>& Context)
+{
+	const ProxyContext* owner = Context.get();
+
+	RelayAssociation& association = Associations[owner];
+	association.Context = Context;
+
+	unsigned short clientPort = ClientAddr.ss_family == AF_INET6 ? ((SOCKADDR_IN6*)&ClientAddr)->sin6_port : ((SOCKADDR_IN*)&ClientAddr)->sin_port;
+	if (clientPort == 0) {
+		PendingClients[MakeKey(ClientAddr, false)].push_back(owner);
+		return;
+	}
+
+	// A newer association of the same client address takes it over.
+	association.ClientKey = MakeKey(ClientAddr, true);
+	association.bClientKnown = true;
+	Clients[association.ClientKey] = owner;
+}
+
+void SharedUDPRelay::Dissociate(const ProxyContext* Context)
+{
+	auto association = Associations.find(Context);
+	if (association == Associations.end()) {
+		return;
+	}
+
+	if (association->second.bClientKnown) {
+		auto client = Clients.find(association->second.ClientKey);
+		if (client != Clients.end() && client->second == Context) {
+			Clients.erase(client);
+		}
+	}
+
+	for (auto pending = PendingClients.begin(); pending != PendingClients.end();)
+	{
+		std::deque<const ProxyContext*>& owners = pending->second;
+		owners.erase(std::remove(owners.begin(), owners.end(), Context), owners.end());
+
+		if (owners.empty()) {
+			pending = PendingClients.erase(pending);
+		}
+		else {
+			++pending;
+		}
+	}
+
+	for (const UDPAddressKey& remoteKey : association->second.RemoteKeys)
+	{
+		Remotes.erase(remoteKey);
+	}
+
+	CloseDedicatedSocket(association->second);
+
+	Associations.erase(association);
+}
+
+void SharedUDPRelay::ExpireRemotes(const ProxyContext* Context, std::chrono::steady_clock::time_point Before)
+{
+	auto association = Associations.find(Context);
+	if (association == Associations.end()) {
+		return;
+	}
+
+	std::vector<UDPAddressKey>& remoteKeys = association->second.RemoteKeys;
+	remoteKeys.erase(std::remove_if(remoteKeys.begin(), remoteKeys.end(),
+	[this, Before](const UDPAddressKey& remoteKey)
+	{
+		auto remote = Remotes.find(remoteKey);
+		if (remote == Remotes.end()) {
+			return true;
+		}
+
+		if (remote->second.LastActive < Before) {
+			Remotes.erase(remote);
+			return true;
+		}
+
+		return false;
+	}), remoteKeys.end());
+}
+
+void SharedUDPRelay::HandleReadable(SOCKET Socket)
+{
+	if (!IsRelaySocket(Socket)) {
+		return;
+	}
+
+	for (int index = 0; index < UDP_RELAY_MAX_BATCH; index++)
+	{
+		SOCKADDR_STORAGE sourceAddr;
+		std::memset(&sourceAddr, 0, sizeof(sourceAddr));
+		socklen_t addrLen = static_cast<socklen_t>(sizeof(sourceAddr));
+
+		int recvState = recvfrom(Socket, Buffer.data(), UDP_DATAGRAM_MAX_SIZE, 0, (SOCKADDR*)&sourceAddr, &addrLen);
+		if (recvState == SOCKET_ERROR) {
+			int errorCode = MiscHelper::GetLastSocketError();
+			if (MiscHelper::IsWouldBlock(errorCode)) {
+				return;
+			}
+
+			if (MiscHelper::IsDatagramError(errorCode)) {
+				continue;
+			}
+
+			LOG(Error, "Recv from shared udp relay failed, code: %d", errorCode);
+			return;
+		}
+
+		MiscHelper::UnmapAddress(sourceAddr);
+		RelayDatagram(Socket, Buffer.data(), recvState, sourceAddr);
+	}
+}
+
+UDPAddressKey SharedUDPRelay::MakeKey(const SOCKADDR_STORAGE& Addr, bool bWithPort, int SocketIndex /*= 0*/) const
+{
+	SOCKADDR_STORAGE unmappedAddr = Addr;
+	MiscHelper::UnmapAddress(unmappedAddr);
+
+	UDPAddressKey key;
+	if (unmappedAddr.ss_family == AF_INET6) {
+		const SOCKADDR_IN6* addr6 = (const SOCKADDR_IN6*)&unmappedAddr;
+		key.Bytes[0] = 6;
+		std::memcpy(key.Bytes + 1, &addr6->sin6_addr, 16);
+		if (bWithPort) {
+			std::memcpy(key.Bytes + 17, &addr6->sin6_port, 2);
+		}
+	}
+	else {
+		const SOCKADDR_IN* addr4 = (const SOCKADDR_IN*)&unmappedAddr;
+		key.Bytes[0] = 4;
+		std::memcpy(key.Bytes + 1, &addr4->sin_addr, 4);
+		if (bWithPort) {
+			std::memcpy(key.Bytes + 17, &addr4->sin_port, 2);
+		}
+	}
+
+	key.Bytes[19] = static_cast<uint8_t>(SocketIndex);
+	return key;
+}
+
+int SharedUDPRelay::GetSocketIndex(SOCKET Socket) const
+{
+	for (size_t index = 0; index < Sockets.size(); index++)
+	{
+		if (Sockets[index] == Socket) {
+			return static_cast<int>(index);
+		}
+	}
+
+	return -1;
+}
+
+SOCKET SharedUDPRelay::BindRemote(const SOCKADDR_STORAGE& Remote, const ProxyContext* Owner, RelayAssociation& Association)
+{
+	auto now = std::chrono::steady_clock::now();
+	int freeIndex(-1);
+
+	for (int index = 0; index < static_cast<int>(Sockets.size()); index++)
+	{
+		auto remote = Remotes.find(MakeKey(Remote, true, index));
+		if (remote == Remotes.end()) {
+			if (freeIndex < 0) {
+				freeIndex = index;
+			}
+			continue;
+		}
+
+		if (remote->second.Owner == Owner) {
+			remote->second.LastActive = now;
+			return Sockets[index];
+		}
+	}
+
+	if (freeIndex < 0) {
+		return OpenDedicatedSocket(Owner, Association);
+	}
+
+	UDPAddressKey remoteKey = MakeKey(Remote, true, freeIndex);
+
+	RemoteBinding& binding = Remotes[remoteKey];
+	binding.Owner = Owner;
+	binding.LastActive = now;
+
+	Association.RemoteKeys.push_back(remoteKey);
+	return Sockets[freeIndex];
+}
+
+SOCKET SharedUDPRelay::OpenDedicatedSocket(const ProxyContext* Owner, RelayAssociation& Association)
+{
+	if (Association.DedicatedSocket != INVALID_SOCKET) {
+		return Association.DedicatedSocket;
+	}
+
+	SOCKET dedicatedSocket = socket(Family, SOCK_DGRAM, 0);
+	if (dedicatedSocket == INVALID_SOCKET) {
+		LOG(Error, "Create dedicated udp relay socket failed, code: %d.", MiscHelper::GetLastSocketError());
+		return INVALID_SOCKET;
+	}
+
+	if (Family == AF_INET6) {
+		int v6Only = 0;
+		setsockopt(dedicatedSocket, IPPROTO_IPV6, IPV6_V6ONLY, (const char*)&v6Only, sizeof(v6Only));
+	}
+
+	SOCKADDR_STORAGE bindAddr;
+	std::memset(&bindAddr, 0, sizeof(bindAddr));
+	bindAddr.ss_family = static_cast<decltype(bindAddr.ss_family)>(Family);
+
+	if (bind(dedicatedSocket, (SOCKADDR*)&bindAddr, MiscHelper::GetAddressLength(bindAddr)) == SOCKET_ERROR ||
+		!MiscHelper::SetNonBlocking(dedicatedSocket) ||
+		!Loop->WatchRelaySocket(dedicatedSocket)) {
+		LOG(Error, "Bind dedicated udp relay socket failed, code: %d.", MiscHelper::GetLastSocketError());
+		MiscHelper::CloseSocket(dedicatedSocket);
+		return INVALID_SOCKET;
+	}
+
+	Association.DedicatedSocket = dedicatedSocket;
+	DedicatedSockets[dedicatedSocket] = Owner;
+	return dedicatedSocket;
+}
+
+void SharedUDPRelay::CloseDedicatedSocket(RelayAssociation& Association)
+{
+	if (Association.DedicatedSocket == INVALID_SOCKET) {
+		return;
+	}
+
+	Loop->UnwatchRelaySocket(Association.DedicatedSocket);
+	DedicatedSockets.erase(Association.DedicatedSocket);
+	MiscHelper::CloseSocket(Association.DedicatedSocket);
+	Association.DedicatedSocket = INVALID_SOCKET;
+}
+
+void SharedUDPRelay::RelayDatagram(SOCKET Socket, const char* Data, int Len, const SOCKADDR_STORAGE& Source)
+{
+	const ProxyContext* owner(nullptr);
+	bool bFromClient(false);
+
+	int socketIndex = GetSocketIndex(Socket);
+
+	// Everything arriving on a dedicated socket is a reply to its association.
+	if (socketIndex < 0) {
+		auto dedicated = DedicatedSockets.find(Socket);
+		if (dedicated == DedicatedSockets.end()) {
+			return;
+		}
+
+		owner = dedicated->second;
+	}
+
+	// Clients only talk to the first socket, replies of remotes come back on the socket their binding uses.
+	if (socketIndex == 0) {
+		auto client = Clients.find(MakeKey(Source, true));
+		if (client != Clients.end()) {
+			owner = client->second;
+			bFromClient = true;
+		}
+	}
+
+	if (owner == nullptr) {
+		auto remote = Remotes.find(MakeKey(Source, true, socketIndex));
+		if (remote != Remotes.end()) {
+			owner = remote->second.Owner;
+			remote->second.LastActive = std::chrono::steady_clock::now();
+		}
+	}
+
+	if (owner == nullptr && socketIndex == 0) {
+		auto pending = PendingClients.find(MakeKey(Source, false));
+		if (pending != PendingClients.end()) {
+			owner = pending->second.front();
+			bFromClient = true;
+
+			pending->second.pop_front();
+			if (pending->second.empty()) {
+				PendingClients.erase(pending);
+			}
+
+			RelayAssociation& association = Associations[owner];
+			association.ClientKey = MakeKey(Source, true);
+			association.bClientKnown = true;
+			Clients[association.ClientKey] = owner;
+		}
+	}
+
+	if (owner == nullptr) {
+		return;
+	}
+
+	auto association = Associations.find(owner);
+	if (association == Associations.end()) {
+		return;
+	}
+
+	std::shared_ptr<ProxyContext> context = association->second.Context.lock();
+	if (context == nullptr || !context->IsAttached()) {
+		return;
+	}
+
+	UDPRelayDatagram datagram;
+	if (!context->HandleRelayDatagram(Data, Len, Source, bFromClient, datagram)) {
+		return;
+	}
+
+	if (bFromClient) {
+		SendToRemote(owner, datagram);
+		return;
+	}
+
+	if (!MiscHelper::SendDatagram(Sockets[0], datagram.Header, datagram.HeaderLen, datagram.Data, datagram.DataLen, datagram.Addr)) {
+		LOG(Warning, "Send udp datagram to %s failed, code: %d", MiscHelper::AddressToString(datagram.Addr).c_str(), MiscHelper::GetLastSocketError());
+	}
+}
+
+bool SharedUDPRelay::SendToRemote(const ProxyContext* Owner, const UDPRelayDatagram& Datagram)
+{
+	auto association = Associations.find(Owner);
+	if (association == Associations.end()) {
+		return false;
+	}
+
+	SOCKET sendSocket = BindRemote(Datagram.Addr, Owner, association->second);
+	if (sendSocket == INVALID_SOCKET) {
+		DropDatagram(Datagram.Addr);
+		return false;
+	}
+
+	if (!MiscHelper::SendDatagram(sendSocket, Datagram.Header, Datagram.HeaderLen, Datagram.Data, Datagram.DataLen, Datagram.Addr)) {
+		LOG(Warning, "Send udp datagram to %s failed, code: %d", MiscHelper::AddressToString(Datagram.Addr).c_str(), MiscHelper::GetLastSocketError());
+	}
+
+	return true;
+}
+
+void SharedUDPRelay::DropDatagram(const SOCKADDR_STORAGE& Remote)
+{
+	Metrics::Add(EMetricCounter::UDPDroppedDatagrams);
+	DroppedNum++;
+
+	auto now = std::chrono::steady_clock::now();
+	if (now - LastDropLog < std::chrono::milliseconds(UDP_RELAY_DROP_LOG_MSEC)) {
+		return;
+	}
+
+	LOG(Warning, "Dropped %llu udp datagrams, the last one to %s, no relay socket can reach it.", static_cast<unsigned long long>(DroppedNum), MiscHelper::AddressToString(Remote).c_str());
+	DroppedNum = 0;
+	LastDropLog = now;
+}
@@ -0,0 +1,140 @@
+#ifndef SHARED_UDP_RELAY_H
+#define SHARED_UDP_RELAY_H
+
+#include "ProxyStructures.h"
+#include "PlatformSocket.h"
+
+#include <memory>
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <unordered_map>
+
+class EventLoop;
+class ProxyContext;
+struct UDPRelayDatagram;
+
+// Address family, address, port and relay socket index of a UDP peer.
+struct UDPAddressKey
+{
+	uint8_t Bytes[20]{};
+
+	bool operator==(const UDPAddressKey& Other) const;
+};
+
+struct UDPAddressKeyHash
+{
+	size_t operator()(const UDPAddressKey& Key) const;
+};
+
+/**
+* A few UDP sockets of one event loop shared by all of its UDP associations.
+* Client datagrams are demultiplexed by the client address, replies by the remote address and the socket they arrived on.
+* A remote address is bound to one association per socket, so associations talking to the same remote use different sockets.
+* Once every socket is bound to a remote, further associations reach it through a dedicated socket of their own.
+* Clients always talk to the first socket, its port is the one sent in UDP ASSOCIATE replies.
+*/
+class SharedUDPRelay
+{
+public:
+	SharedUDPRelay(EventLoop* InLoop);
+
+	virtual ~SharedUDPRelay();
+
+	virtual bool Init(int SocketNum);
+
+	virtual inline const std::vector<SOCKET>& GetSockets() const { return Sockets; }
+
+	virtual inline unsigned short GetPort() const { return Port; }
+
+	virtual inline int GetFamily() const { return Family; }
+
+	virtual bool IsRelaySocket(SOCKET Socket) const;
+
+	/**
+	* @param ClientAddr	Client side of the association, with port 0 the first unknown datagram of the host decides it.
+	*/
+	virtual void Associate(const SOCKADDR_STORAGE& ClientAddr, const std::shared_ptr<ProxyContext>& Context);
+
+	virtual void Dissociate(const ProxyContext* Context);
+
+	// Drop the remote bindings of an association which were idle since before the given time.
+	virtual void ExpireRemotes(const ProxyContext* Context, std::chrono::steady_clock::time_point Before);
+
+	virtual void HandleReadable(SOCKET Socket);
+
+	/**
+	* Send a client datagram of the association to its remote.
+	* @return false when it's dropped.
+	*/
+	virtual bool SendToRemote(const ProxyContext* Owner, const UDPRelayDatagram& Datagram);
+
+protected:
+	struct RemoteBinding
+	{
+		const ProxyContext* Owner{nullptr};
+
+		std::chrono::steady_clock::time_point LastActive;
+	};
+
+	struct RelayAssociation
+	{
+		std::weak_ptr<ProxyContext> Context;
+
+		UDPAddressKey ClientKey;
+		bool bClientKnown{false};
+
+		std::vector<UDPAddressKey> RemoteKeys;
+
+		// Reaches the remotes every shared socket is bound to by others, opened on demand
+		SOCKET DedicatedSocket{INVALID_SOCKET};
+	};
+
+	virtual UDPAddressKey MakeKey(const SOCKADDR_STORAGE& Addr, bool bWithPort, int SocketIndex = 0) const;
+
+	virtual int GetSocketIndex(SOCKET Socket) const;
+
+	/**
+	* Socket to reach the remote through for the association,
+	* the dedicated one when every shared socket is taken by others.
+	* @return INVALID_SOCKET when not even a dedicated socket can be opened.
+	*/
+	virtual SOCKET BindRemote(const SOCKADDR_STORAGE& Remote, const ProxyContext* Owner, RelayAssociation& Association);
+
+	virtual SOCKET OpenDedicatedSocket(const ProxyContext* Owner, RelayAssociation& Association);
+
+	virtual void CloseDedicatedSocket(RelayAssociation& Association);
+
+	virtual void RelayDatagram(SOCKET Socket, const char* Data, int Len, const SOCKADDR_STORAGE& Source);
+
+	// Count a datagram which can't be relayed, logged at most once per UDP_RELAY_DROP_LOG_MSEC.
+	virtual void DropDatagram(const SOCKADDR_STORAGE& Remote);
+
+protected:
+	EventLoop* Loop;
+
+	std::vector<SOCKET> Sockets;
+	unsigned short Port;
+	int Family;
+
+	std::unordered_map<const ProxyContext*, RelayAssociation> Associations;
+
+	std::unordered_map<UDPAddressKey, const ProxyContext*, UDPAddressKeyHash> Clients;
+
+	// Associations still waiting for the first datagram of their client host, oldest first
+	std::unordered_map<UDPAddressKey, std::deque<const ProxyContext*>, UDPAddressKeyHash> PendingClients;
+
+	std::unordered_map<UDPAddressKey, RemoteBinding, UDPAddressKeyHash> Remotes;
+
+	std::unordered_map<SOCKET, const ProxyContext*> DedicatedSockets;
+
+	// Drops since the last log line
+	uint64_t DroppedNum;
+	std::chrono::steady_clock::time_point LastDropLog;
+
+	std::vector<char> Buffer;
+};
+
+#endif // !SHARED_UDP_RELAY_H
@@ -0,0 +1,137 @@
+#include "Socks5Parser.h"
+#include "BufferView.h"
+
+#include <cstring>
+
+Socks5Parser::Socks5Parser()
+	: ReadOffset(0)
+	, WriteOffset(0)
+{
+
+}
+
+Socks5Parser::~Socks5Parser()
+{
+
+}
+
+char* Socks5Parser::GetWriteBuffer()
+{
+	// Move the unparsed tail to the front, a partial message is always shorter than the buffer.
+	if (ReadOffset > 0) {
+		std::memmove(Buffer, Buffer + ReadOffset, GetBufferedNum());
+		WriteOffset -= ReadOffset;
+		ReadOffset = 0;
+	}
+
+	return Buffer + WriteOffset;
+}
+
+int Socks5Parser::GetWriteSpace()
+{
+	return SOCKS_PARSER_BUFFER_SIZE - WriteOffset;
+}
+
+void Socks5Parser::Commit(int Len)
+{
+	if (Len > 0 && Len <= GetWriteSpace()) {
+		WriteOffset += Len;
+	}
+}
+
+EParseResult Socks5Parser::ParseGreeting(HandshakePacket& Packet)
+{
+	BufferView view(Buffer + ReadOffset, GetBufferedNum());
+
+	// Version and method number
+	uint8_t version(0), methodNum(0);
+	if (!view.ReadUInt8(version) || !view.ReadUInt8(methodNum) || view.GetRemaining() < methodNum) {
+		return EParseResult::NeedMore;
+	}
+
+	Packet.Version = static_cast<ESocksVersion>(version);
+	Packet.MethodNum = methodNum;
+	for (int index = 0; index < methodNum; index++)
+	{
+		uint8_t method(0);
+		view.ReadUInt8(method);
+		Packet.MethodList[index] = static_cast<EConnectionProtocol>(method);
+	}
+
+	Consume(view.GetOffset());
+	return EParseResult::Done;
+}
+
+EParseResult Socks5Parser::ParseRequest(TravelPayload& Payload)
+{
+	BufferView view(Buffer + ReadOffset, GetBufferedNum());
+
+	// Version, command, reserved and address type
+	uint8_t header[4];
+	if (!view.Read(header, 4)) {
+		return EParseResult::NeedMore;
+	}
+
+	Payload.Version = static_cast<ESocksVersion>(header[0]);
+	Payload.AddressType = static_cast<EAddressType>(header[3]);
+
+	int addrLen(0);
+	switch (Payload.AddressType)
+	{
+	case EAddressType::IPv4:
+		addrLen = 4;
+		break;
+	case EAddressType::IPv6:
+		addrLen = 16;
+		break;
+	case EAddressType::DomainName:
+	{
+		uint8_t nameLen(0);
+		if (!view.ReadUInt8(nameLen)) {
+			return EParseResult::NeedMore;
+		}
+
+		addrLen = nameLen;
+		break;
+	}
+	default:
+		return EParseResult::Malformed;
+	}
+
+	if (view.GetRemaining() < addrLen + 2) {
+		return EParseResult::NeedMore;
+	}
+
+	Payload.Cmd = static_cast<ECommandType>(header[1]);
+	Payload.Reserved = static_cast<char>(header[2]);
+
+	view.Read(Payload.DestAddr, addrLen);
+	view.Read(Payload.DestPort, 2);
+
+	// Terminated for the resolver
+	Payload.DestAddrLen = addrLen;
+	Payload.DestAddr[addrLen] = 0x00;
+
+	Consume(view.GetOffset());
+	return EParseResult::Done;
+}
+
+void Socks5Parser::TakeRemaining(std::vector<char>& Remaining)
+{
+	Remaining.assign(Buffer + ReadOffset, Buffer + WriteOffset);
+	Reset();
+}
+
+void Socks5Parser::Reset()
+{
+	ReadOffset = WriteOffset = 0;
+}
+
+void Socks5Parser::Consume(int Len)
+{
+	ReadOffset += Len;
+
+	if (ReadOffset >= WriteOffset) {
+		ReadOffset = WriteOffset = 0;
+	}
+}
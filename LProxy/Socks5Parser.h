@@ -0,0 +1,64 @@
+#ifndef SOCKS5_PARSER_H
+#define SOCKS5_PARSER_H
+
+#include "ProxyStructures.h"
+
+#include <vector>
+
+enum class EParseResult
+{
+	// The message isn't complete yet, wait for the next read.
+	NeedMore,
+
+	// A whole message was parsed and consumed.
+	Done,
+
+	// The message can't be framed, e.g. an unknown address type.
+	Malformed,
+};
+
+/**
+* Resumable parser of the SOCKS5 greeting and request.
+* Bytes of any number of reads are appended, a message is only consumed once it's complete,
+* so a client sending the greeting, the request and its first payload in one segment is parsed in one pass.
+* Bytes are kept in inline storage, parsing a handshake never allocates.
+*/
+class Socks5Parser
+{
+public:
+	Socks5Parser();
+
+	virtual ~Socks5Parser();
+
+	// Receive straight into the free space, then commit the received bytes.
+	virtual char* GetWriteBuffer();
+
+	virtual int GetWriteSpace();
+
+	virtual void Commit(int Len);
+
+	virtual EParseResult ParseGreeting(HandshakePacket& Packet);
+
+	virtual EParseResult ParseRequest(TravelPayload& Payload);
+
+	// Move out the bytes after the parsed messages, e.g. pipelined payload for the destination.
+	virtual void TakeRemaining(std::vector<char>& Remaining);
+
+	virtual void Reset();
+
+	virtual inline int GetBufferedNum() const { return WriteOffset - ReadOffset; }
+
+protected:
+	virtual void Consume(int Len);
+
+protected:
+	char Buffer[SOCKS_PARSER_BUFFER_SIZE];
+
+	// Bytes before it are already parsed.
+	int ReadOffset;
+
+	// Bytes before it are received.
+	int WriteOffset;
+};
+
+#endif // !SOCKS5_PARSER_H
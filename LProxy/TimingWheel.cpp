@@ -0,0 +1,281 @@
+#include "TimingWheel.h"
+
+#include <algorithm>
+
+#define TIMING_WHEEL_ROOT_SIZE (1u << TIMING_WHEEL_ROOT_BITS)
+#define TIMING_WHEEL_LEVEL_SIZE (1u << TIMING_WHEEL_LEVEL_BITS)
+#define TIMING_WHEEL_SLOT_NUM (TIMING_WHEEL_ROOT_SIZE + (TIMING_WHEEL_LEVEL_NUM - 1) * TIMING_WHEEL_LEVEL_SIZE)
+// Every due timer waits in one more list behind the slots
+#define TIMING_WHEEL_DUE_SLOT TIMING_WHEEL_SLOT_NUM
+#define TIMING_WHEEL_NONE UINT32_MAX
+
+// First tick bit of a level, level 0 is the root.
+static inline uint32_t GetLevelShift(int Level)
+{
+	return Level == 0 ? 0 : TIMING_WHEEL_ROOT_BITS + (Level - 1) * TIMING_WHEEL_LEVEL_BITS;
+}
+
+// Ticks a level covers from the current tick, the root included.
+static inline uint64_t GetLevelSpan(int Level)
+{
+	return 1ull << (TIMING_WHEEL_ROOT_BITS + Level * TIMING_WHEEL_LEVEL_BITS);
+}
+
+static inline uint32_t GetSlot(int Level, uint64_t Tick)
+{
+	if (Level == 0) {
+		return static_cast<uint32_t>(Tick & (TIMING_WHEEL_ROOT_SIZE - 1));
+	}
+
+	return TIMING_WHEEL_ROOT_SIZE + (Level - 1) * TIMING_WHEEL_LEVEL_SIZE + static_cast<uint32_t>((Tick >> GetLevelShift(Level)) & (TIMING_WHEEL_LEVEL_SIZE - 1));
+}
+
+TimingWheel::TimingWheel()
+	: Origin(std::chrono::steady_clock::now())
+	, CurrentTick(0)
+	, SlotHeads(TIMING_WHEEL_SLOT_NUM + 1, TIMING_WHEEL_NONE)
+	, SlotTails(TIMING_WHEEL_SLOT_NUM + 1, TIMING_WHEEL_NONE)
+	, TimerNum(0)
+	, DueNum(0)
+{
+
+}
+
+TimingWheel::~TimingWheel()
+{
+
+}
+
+uint64_t TimingWheel::Add(int DelayMsec, LoopTimer& Timer)
+{
+	uint32_t nodeIndex;
+	if (!FreeNodes.empty()) {
+		nodeIndex = FreeNodes.back();
+		FreeNodes.pop_back();
+	}
+	else {
+		nodeIndex = static_cast<uint32_t>(Nodes.size());
+		Nodes.emplace_back();
+	}
+
+	TimerNode& node = Nodes[nodeIndex];
+	node.Generation++;
+	node.bUsed = true;
+
+	// Rounded up to whole ticks, so it's never due before the delay passed.
+	auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - Origin);
+	uint64_t deadlineMsec = static_cast<uint64_t>(elapsed.count()) + static_cast<uint64_t>(std::max(DelayMsec, 0));
+	node.ExpireTick = std::max<uint64_t>((deadlineMsec + TIMING_WHEEL_TICK_MSEC - 1) / TIMING_WHEEL_TICK_MSEC, CurrentTick);
+
+	Timer.Id = (static_cast<uint64_t>(node.Generation) << 32) | (static_cast<uint64_t>(nodeIndex) + 1);
+	node.Timer = Timer;
+
+	Schedule(nodeIndex);
+	TimerNum++;
+
+	return Timer.Id;
+}
+
+void TimingWheel::Cancel(uint64_t TimerId)
+{
+	if (TimerId == 0) {
+		return;
+	}
+
+	uint32_t nodeIndex = static_cast<uint32_t>((TimerId & 0xFFFFFFFF) - 1);
+	if (nodeIndex >= Nodes.size()) {
+		return;
+	}
+
+	TimerNode& node = Nodes[nodeIndex];
+	if (!node.bUsed || node.Generation != static_cast<uint32_t>(TimerId >> 32)) {
+		return;
+	}
+
+	UnlinkNode(nodeIndex);
+	FreeNode(nodeIndex);
+}
+
+void TimingWheel::Advance(std::chrono::steady_clock::time_point Now)
+{
+	uint64_t nowTick = GetTick(Now);
+
+	while (CurrentTick <= nowTick)
+	{
+		// Nothing left to turn, a long idle wheel skips its empty ticks at once.
+		if (TimerNum == DueNum) {
+			CurrentTick = nowTick + 1;
+			break;
+		}
+
+		// The root wrapped, the next slot of each higher level which wrapped too comes down.
+		for (int level = 1; level < TIMING_WHEEL_LEVEL_NUM; level++)
+		{
+			if ((CurrentTick & (GetLevelSpan(level - 1) - 1)) != 0) {
+				break;
+			}
+
+			Cascade(GetSlot(level, CurrentTick));
+		}
+
+		MoveToDue(GetSlot(0, CurrentTick));
+		CurrentTick++;
+	}
+}
+
+bool TimingWheel::PopDue(LoopTimer& Timer)
+{
+	uint32_t nodeIndex = SlotHeads[TIMING_WHEEL_DUE_SLOT];
+	if (nodeIndex == TIMING_WHEEL_NONE) {
+		return false;
+	}
+
+	Timer = Nodes[nodeIndex].Timer;
+
+	UnlinkNode(nodeIndex);
+	FreeNode(nodeIndex);
+	return true;
+}
+
+int TimingWheel::GetWaitTimeout(std::chrono::steady_clock::time_point Now, int MaxMsec) const
+{
+	if (DueNum != 0) {
+		return 0;
+	}
+
+	if (TimerNum == 0) {
+		return MaxMsec;
+	}
+
+	// The first occupied root slot, or the next wrap which may cascade timers down into the root.
+	uint64_t lastTick = GetTick(Now) + static_cast<uint64_t>(MaxMsec) / TIMING_WHEEL_TICK_MSEC + 1;
+	uint64_t tick = CurrentTick;
+	for (; tick <= lastTick; tick++)
+	{
+		if (SlotHeads[GetSlot(0, tick)] != TIMING_WHEEL_NONE || (tick & (TIMING_WHEEL_ROOT_SIZE - 1)) == 0) {
+			break;
+		}
+	}
+
+	auto remain = std::chrono::duration_cast<std::chrono::milliseconds>(Origin + std::chrono::milliseconds(tick * TIMING_WHEEL_TICK_MSEC) - Now);
+	if (remain.count() <= 0) {
+		return 0;
+	}
+
+	// Round up, waking before the tick only spins the loop once more.
+	return static_cast<int>(std::min<long long>(remain.count() + 1, MaxMsec));
+}
+
+void TimingWheel::Clear()
+{
+	Nodes.clear();
+	FreeNodes.clear();
+	std::fill(SlotHeads.begin(), SlotHeads.end(), TIMING_WHEEL_NONE);
+	std::fill(SlotTails.begin(), SlotTails.end(), TIMING_WHEEL_NONE);
+	TimerNum = DueNum = 0;
+}
+
+uint64_t TimingWheel::GetTick(std::chrono::steady_clock::time_point Time) const
+{
+	auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(Time - Origin);
+	return elapsed.count() <= 0 ? 0 : static_cast<uint64_t>(elapsed.count()) / TIMING_WHEEL_TICK_MSEC;
+}
+
+void TimingWheel::Schedule(uint32_t NodeIndex)
+{
+	TimerNode& node = Nodes[NodeIndex];
+
+	uint64_t delta = node.ExpireTick - CurrentTick;
+	for (int level = 0; level < TIMING_WHEEL_LEVEL_NUM; level++)
+	{
+		if (delta < GetLevelSpan(level)) {
+			LinkNode(NodeIndex, GetSlot(level, node.ExpireTick));
+			return;
+		}
+	}
+
+	node.ExpireTick = CurrentTick + GetLevelSpan(TIMING_WHEEL_LEVEL_NUM - 1) - 1;
+	LinkNode(NodeIndex, GetSlot(TIMING_WHEEL_LEVEL_NUM - 1, node.ExpireTick));
+}
+
+void TimingWheel::LinkNode(uint32_t NodeIndex, uint32_t Slot)
+{
+	TimerNode& node = Nodes[NodeIndex];
+	node.Slot = Slot;
+	node.Prev = SlotTails[Slot];
+	node.Next = TIMING_WHEEL_NONE;
+
+	if (node.Prev != TIMING_WHEEL_NONE) {
+		Nodes[node.Prev].Next = NodeIndex;
+	}
+	else {
+		SlotHeads[Slot] = NodeIndex;
+	}
+
+	SlotTails[Slot] = NodeIndex;
+
+	if (Slot == TIMING_WHEEL_DUE_SLOT) {
+		DueNum++;
+	}
+}
+
+void TimingWheel::UnlinkNode(uint32_t NodeIndex)
+{
+	TimerNode& node = Nodes[NodeIndex];
+
+	if (node.Prev != TIMING_WHEEL_NONE) {
+		Nodes[node.Prev].Next = node.Next;
+	}
+	else {
+		SlotHeads[node.Slot] = node.Next;
+	}
+
+	if (node.Next != TIMING_WHEEL_NONE) {
+		Nodes[node.Next].Prev = node.Prev;
+	}
+	else {
+		SlotTails[node.Slot] = node.Prev;
+	}
+
+	if (node.Slot == TIMING_WHEEL_DUE_SLOT) {
+		DueNum--;
+	}
+
+	node.Prev = node.Next = TIMING_WHEEL_NONE;
+}
+
+void TimingWheel::FreeNode(uint32_t NodeIndex)
+{
+	TimerNode& node = Nodes[NodeIndex];
+	node.bUsed = false;
+	node.Timer.Context.reset();
+
+	FreeNodes.push_back(NodeIndex);
+	TimerNum--;
+}
+
+void TimingWheel::Cascade(uint32_t Slot)
+{
+	uint32_t nodeIndex = SlotHeads[Slot];
+	SlotHeads[Slot] = SlotTails[Slot] = TIMING_WHEEL_NONE;
+
+	while (nodeIndex != TIMING_WHEEL_NONE)
+	{
+		uint32_t next = Nodes[nodeIndex].Next;
+		Schedule(nodeIndex);
+		nodeIndex = next;
+	}
+}
+
+void TimingWheel::MoveToDue(uint32_t Slot)
+{
+	uint32_t nodeIndex = SlotHeads[Slot];
+	SlotHeads[Slot] = SlotTails[Slot] = TIMING_WHEEL_NONE;
+
+	while (nodeIndex != TIMING_WHEEL_NONE)
+	{
+		uint32_t next = Nodes[nodeIndex].Next;
+		LinkNode(nodeIndex, TIMING_WHEEL_DUE_SLOT);
+		nodeIndex = next;
+	}
+}
@@ -0,0 +1,116 @@
+#ifndef TIMING_WHEEL_H
+#define TIMING_WHEEL_H
+
+#include "ProxyStructures.h"
+
+#include <memory>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+
+#define TIMING_WHEEL_TICK_MSEC 10
+// Slots of the first level are ticks, each slot of a higher level spans a whole lower level.
+#define TIMING_WHEEL_ROOT_BITS 8
+#define TIMING_WHEEL_LEVEL_BITS 6
+#define TIMING_WHEEL_LEVEL_NUM 4
+
+class ProxyContext;
+
+struct LoopTimer
+{
+	uint64_t Id{0};
+
+	std::weak_ptr<ProxyContext> Context;
+
+	ETimerType Type{ETimerType::ConnectTimeout};
+};
+
+/**
+* Hierarchical timing wheel of one event loop, adding and cancelling a timer is O(1).
+* Timers further away wait in coarse slots and cascade down as the wheel turns,
+* delays beyond the last level (about 7 days) are clamped to it.
+* Never fires early, a timer is due at most one tick late.
+*/
+class TimingWheel
+{
+public:
+	TimingWheel();
+
+	virtual ~TimingWheel();
+
+	/**
+	* Add a timer due after the delay, Timer.Id is set to its id.
+	* @return Timer id, never 0.
+	*/
+	virtual uint64_t Add(int DelayMsec, LoopTimer& Timer);
+
+	// Cancel a pending or due timer, unknown ids are ignored.
+	virtual void Cancel(uint64_t TimerId);
+
+	// Turn the wheel up to Now, the timers which are due move to the due list.
+	virtual void Advance(std::chrono::steady_clock::time_point Now);
+
+	// Take the next due timer, one cancelled by the handler of an earlier one isn't returned.
+	virtual bool PopDue(LoopTimer& Timer);
+
+	// Milliseconds until the wheel has to turn again, at most MaxMsec.
+	virtual int GetWaitTimeout(std::chrono::steady_clock::time_point Now, int MaxMsec) const;
+
+	virtual void Clear();
+
+	virtual inline size_t GetTimerNum() const { return TimerNum; }
+
+protected:
+	struct TimerNode
+	{
+		LoopTimer Timer;
+
+		uint64_t ExpireTick{0};
+
+		// Neighbours in the list of the slot
+		uint32_t Prev{0};
+		uint32_t Next{0};
+
+		uint32_t Slot{0};
+
+		// Tells the ids of a reused node apart
+		uint32_t Generation{0};
+
+		bool bUsed{false};
+	};
+
+	virtual uint64_t GetTick(std::chrono::steady_clock::time_point Time) const;
+
+	// Put a node in the slot its expire tick falls in, relative to the current tick.
+	virtual void Schedule(uint32_t NodeIndex);
+
+	virtual void LinkNode(uint32_t NodeIndex, uint32_t Slot);
+
+	virtual void UnlinkNode(uint32_t NodeIndex);
+
+	virtual void FreeNode(uint32_t NodeIndex);
+
+	// Move the timers of a higher level slot down to the levels below it.
+	virtual void Cascade(uint32_t Slot);
+
+	// Move a whole slot behind the due list.
+	virtual void MoveToDue(uint32_t Slot);
+
+protected:
+	std::chrono::steady_clock::time_point Origin;
+
+	// Next tick to turn, every tick before it is processed
+	uint64_t CurrentTick;
+
+	std::vector<TimerNode> Nodes;
+	std::vector<uint32_t> FreeNodes;
+
+	// Heads of the slot lists, level by level, the last one is the due list
+	std::vector<uint32_t> SlotHeads;
+	std::vector<uint32_t> SlotTails;
+
+	size_t TimerNum;
+	size_t DueNum;
+};
+
+#endif // !TIMING_WHEEL_H
@@ -0,0 +1,109 @@
+#include "UDPReassembly.h"
+
+#include <cstring>
+#include <algorithm>
+
+std::atomic<size_t> UDPReassembly::TotalBufferSize(0);
+
+UDPReassembly::UDPReassembly()
+	: DataLen(0)
+	, LastPosition(0)
+{
+
+}
+
+UDPReassembly::~UDPReassembly()
+{
+	Release();
+}
+
+EReassemblyResult UDPReassembly::Add(const UDPTravelReply& Fragment, UDPTravelReply& Datagram)
+{
+	uint8_t fragment = static_cast<uint8_t>(Fragment.Fragment);
+	int position = fragment & 0x7F;
+	bool bLast = (fragment & 0x80) != 0;
+
+	// Positions of a sequence only go up, anything else abandons it. Skipped positions are lost fragments.
+	if (IsPending() && (position != LastPosition + 1 || !IsSameDestination(Fragment))) {
+		Reset();
+	}
+
+	if (!IsPending()) {
+		if (position != 1) {
+			return EReassemblyResult::Dropped;
+		}
+
+		Header = Fragment;
+		Header.Fragment = 0;
+		Header.Data = nullptr;
+		Header.DataLen = 0;
+	}
+
+	if (!Append(Fragment.Data, Fragment.DataLen)) {
+		Reset();
+		return EReassemblyResult::Dropped;
+	}
+
+	LastPosition = position;
+	if (!bLast) {
+		return EReassemblyResult::Queued;
+	}
+
+	Datagram = Header;
+	Datagram.Data = Buffer.data();
+	Datagram.DataLen = DataLen;
+
+	// The bytes stay in the buffer until the next sequence overwrites them.
+	DataLen = 0;
+	LastPosition = 0;
+	return EReassemblyResult::Completed;
+}
+
+void UDPReassembly::Reset()
+{
+	DataLen = 0;
+	LastPosition = 0;
+}
+
+void UDPReassembly::Release()
+{
+	Reset();
+
+	if (!Buffer.empty()) {
+		TotalBufferSize.fetch_sub(Buffer.size(), std::memory_order_relaxed);
+		std::vector<char>().swap(Buffer);
+	}
+}
+
+bool UDPReassembly::Append(const char* Data, int Len)
+{
+	if (Len < 0 || Len > UDP_REASSEMBLY_MAX_SIZE - DataLen) {
+		return false;
+	}
+
+	size_t required = static_cast<size_t>(DataLen + Len);
+	if (required > Buffer.size()) {
+		size_t grown = std::min<size_t>(std::max<size_t>({ required, Buffer.size() * 2, UDP_REASSEMBLY_MIN_ALLOC }), UDP_REASSEMBLY_MAX_SIZE);
+		size_t extra = grown - Buffer.size();
+
+		// Reserve the growth first, so concurrent loops can't overshoot the budget together.
+		if (TotalBufferSize.fetch_add(extra, std::memory_order_relaxed) + extra > UDP_REASSEMBLY_MAX_TOTAL) {
+			TotalBufferSize.fetch_sub(extra, std::memory_order_relaxed);
+			return false;
+		}
+
+		Buffer.resize(grown);
+	}
+
+	std::memcpy(Buffer.data() + DataLen, Data, static_cast<size_t>(Len));
+	DataLen += Len;
+	return true;
+}
+
+bool UDPReassembly::IsSameDestination(const UDPTravelReply& Fragment) const
+{
+	return Fragment.AddressType == Header.AddressType &&
+		Fragment.BindAddressLen == Header.BindAddressLen &&
+		std::memcmp(Fragment.BindAddress, Header.BindAddress, static_cast<size_t>(Header.BindAddressLen)) == 0 &&
+		std::memcmp(Fragment.BindPort, Header.BindPort, 2) == 0;
+}
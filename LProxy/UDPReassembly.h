@@ -0,0 +1,72 @@
+#ifndef UDP_REASSEMBLY_H
+#define UDP_REASSEMBLY_H
+
+#include "ProxyStructures.h"
+
+#include <atomic>
+#include <vector>
+#include <cstddef>
+
+enum class EReassemblyResult
+{
+	// The fragment is queued, the sequence isn't complete yet.
+	Queued,
+
+	// The fragment ended its sequence, the whole datagram is ready.
+	Completed,
+
+	// The fragment doesn't fit any sequence or the memory budget, it's dropped.
+	Dropped,
+};
+
+/**
+* Reassembly queue of the fragmented datagrams of one UDP association, RFC 1928 section 7.
+* Only one sequence is reassembled at a time, a fragment whose position isn't the next one abandons it.
+* The buffer grows with the sequence up to the largest UDP payload,
+* the buffers of all associations together never exceed UDP_REASSEMBLY_MAX_TOTAL.
+*/
+class UDPReassembly
+{
+public:
+	UDPReassembly();
+
+	virtual ~UDPReassembly();
+
+	/**
+	* @param Datagram	The whole datagram when completed, its data stays valid until the next fragment is added.
+	*/
+	virtual EReassemblyResult Add(const UDPTravelReply& Fragment, UDPTravelReply& Datagram);
+
+	// Abandon the current sequence, the buffer is kept for the next one.
+	virtual void Reset();
+
+	// Abandon the current sequence and give the buffer back to the budget.
+	virtual void Release();
+
+	virtual inline bool IsPending() const { return LastPosition != 0; }
+
+	// Position of the last queued fragment, 0 when no sequence is pending.
+	virtual inline int GetPosition() const { return LastPosition; }
+
+	virtual inline bool IsReassembled(const char* Data) const { return !Buffer.empty() && Data == Buffer.data(); }
+
+	static inline size_t GetTotalBufferSize() { return TotalBufferSize.load(std::memory_order_relaxed); }
+
+protected:
+	virtual bool Append(const char* Data, int Len);
+
+	virtual bool IsSameDestination(const UDPTravelReply& Fragment) const;
+
+protected:
+	static std::atomic<size_t> TotalBufferSize;
+
+	std::vector<char> Buffer;
+	int DataLen;
+
+	int LastPosition;
+
+	// Address fields of the first fragment, the whole datagram goes there.
+	UDPTravelReply Header;
+};
+
+#endif // !UDP_REASSEMBLY_H
@@ -0,0 +1,417 @@
+// Renders binary log segments of LProxy as text or JSON lines.
+// Usage: LogDecoder [--json] <segment.blog>...
+
+#include "../LProxy/BinaryLog.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iterator>
+#include <unordered_map>
+
+struct FormatDefinition
+{
+	std::string Signature;
+
+	std::string Format;
+};
+
+// One decoded argument, Text keeps strings, the numeric fields the rest.
+struct DecodedArg
+{
+	char Code{0};
+
+	std::string Text;
+
+	long long Signed{0};
+	unsigned long long Unsigned{0};
+	double Float{0.0};
+};
+
+static const char* GetLevelName(int Level)
+{
+	static const char* LevelNames[] = { "Display", "Log", "Warning", "Error", "Fatal" };
+	return (Level >= 0 && Level < 5) ? LevelNames[Level] : "(null)";
+}
+
+static bool ReadArgs(const std::string& Signature, const char* Data, size_t Size, std::vector<DecodedArg>& Args)
+{
+	size_t offset(0);
+
+	for (char code : Signature)
+	{
+		DecodedArg arg;
+		arg.Code = code;
+
+		size_t width(0);
+		switch (code)
+		{
+		case 's':
+		{
+			const void* end = std::memchr(Data + offset, '\0', Size - offset);
+			if (end == nullptr) {
+				return false;
+			}
+
+			arg.Text.assign(Data + offset, static_cast<const char*>(end));
+			offset += arg.Text.size() + 1;
+			Args.push_back(arg);
+			continue;
+		}
+		case 'b': case 'B': width = 1; break;
+		case 'h': case 'H': width = 2; break;
+		case 'i': case 'I': case 'f': case 'q': width = 4; break;
+		case 'l': case 'L': case 'd': case 'p': width = 8; break;
+		default:
+			return false;
+		}
+
+		if (Size - offset < width) {
+			return false;
+		}
+
+		const char* raw = Data + offset;
+		offset += width;
+
+		switch (code)
+		{
+		case 'b': { int8_t value; std::memcpy(&value, raw, width); arg.Signed = value; break; }
+		case 'B': { uint8_t value; std::memcpy(&value, raw, width); arg.Unsigned = value; break; }
+		case 'h': { int16_t value; std::memcpy(&value, raw, width); arg.Signed = value; break; }
+		case 'H': { uint16_t value; std::memcpy(&value, raw, width); arg.Unsigned = value; break; }
+		case 'i': { int32_t value; std::memcpy(&value, raw, width); arg.Signed = value; break; }
+		case 'I': case 'q': { uint32_t value; std::memcpy(&value, raw, width); arg.Unsigned = value; break; }
+		case 'l': { int64_t value; std::memcpy(&value, raw, width); arg.Signed = value; break; }
+		case 'L': case 'p': { uint64_t value; std::memcpy(&value, raw, width); arg.Unsigned = value; break; }
+		case 'f': { float value; std::memcpy(&value, raw, width); arg.Float = value; break; }
+		case 'd': { double value; std::memcpy(&value, raw, width); arg.Float = value; break; }
+		}
+
+		if (code == 'b' || code == 'h' || code == 'i' || code == 'l') {
+			arg.Unsigned = static_cast<unsigned long long>(arg.Signed);
+		}
+		else if (code != 'f' && code != 'd') {
+			arg.Signed = static_cast<long long>(arg.Unsigned);
+		}
+
+		Args.push_back(arg);
+	}
+
+	return true;
+}
+
+/**
+* Render a printf format with decoded arguments, one conversion at a time.
+* Length modifiers of the format are replaced by the ones matching the stored width.
+*/
+static std::string RenderMessage(const std::string& Format, const std::vector<DecodedArg>& Args)
+{
+	std::string message;
+	size_t argIndex(0);
+
+	for (size_t index = 0; index < Format.size(); index++)
+	{
+		if (Format[index] != '%') {
+			message.push_back(Format[index]);
+			continue;
+		}
+
+		if (index + 1 < Format.size() && Format[index + 1] == '%') {
+			message.push_back('%');
+			index++;
+			continue;
+		}
+
+		size_t specEnd = Format.find_first_of("diouxXeEfFgGaAcsp", index + 1);
+		if (specEnd == std::string::npos || argIndex >= Args.size()) {
+			message.append(Format, index, std::string::npos);
+			break;
+		}
+
+		std::string spec;
+		for (size_t specIndex = index; specIndex < specEnd; specIndex++)
+		{
+			if (std::strchr("hljztL", Format[specIndex]) == nullptr) {
+				spec.push_back(Format[specIndex]);
+			}
+		}
+
+		char conversion = Format[specEnd];
+		const DecodedArg& arg = Args[argIndex++];
+		char buffer[512];
+
+		if (arg.Code == 's') {
+			spec.push_back('s');
+			std::snprintf(buffer, sizeof(buffer), spec.c_str(), arg.Text.c_str());
+		}
+		else if (std::strchr("eEfFgGaA", conversion) != nullptr) {
+			spec.push_back(conversion);
+			double value = (arg.Code == 'f' || arg.Code == 'd') ? arg.Float : static_cast<double>(arg.Signed);
+			std::snprintf(buffer, sizeof(buffer), spec.c_str(), value);
+		}
+		else if (conversion == 'p') {
+			spec.push_back('p');
+			std::snprintf(buffer, sizeof(buffer), spec.c_str(), reinterpret_cast<void*>(static_cast<uintptr_t>(arg.Unsigned)));
+		}
+		else if (conversion == 'c') {
+			spec.push_back('c');
+			std::snprintf(buffer, sizeof(buffer), spec.c_str(), static_cast<int>(arg.Signed));
+		}
+		else if (conversion == 's') {
+			// A number logged with %s, print it instead of following a pointer.
+			std::snprintf(buffer, sizeof(buffer), "%lld", arg.Signed);
+		}
+		else {
+			spec.append("ll");
+			spec.push_back(conversion);
+			if (conversion == 'd' || conversion == 'i') {
+				std::snprintf(buffer, sizeof(buffer), spec.c_str(), arg.Signed);
+			}
+			else {
+				std::snprintf(buffer, sizeof(buffer), spec.c_str(), arg.Unsigned);
+			}
+		}
+
+		message.append(buffer);
+		index = specEnd;
+	}
+
+	return message;
+}
+
+static std::string EscapeJson(const std::string& Text)
+{
+	std::string escaped;
+	for (char character : Text)
+	{
+		switch (character)
+		{
+		case '"': escaped.append("\\\""); break;
+		case '\\': escaped.append("\\\\"); break;
+		case '\n': escaped.append("\\n"); break;
+		case '\r': escaped.append("\\r"); break;
+		case '\t': escaped.append("\\t"); break;
+		default:
+			if (static_cast<unsigned char>(character) < 0x20) {
+				char buffer[8];
+				std::snprintf(buffer, sizeof(buffer), "\\u%04x", static_cast<unsigned>(static_cast<unsigned char>(character)));
+				escaped.append(buffer);
+			}
+			else {
+				escaped.push_back(character);
+			}
+			break;
+		}
+	}
+
+	return escaped;
+}
+
+static std::string FormatTime(const BinaryLogHeader& Header, int64_t Timestamp)
+{
+	long double elapsed = static_cast<long double>(Timestamp - Header.SteadyClock) * Header.SteadyNumerator / Header.SteadyDenominator;
+	int64_t micros = Header.WallClockMicros + static_cast<int64_t>(elapsed * 1000000);
+
+	std::time_t seconds = static_cast<std::time_t>(micros / 1000000);
+	struct tm* time = localtime(&seconds);
+
+	char buffer[64] = { 0 };
+	std::snprintf(buffer, sizeof(buffer), "%d-%02d-%02d-%02d.%02d.%02d.%06d",
+		(int)time->tm_year + 1900, (int)time->tm_mon + 1, (int)time->tm_mday,
+		(int)time->tm_hour, (int)time->tm_min, (int)time->tm_sec, (int)(micros % 1000000));
+
+	return buffer;
+}
+
+static void PrintLine(bool bJson, const std::string& Time, int64_t Timestamp, const char* Level, const std::string& Message, const std::vector<DecodedArg>* Args)
+{
+	if (!bJson) {
+		std::printf("[ %s ][ %s ] : %s\n", Time.c_str(), Level, Message.c_str());
+		return;
+	}
+
+	std::string line = "{\"time\":\"" + Time + "\",\"ticks\":" + std::to_string(Timestamp) + ",\"level\":\"" + Level + "\",\"message\":\"" + EscapeJson(Message) + "\"";
+
+	if (Args != nullptr) {
+		line.append(",\"args\":[");
+		for (size_t index = 0; index < Args->size(); index++)
+		{
+			const DecodedArg& arg = (*Args)[index];
+			if (index > 0) {
+				line.push_back(',');
+			}
+
+			if (arg.Code == 's') {
+				line.append("\"").append(EscapeJson(arg.Text)).append("\"");
+			}
+			else if (arg.Code == 'f' || arg.Code == 'd') {
+				char buffer[64];
+				std::snprintf(buffer, sizeof(buffer), "%.17g", arg.Float);
+				line.append(buffer);
+			}
+			else if (arg.Code == 'b' || arg.Code == 'h' || arg.Code == 'i' || arg.Code == 'l') {
+				line.append(std::to_string(arg.Signed));
+			}
+			else {
+				line.append(std::to_string(arg.Unsigned));
+			}
+		}
+		line.push_back(']');
+	}
+
+	line.push_back('}');
+	std::printf("%s\n", line.c_str());
+}
+
+static bool DecodeSegment(const char* Path, bool bJson)
+{
+	std::ifstream file(Path, std::ios::binary);
+	if (!file) {
+		std::fprintf(stderr, "Open %s failed.\n", Path);
+		return false;
+	}
+
+	std::vector<char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+	BinaryLogHeader header;
+	if (data.size() < sizeof(header)) {
+		std::fprintf(stderr, "%s is not a binary log segment.\n", Path);
+		return false;
+	}
+
+	std::memcpy(&header, data.data(), sizeof(header));
+	if (std::memcmp(header.Magic, BINARY_LOG_MAGIC, sizeof(header.Magic)) != 0 || header.Version != BINARY_LOG_VERSION || header.SteadyDenominator == 0) {
+		std::fprintf(stderr, "%s is not a binary log segment of version %d.\n", Path, BINARY_LOG_VERSION);
+		return false;
+	}
+
+	std::unordered_map<uint32_t, FormatDefinition> formats;
+	size_t offset = sizeof(header);
+
+	while (data.size() - offset >= sizeof(BinaryLogEntry))
+	{
+		BinaryLogEntry entry;
+		std::memcpy(&entry, data.data() + offset, sizeof(entry));
+		offset += sizeof(entry);
+
+		if (entry.Type == static_cast<uint16_t>(EBinaryLogEntry::End)) {
+			break;
+		}
+
+		if (data.size() - offset < entry.Size) {
+			std::fprintf(stderr, "%s ends in the middle of an entry.\n", Path);
+			return false;
+		}
+
+		const char* payload = data.data() + offset;
+		offset += entry.Size;
+
+		switch (static_cast<EBinaryLogEntry>(entry.Type))
+		{
+		case EBinaryLogEntry::Format:
+		{
+			uint32_t formatId(0);
+			if (entry.Size < sizeof(formatId) + 2) {
+				break;
+			}
+
+			std::memcpy(&formatId, payload, sizeof(formatId));
+
+			const char* signature = payload + sizeof(formatId);
+			size_t signatureLen = strnlen(signature, entry.Size - sizeof(formatId));
+			if (sizeof(formatId) + signatureLen + 1 >= entry.Size) {
+				break;
+			}
+
+			const char* format = signature + signatureLen + 1;
+			size_t formatLen = strnlen(format, entry.Size - sizeof(formatId) - signatureLen - 1);
+
+			FormatDefinition& definition = formats[formatId];
+			definition.Signature.assign(signature, signatureLen);
+			definition.Format.assign(format, formatLen);
+			break;
+		}
+		case EBinaryLogEntry::Record:
+		{
+			const size_t headSize = sizeof(uint32_t) * 2 + sizeof(int64_t);
+			if (entry.Size < headSize) {
+				break;
+			}
+
+			uint32_t formatId(0);
+			int64_t timestamp(0);
+			std::memcpy(&formatId, payload, sizeof(formatId));
+			std::memcpy(&timestamp, payload + sizeof(uint32_t) * 2, sizeof(timestamp));
+
+			auto definition = formats.find(formatId);
+			if (definition == formats.end()) {
+				PrintLine(bJson, FormatTime(header, timestamp), timestamp, GetLevelName(entry.Level), "(record of unknown format " + std::to_string(formatId) + ")", nullptr);
+				break;
+			}
+
+			std::vector<DecodedArg> args;
+			if (!ReadArgs(definition->second.Signature, payload + headSize, entry.Size - headSize, args)) {
+				PrintLine(bJson, FormatTime(header, timestamp), timestamp, GetLevelName(entry.Level), "(malformed arguments) " + definition->second.Format, nullptr);
+				break;
+			}
+
+			PrintLine(bJson, FormatTime(header, timestamp), timestamp, GetLevelName(entry.Level), RenderMessage(definition->second.Format, args), &args);
+			break;
+		}
+		case EBinaryLogEntry::Dropped:
+		{
+			int64_t timestamp(0);
+			uint64_t count(0);
+			if (entry.Size < sizeof(timestamp) + sizeof(count)) {
+				break;
+			}
+
+			std::memcpy(&timestamp, payload, sizeof(timestamp));
+			std::memcpy(&count, payload + sizeof(timestamp), sizeof(count));
+
+			PrintLine(bJson, FormatTime(header, timestamp), timestamp, "Warning", std::to_string(count) + " log records dropped, the log ring of their thread was full.", nullptr);
+			break;
+		}
+		default:
+			// Entries of a newer writer are skipped by their size.
+			break;
+		}
+	}
+
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	bool bJson(false);
+	std::vector<const char*> paths;
+
+	for (int index = 1; index < argc; index++)
+	{
+		if (std::strcmp(argv[index], "--json") == 0) {
+			bJson = true;
+		}
+		else {
+			paths.push_back(argv[index]);
+		}
+	}
+
+	if (paths.empty()) {
+		std::fprintf(stderr, "Usage: LogDecoder [--json] <segment%s>...\n", BINARY_LOG_EXT);
+		return 1;
+	}
+
+	int result(0);
+	for (const char* path : paths)
+	{
+		if (!DecodeSegment(path, bJson)) {
+			result = 1;
+		}
+	}
+
+	return result;
+}